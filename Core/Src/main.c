@@ -26,6 +26,7 @@
 #include "sd_driver_read.h"
 #include "sd_driver_write.h"
 #include "sd_driver_erase.h"
+#include "sd_driver_profile.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -35,7 +36,10 @@
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
-
+#ifdef SD_PROFILE
+// Single block reads measured by measure_data_phase()
+#define PROFILE_SECTORS 64U
+#endif
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -47,6 +51,16 @@
 SPI_HandleTypeDef hspi2;
 
 /* USER CODE BEGIN PV */
+#ifdef SD_USE_DMA
+DMA_HandleTypeDef hdma_spi2_rx;
+DMA_HandleTypeDef hdma_spi2_tx;
+#endif
+#ifdef SD_PROFILE
+// SD_PROFILE_DATA of the measurement in core cycles (DWT), to be read
+// with the debugger
+volatile uint32_t profile_data_mean = 0;
+volatile uint32_t profile_data_p99 = 0;
+#endif
 
 /* USER CODE END PV */
 
@@ -55,6 +69,12 @@ void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
 static void MX_SPI2_Init(void);
 /* USER CODE BEGIN PFP */
+#ifdef SD_USE_DMA
+static void MX_DMA_Init(void);
+#endif
+#ifdef SD_PROFILE
+static sd_error measure_data_phase(SPI_HandleTypeDef *hspi, uint8_t *data);
+#endif
 // HAL_StatusTypeDef receive_byte(uint8_t* data);
 // HAL_StatusTypeDef receive_bytes(uint8_t* data, const uint8_t size);
 // HAL_StatusTypeDef transmit_bytes(const uint8_t* data, const uint8_t size);
@@ -64,7 +84,27 @@ static void MX_SPI2_Init(void);
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
+#ifdef SD_PROFILE
+// Times the data blocks of PROFILE_SECTORS single block reads. Build it
+// with and without SD_TRANSPORT_LL to compare the transports
+static sd_error measure_data_phase(SPI_HandleTypeDef *hspi, uint8_t *data)
+{
+  sd_error status = SD_OK;
+  sd_profile_stats stats;
+
+  sd_card_profile_reset_stats();
+  for (uint32_t i = 0; i < PROFILE_SECTORS; i++)
+    status |= sd_card_read_data(hspi, i, data, 512);
+
+  sd_card_profile_get_stats(&stats);
+  sd_profile_histogram *data_phase = &stats.phases[SD_PROFILE_DATA];
+  if (data_phase->count)
+    profile_data_mean = (uint32_t)(data_phase->total / data_phase->count);
+  profile_data_p99 = sd_card_profile_get_percentile(data_phase, 99);
 
+  return status;
+}
+#endif
 /* USER CODE END 0 */
 
 /**
@@ -90,6 +130,10 @@ int main(void)
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
+#ifdef SD_USE_DMA
+  // DMA must be clocked before SPI MSP initialization links the channels
+  MX_DMA_Init();
+#endif
 
   /* USER CODE END SysInit */
 
@@ -128,6 +172,11 @@ int main(void)
   if (status || !((data[0] == data[1]) && (data[1023] == 0xff)))
     Error_Handler();
 
+#ifdef SD_PROFILE
+  if (measure_data_phase(&hspi2, data))
+    Error_Handler();
+#endif
+
   while (1)
   {
     /* USER CODE END WHILE */
@@ -245,6 +294,23 @@ static void MX_GPIO_Init(void)
 }
 
 /* USER CODE BEGIN 4 */
+#ifdef SD_USE_DMA
+/**
+  * @brief DMA Initialization Function. SPI2_RX - DMA1 Channel 4,
+  * SPI2_TX - DMA1 Channel 5
+  * @param None
+  * @retval None
+  */
+static void MX_DMA_Init(void)
+{
+  __HAL_RCC_DMA1_CLK_ENABLE();
+
+  HAL_NVIC_SetPriority(DMA1_Channel4_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel4_IRQn);
+  HAL_NVIC_SetPriority(DMA1_Channel5_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+}
+#endif
 
 /* USER CODE END 4 */
 
@@ -57,6 +57,11 @@
 /* External variables --------------------------------------------------------*/
 
 /* USER CODE BEGIN EV */
+#ifdef SD_USE_DMA
+extern DMA_HandleTypeDef hdma_spi2_rx;
+extern DMA_HandleTypeDef hdma_spi2_tx;
+extern SPI_HandleTypeDef hspi2;
+#endif
 
 /* USER CODE END EV */
 
@@ -199,5 +204,30 @@ void SysTick_Handler(void)
 /******************************************************************************/
 
 /* USER CODE BEGIN 1 */
+#ifdef SD_USE_DMA
+/**
+  * @brief This function handles DMA1 channel4 global interrupt (SPI2_RX).
+  */
+void DMA1_Channel4_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_spi2_rx);
+}
+
+/**
+  * @brief This function handles DMA1 channel5 global interrupt (SPI2_TX).
+  */
+void DMA1_Channel5_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_spi2_tx);
+}
+
+/**
+  * @brief This function handles SPI2 global interrupt.
+  */
+void SPI2_IRQHandler(void)
+{
+  HAL_SPI_IRQHandler(&hspi2);
+}
+#endif
 
 /* USER CODE END 1 */
@@ -7,6 +7,29 @@ Original code: https://github.com/MatveyMelnikov/CRC
 
 #include <stdint.h>
 
+/*
+* CRC16 implementations. Define CRC_BUFFER_CRC16_METHOD at build time
+* to choose between speed and flash usage. All of them give the same result.
+* No RAM is used for tables: they are placed in flash
+*/
+#define CRC_BUFFER_CRC16_BITWISE 0 // Bit at a time, no tables
+#define CRC_BUFFER_CRC16_NIBBLE 1 // 4 bits at a time, 32 bytes of tables
+#define CRC_BUFFER_CRC16_BYTE 2 // 8 bits at a time, 512 bytes of tables
+#define CRC_BUFFER_CRC16_SLICE_4 3 // 32 bits at a time, 2 KBytes of tables
+#define CRC_BUFFER_CRC16_SLICE_8 4 // 64 bits at a time, 4 KBytes of tables
+
+#ifndef CRC_BUFFER_CRC16_METHOD
+#define CRC_BUFFER_CRC16_METHOD CRC_BUFFER_CRC16_BYTE
+#endif
+
+/*
+* CRC7 is calculated a byte at a time using a 256 byte table in flash.
+* Define CRC_BUFFER_CRC7_TABLE as 0 to return to the bit at a time version
+*/
+#ifndef CRC_BUFFER_CRC7_TABLE
+#define CRC_BUFFER_CRC7_TABLE 1
+#endif
+
 typedef uint8_t crc_buffer_7;
 typedef uint16_t crc_buffer_16;
 
@@ -45,4 +68,22 @@ crc_buffer_calculate_crc_16(
 	const uint16_t data_length
 );
 
+/*
+* Streaming CRC16: the data can be passed in parts of any length as it 
+* arrives. init + update (one or more times) + finalize gives the same
+* result as crc_buffer_calculate_crc_16
+*/
+void
+crc_buffer_init_crc_16(crc_buffer_16* buffer);
+
+void
+crc_buffer_update_crc_16(
+	crc_buffer_16* buffer,
+	const uint8_t* data,
+	const uint16_t data_length
+);
+
+crc_16_result
+crc_buffer_finalize_crc_16(crc_buffer_16* buffer);
+
 #endif
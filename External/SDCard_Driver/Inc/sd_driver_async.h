@@ -0,0 +1,75 @@
+/*
+Non-blocking operations: a request is submitted and then carried out step
+by step by sd_card_async_process, which never waits for the card
+*/
+
+#ifndef SD_DRIVER_ASYNC_H
+#define SD_DRIVER_ASYNC_H
+
+#include "sd_driver_secondary.h"
+
+// Structs -------------------------------------------------------------------
+
+typedef enum
+{
+  SD_ASYNC_READ = 0x0U,
+  SD_ASYNC_WRITE,
+  SD_ASYNC_ERASE,
+  SD_ASYNC_RESET
+} sd_async_operation;
+
+typedef enum
+{
+  SD_ASYNC_IDLE = 0x0U, // Not submitted
+  SD_ASYNC_IN_PROGRESS,
+  SD_ASYNC_DONE // Status holds the result
+} sd_async_state;
+
+typedef struct sd_async_request sd_async_request;
+
+// Called by sd_card_async_process when the request is done. A new request
+// can be submitted from the callback
+typedef void (*sd_async_callback)(sd_async_request *const request);
+
+struct sd_async_request
+{
+  sd_async_operation operation;
+  // Read and write: address of the first block. Erase: first block
+  uint32_t address;
+  // Erase: last block
+  uint32_t end_address;
+  uint8_t *data;
+  uint32_t block_length;
+  // One block - CMD17/CMD24, several - CMD18/CMD25
+  uint32_t number_of_blocks;
+  // Reset
+  bool crc_enable;
+  sd_async_callback callback; // Can be NULL
+  void *context;
+
+  // Filled by the driver
+  volatile sd_async_state state;
+  sd_error status;
+  uint32_t blocks_done;
+};
+
+// Functions -----------------------------------------------------------------
+
+// The request must stay valid until it is done. Only one request is carried
+// out at a time: SD_BUSY is returned while another one is in progress.
+// Blocking driver functions must not be called during the request
+sd_error sd_card_async_submit(
+  SPI_HandleTypeDef *const hspi,
+  sd_async_request *const request
+);
+
+// Advances the current request as far as possible without waiting.
+// Call it from the main loop or from a timer interrupt (its priority must
+// be lower than the SysTick one, HAL timeouts rely on it). With SD_USE_DMA
+// the data blocks move in the background between the calls, otherwise
+// each block is transferred within one call
+void sd_card_async_process(void);
+
+bool sd_card_async_is_busy(void);
+
+#endif
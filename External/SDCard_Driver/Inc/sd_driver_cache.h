@@ -0,0 +1,107 @@
+/*
+Sector cache with LRU eviction: read cache and write-back buffer.
+Enabled by defining SD_CACHE_SIZE (number of cached 512-byte sectors)
+at build time, see Makefile
+*/
+
+#ifndef SD_DRIVER_CACHE_H
+#define SD_DRIVER_CACHE_H
+
+#include "sd_driver_secondary.h"
+
+// Defines -------------------------------------------------------------------
+
+// Only blocks of this length are cached
+#define SD_CACHE_BLOCK_SIZE 512U
+
+// Structs -------------------------------------------------------------------
+
+typedef struct
+{
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t evictions; // Valid sectors replaced by new ones
+  // Write-back
+  uint32_t buffered_writes; // Calls of sd_card_cache_write_back
+  uint32_t absorbed_writes; // Writes to a sector that was already dirty
+  uint32_t flushed_blocks; // Program cycles actually issued
+  uint32_t flush_runs; // CMD24/CMD25 issued by flushes
+} sd_cache_stats;
+
+// Functions -----------------------------------------------------------------
+
+// Single block reads (sd_card_read_data) go through the cache. Multiple
+// block reads bypass it (dirty sectors are still copied into their data),
+// so streamed data does not push out metadata.
+// Writes through the driver update cached copies, failed writes and
+// erases drop them
+
+// true - the block was in the cache and is copied to data
+bool sd_card_cache_read(
+  const uint32_t address,
+  uint8_t *const data,
+  const uint32_t block_length
+);
+
+// Puts a block read from the card into the cache. It is not cached if
+// all sectors are dirty
+void sd_card_cache_store(
+  const uint32_t address,
+  const uint8_t *const data,
+  const uint32_t block_length
+);
+
+// Copies dirty sectors over the blocks just read from the card
+void sd_card_cache_overlay(
+  const uint32_t address,
+  uint8_t *const data,
+  const uint32_t block_length,
+  const uint32_t number_of_blocks
+);
+
+// Called after writing number_of_blocks blocks with the given status
+void sd_card_cache_write(
+  const uint32_t address,
+  const uint8_t *const data,
+  const uint32_t block_length,
+  const uint32_t number_of_blocks,
+  const sd_error status
+);
+
+// Drops the blocks (dirty ones too) from start_address up to
+// (not including) end_address
+void sd_card_cache_invalidate(
+  const uint32_t start_address,
+  const uint32_t end_address
+);
+
+// Dirty sectors are lost: flush before a reset
+void sd_card_cache_invalidate_all(void);
+
+// Write-back: the block is kept in the cache and written by the next
+// flush, repeated updates of a sector cost one program cycle.
+// force_unit_access - the block is written to the card before the return
+// (other dirty sectors stay in the cache). A dirty sector is written
+// by a flush when all sectors are dirty and a new one is needed
+sd_error sd_card_cache_write_back(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  const uint8_t *const data,
+  const uint32_t block_length,
+  const bool force_unit_access
+);
+
+// Writes dirty sectors in address order, adjacent ones within one CMD25.
+// Sectors separated by a barrier are written in the order of barriers.
+// On error the rest of the sectors stay dirty
+sd_error sd_card_cache_flush(SPI_HandleTypeDef *const hspi);
+
+// Write-back blocks passed before the barrier reach the card before
+// the ones passed after it. Nothing is written by the call itself
+void sd_card_cache_barrier(void);
+
+void sd_card_cache_get_stats(sd_cache_stats *const stats);
+
+void sd_card_cache_reset_stats(void);
+
+#endif
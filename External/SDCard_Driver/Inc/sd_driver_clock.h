@@ -0,0 +1,39 @@
+/*
+SPI clock management: slow identification, then the fastest clock allowed
+by the card and the peripheral bus
+*/
+
+#ifndef SD_DRIVER_CLOCK_H
+#define SD_DRIVER_CLOCK_H
+
+#include "sd_driver_secondary.h"
+
+// Defines -------------------------------------------------------------------
+
+// Card identification must be done at no more than 400 kHz
+#define SD_IDENTIFICATION_CLOCK 400000U
+
+// Number of CRC errors in a row after which the clock is lowered by one step
+#define SD_CLOCK_CRC_ERROR_LIMIT 3U
+
+// Functions -----------------------------------------------------------------
+
+// Sets the fastest SPI clock (in Hz) that does not exceed max_clock.
+// With the STM32 transports the clock is derived from PCLK1 (SPI2, SPI3)
+// or PCLK2 (SPI1)
+sd_error sd_card_set_max_clock(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t max_clock
+);
+
+// Current SPI clock in Hz
+uint32_t sd_card_get_clock(SPI_HandleTypeDef *const hspi);
+
+// Called for every received or transmitted data block. After
+// SD_CLOCK_CRC_ERROR_LIMIT CRC errors in a row the clock is halved
+void sd_card_clock_report_crc(
+  SPI_HandleTypeDef *const hspi,
+  const bool crc_error
+);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+Coalescing of adjacent single block writes into CMD25 runs. Enabled by
+defining SD_COALESCE_BLOCKS (maximum number of 512-byte blocks held) at
+build time, see Makefile
+*/
+
+#ifndef SD_DRIVER_COALESCE_H
+#define SD_DRIVER_COALESCE_H
+
+#include "sd_driver_secondary.h"
+
+// Defines -------------------------------------------------------------------
+
+// Only blocks of this length are held
+#define SD_COALESCE_BLOCK_SIZE 512U
+
+// Longest time a block can be held (ms), checked by the coalescing calls
+#ifndef SD_COALESCE_TIMEOUT
+#define SD_COALESCE_TIMEOUT 10U
+#endif
+
+// Structs -------------------------------------------------------------------
+
+typedef struct
+{
+  uint32_t writes; // Blocks passed to sd_card_coalesce_write
+  uint32_t runs; // CMD24 and CMD25 issued
+  uint32_t full_runs; // Runs written because SD_COALESCE_BLOCKS were held
+  uint32_t timeouts; // Runs written because of SD_COALESCE_TIMEOUT
+} sd_coalesce_stats;
+
+// Functions -----------------------------------------------------------------
+
+// The block is copied and held while the next writes continue it. The held
+// run is written by sd_card_write_multiple_data when a write does not
+// continue it, when SD_COALESCE_BLOCKS are held, when it is older than
+// SD_COALESCE_TIMEOUT or before any other command. An error of a run
+// written in the background is returned by the next call
+sd_error sd_card_coalesce_write(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  const uint8_t *const data,
+  const uint32_t block_length
+);
+
+// Writes the held run if it is older than SD_COALESCE_TIMEOUT.
+// Call it periodically, e.g. from the main loop
+sd_error sd_card_coalesce_poll(void);
+
+// Writes the held run now
+sd_error sd_card_coalesce_flush(void);
+
+// Writes the held run, its error is returned by the next call above.
+// Called by sd_card_select before every command
+void sd_card_coalesce_release(void);
+
+void sd_card_coalesce_get_stats(sd_coalesce_stats *const stats);
+
+void sd_card_coalesce_reset_stats(void);
+
+#endif
@@ -2,8 +2,8 @@
 SD card erase functions
 */
 
-#ifndef SD_DRIVER_READ_H
-#define SD_DRIVER_READ_H
+#ifndef SD_DRIVER_ERASE_H
+#define SD_DRIVER_ERASE_H
 
 #include "sd_driver_secondary.h"
 
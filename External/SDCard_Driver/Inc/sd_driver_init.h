@@ -7,6 +7,34 @@ Initializing SD cards of different versions and sizes
 
 #include "sd_driver_secondary.h"
 
+// Defines -------------------------------------------------------------------
+
+// Switch function status (CMD6 response) takes 64 bytes
+#define SD_SWITCH_STATUS_SIZE 64U
+
+// SCR register (ACMD51 data) takes 8 bytes
+#define SD_SCR_SIZE 8U
+
+// SD status (ACMD13 data) takes 64 bytes
+#define SD_SSR_SIZE 64U
+
+// Card initialization shall be completed within 1 second from the first
+// ACMD41 (ms)
+#define SD_INITIALIZATION_TIMEOUT 1000U
+
+// Maximum clock of a card in high-speed mode (Hz)
+#define SD_HIGH_SPEED_CLOCK 50000000U
+
+// Macros --------------------------------------------------------------------
+
+// Class 10 - switch function commands
+#define IS_SWITCH_FUNCTION_SUPPORTED(info) \
+  (bool)((info).command_classes & (1 << 10))
+
+// CMD_SUPPORT, bit 33 of the SCR - SET_BLOCK_COUNT (CMD23)
+#define IS_BLOCK_COUNT_SUPPORTED(scr) \
+  (bool)((scr)[3] & 0x02)
+
 // Variables -----------------------------------------------------------------
 
 // Displaying the status of the SD card: its version and size
@@ -22,14 +50,63 @@ typedef struct
   uint16_t max_data_block_size; // In bytes
   bool partial_blocks_allowed;
   uint32_t size; // For version 2 - KBytes, for version 1 - bytes
+  float access_time; // ns, TAAC
+  uint32_t access_clocks; // SPI clock cycles, NSAC * 100
+  uint8_t write_speed_factor; // Write to read time ratio, 2^R2W_FACTOR
 } sd_info;
 
 // Functions -----------------------------------------------------------------
 
 sd_error sd_card_reset(SPI_HandleTypeDef *const hspi, const bool crc_enable);
 
+// Steps of sd_card_reset for callers that must not block.
+// Start: identification up to the first ACMD41
+sd_error sd_card_reset_start(
+  SPI_HandleTypeDef *const hspi,
+  const bool crc_enable
+);
+
+// One ACMD41. SD_BUSY - the card is still initializing, the call must be
+// repeated (no longer than SD_INITIALIZATION_TIMEOUT)
+sd_error sd_card_reset_poll(SPI_HandleTypeDef *const hspi);
+
+// Capacity, clock and the result in sd_card_status. Status is the result
+// of the previous steps
+sd_error sd_card_reset_finish(
+  SPI_HandleTypeDef *const hspi,
+  sd_error status
+);
+
 sd_error sd_card_get_common_info(
   SPI_HandleTypeDef *const hspi, sd_info *const info
 );
 
+// ACMD51. SCR takes SD_SCR_SIZE bytes
+sd_error sd_card_get_scr(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t *const scr
+);
+
+// ACMD13. SD status takes SD_SSR_SIZE bytes
+sd_error sd_card_get_ssr(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t *const ssr
+);
+
+// CMD6. In check mode (switch = false) only queries the function.
+// Group - 1..6, function - 0..15. Status takes SD_SWITCH_STATUS_SIZE bytes
+sd_error sd_card_switch_function(
+  SPI_HandleTypeDef *const hspi,
+  const bool switch_mode,
+  const uint8_t group,
+  const uint8_t function,
+  uint8_t *const status
+);
+
+// Selects access mode 1 (high speed) if the card supports it and raises
+// the SPI clock accordingly. Info must be received by sd_card_get_common_info
+sd_error sd_card_switch_high_speed(
+  SPI_HandleTypeDef *const hspi, const sd_info *const info
+);
+
 #endif
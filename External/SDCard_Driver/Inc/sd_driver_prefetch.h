@@ -0,0 +1,53 @@
+/*
+Sequential read-ahead for single block reads. Enabled by defining
+SD_PREFETCH_DEPTH (number of 512-byte blocks read ahead) at build time,
+see Makefile
+*/
+
+#ifndef SD_DRIVER_PREFETCH_H
+#define SD_DRIVER_PREFETCH_H
+
+#include "sd_driver_secondary.h"
+
+// Defines -------------------------------------------------------------------
+
+// Only blocks of this length are read ahead
+#define SD_PREFETCH_BLOCK_SIZE 512U
+
+// Number of sequential reads after which the CMD18 stream is opened
+#define SD_PREFETCH_TRIGGER 2U
+
+// Structs -------------------------------------------------------------------
+
+typedef struct
+{
+  uint32_t streams; // Opened CMD18
+  uint32_t prefetched; // Blocks read ahead of a request
+  uint32_t used; // Read ahead blocks that were requested later
+} sd_prefetch_stats;
+
+// Functions -----------------------------------------------------------------
+
+// sd_card_read_data detects sequential access: after SD_PREFETCH_TRIGGER
+// reads of adjacent blocks, CMD18 stays open and the next
+// SD_PREFETCH_DEPTH blocks are read into a ring at once. Any other command
+// closes the stream (CMD12) and drops the ring, so the card stays
+// selected only while blocks are read one after another
+
+// true - the request is served by the stream, its result is in status
+bool sd_card_prefetch_read(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  uint8_t *const data,
+  const uint32_t block_length,
+  sd_error *const status
+);
+
+// Closes the stream and drops the blocks read ahead
+void sd_card_prefetch_stop(void);
+
+void sd_card_prefetch_get_stats(sd_prefetch_stats *const stats);
+
+void sd_card_prefetch_reset_stats(void);
+
+#endif
@@ -0,0 +1,91 @@
+/*
+Latency histograms of the transfer phases: command, R1, token, data, CRC
+and busy. Enabled by defining SD_PROFILE at build time, see Makefile.
+Without it the recording macros are empty
+*/
+
+#ifndef SD_DRIVER_PROFILE_H
+#define SD_DRIVER_PROFILE_H
+
+#include "sd_driver_secondary.h"
+
+// Defines -------------------------------------------------------------------
+
+// Bucket i holds durations from 2^(i-1) to 2^i - 1 timestamp ticks
+// (bucket 0 - zero), the last one also holds the longer ones
+#define SD_PROFILE_BUCKETS 32U
+
+#ifdef SD_PROFILE
+
+// Declares the timestamp the next phase is measured from
+#define SD_PROFILE_START(timestamp) \
+  uint32_t timestamp = SD_GET_TIMESTAMP()
+
+// Records the time since the timestamp, which then moves to the end
+// of the phase
+#define SD_PROFILE_RECORD(phase, timestamp) \
+  timestamp = sd_card_profile_record(phase, timestamp)
+
+#else
+
+#define SD_PROFILE_START(timestamp)
+#define SD_PROFILE_RECORD(phase, timestamp)
+
+#endif
+
+// Structs -------------------------------------------------------------------
+
+typedef enum
+{
+  SD_PROFILE_COMMAND = 0, // Command frame sent
+  SD_PROFILE_R1, // Wait for R1
+  // Wait for the start token of a read block. For a written block -
+  // its CRC sent and the data response token received
+  SD_PROFILE_TOKEN,
+  // Data block moved. With SD_USE_DMA - the wait for the end of the
+  // transfer, the CRC of the part received meanwhile included
+  SD_PROFILE_DATA,
+  // CRC16 calculated, for a read block also received and compared
+  SD_PROFILE_CRC,
+  SD_PROFILE_BUSY, // Busy after a write, stop or erase
+  SD_PROFILE_PHASES
+} sd_profile_phase;
+
+// Durations in timestamp ticks (core cycles for the HAL and LL transports)
+typedef struct
+{
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+  uint32_t buckets[SD_PROFILE_BUCKETS];
+} sd_profile_histogram;
+
+typedef struct
+{
+  uint32_t frequency; // Of the timestamp (Hz)
+  sd_profile_histogram phases[SD_PROFILE_PHASES];
+} sd_profile_stats;
+
+// Functions -----------------------------------------------------------------
+
+// Adds the time from start_timestamp to now, returns now.
+// Used through SD_PROFILE_RECORD
+uint32_t sd_card_profile_record(
+  const sd_profile_phase phase,
+  const uint32_t start_timestamp
+);
+
+// Copy of the histograms collected since the last reset
+void sd_card_profile_get_stats(sd_profile_stats *const stats);
+
+void sd_card_profile_reset_stats(void);
+
+// Upper bound of the bucket the given share (%) of the durations
+// falls into, e.g. 99 - the 99th percentile in timestamp ticks
+uint32_t sd_card_profile_get_percentile(
+  const sd_profile_histogram *const histogram,
+  const uint8_t percent
+);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+Request queue in front of the driver. Pending reads and writes are sorted
+by address (elevator order) and adjacent ones are merged into one
+CMD18/CMD25 run
+*/
+
+#ifndef SD_DRIVER_QUEUE_H
+#define SD_DRIVER_QUEUE_H
+
+#include "sd_driver_secondary.h"
+
+// Defines -------------------------------------------------------------------
+
+// Maximum number of pending requests
+#define SD_QUEUE_SIZE 16U
+
+// Structs -------------------------------------------------------------------
+
+typedef enum
+{
+  SD_QUEUE_READ = 0x0U,
+  SD_QUEUE_WRITE
+} sd_queue_operation;
+
+typedef struct sd_queue_request sd_queue_request;
+
+// Called when the run containing the request is over. A new request
+// can be submitted from the callback
+typedef void (*sd_queue_callback)(sd_queue_request *const request);
+
+struct sd_queue_request
+{
+  sd_queue_operation operation;
+  // SDSC - byte unit address, SDHC and SDXC - block unit address
+  uint32_t address;
+  uint8_t *data; // number_of_blocks * block_length bytes
+  uint32_t number_of_blocks;
+  sd_queue_callback callback; // Can be NULL
+  void *context;
+
+  // Filled by the driver
+  sd_error status;
+  bool is_done;
+};
+
+typedef struct
+{
+  uint32_t requests; // Completed requests
+  uint32_t blocks;
+  uint32_t runs; // Issued data commands (CMD17, CMD18, CMD24, CMD25)
+} sd_queue_stats;
+
+typedef struct
+{
+  SPI_HandleTypeDef *hspi;
+  uint32_t block_length;
+  // In the order of submission
+  sd_queue_request *pending[SD_QUEUE_SIZE];
+  uint8_t number_of_pending;
+  // Address after the last run and direction of the elevator
+  uint32_t head_address;
+  bool is_ascending;
+  sd_queue_stats stats;
+} sd_queue;
+
+// Functions -----------------------------------------------------------------
+
+void sd_card_queue_init(
+  sd_queue *const queue,
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t block_length
+);
+
+// The request must stay valid until it is done.
+// SD_BUSY - the queue is full, it has to be dispatched first
+sd_error sd_card_queue_submit(
+  sd_queue *const queue,
+  sd_queue_request *const request
+);
+
+// Carries out all pending requests (blocking). Requests that overlap an
+// earlier write (or are writes overlapping an earlier request) are not
+// moved ahead of it. Returns the accumulated status of all runs
+sd_error sd_card_queue_dispatch(sd_queue *const queue);
+
+#endif
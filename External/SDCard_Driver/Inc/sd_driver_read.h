@@ -7,8 +7,56 @@ Single and multiple reading functions from SD card
 
 #include "sd_driver_secondary.h"
 
+// Defines -------------------------------------------------------------------
+
+// Number of times a multiple read is re-issued from a failed block
+#ifndef SD_READ_RETRIES
+#define SD_READ_RETRIES 3U
+#endif
+
+// Number of retried blocks listed in sd_read_retry_stats
+#define SD_READ_RETRY_REPORT_SIZE 8U
+
+// Structs -------------------------------------------------------------------
+
+// Receives a filled block. The buffer stays valid until
+// number_of_buffers - 2 more blocks are passed to the consumer.
+// Returning false stops the stream
+typedef bool (*sd_read_stream_callback)(
+  uint8_t *const data,
+  const uint32_t block_index,
+  void *const context
+);
+
+typedef struct
+{
+  uint32_t blocks; // Blocks handed over to the consumer
+  // How many times the consumer returned before the next block was received
+  // (counted only with SD_USE_DMA)
+  uint32_t stalls;
+} sd_read_stream_stats;
+
+typedef struct
+{
+  uint32_t retries; // Re-issued CMD17 and CMD18
+  uint32_t retried_blocks; // Blocks that failed at least once
+  // Indexes (from 0) of the first SD_READ_RETRY_REPORT_SIZE retried blocks
+  uint32_t blocks[SD_READ_RETRY_REPORT_SIZE];
+} sd_read_retry_stats;
+
 // Functions -----------------------------------------------------------------
 
+// CMD12 during a multiple read. Waits for the end of busy, CS stays selected
+sd_error sd_card_stop_transmission(SPI_HandleTypeDef *const hspi);
+
+// CMD23 before CMD18: the multiple read ends by itself after
+// number_of_blocks. Only if sd_card_status.block_count_supported,
+// CS stays selected
+sd_error sd_card_set_block_count(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t number_of_blocks
+);
+
 // SDSC uses byte unit address and SDHC and SDXC Cards use
 // block unit address (512 bytes unit).
 // Use sd_card_set_block_len to set block length
@@ -19,6 +67,10 @@ sd_error sd_card_read_data(
   const uint32_t block_length
 );
 
+// With CMD23 support the number of blocks is set in advance and CMD12
+// is sent only after an error. A failed block (CRC, token) stops the
+// transfer, and the read is re-issued from that block: up to
+// SD_READ_RETRIES times per call
 sd_error sd_card_read_multiple_data(
   SPI_HandleTypeDef *const hspi, 
   const uint32_t address,
@@ -27,4 +79,31 @@ sd_error sd_card_read_multiple_data(
   const uint32_t number_of_blocks
 );
 
+// sd_card_read_multiple_data that reports the retried blocks.
+// stats can be NULL
+sd_error sd_card_read_multiple_data_with_stats(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  uint8_t* data,
+  const uint32_t block_length,
+  const uint32_t number_of_blocks,
+  sd_read_retry_stats *const stats
+);
+
+// Reads blocks one after another into a ring of number_of_buffers buffers
+// (buffers must hold number_of_buffers * block_length bytes). Each filled
+// buffer is passed to the callback while the next block is received.
+// CMD12 is issued only when the callback stops the stream.
+// stats can be NULL
+sd_error sd_card_read_stream(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  uint8_t* buffers,
+  const uint8_t number_of_buffers,
+  const uint32_t block_length,
+  const sd_read_stream_callback callback,
+  void *const context,
+  sd_read_stream_stats *const stats
+);
+
 #endif
@@ -7,8 +7,16 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+#ifdef SD_TRANSPORT_SIM
+// Host build: the SPI handle is only passed through to the transport
+typedef struct __SPI_HandleTypeDef SPI_HandleTypeDef;
+#define __weak __attribute__((weak))
+#else
 #include "stm32f1xx.h" // If you don't include it, there will be HAL errors
 #include "stm32f1xx_hal_spi.h"
+#endif
 
 // Defines -------------------------------------------------------------------
 
@@ -18,13 +26,70 @@
 
 #define SD_TRANSMISSION_TIMEOUT 500U
 
+// Maximum number of bytes moved by one asynchronous transfer.
+// Covers a whole 512-byte data block
+#define SD_BULK_TRANSFER_SIZE 512U
+
+// Transport used by default (can be changed by sd_card_set_transport).
+// Define SD_TRANSPORT_LL for the register level backend or
+// SD_TRANSPORT_SIM for the simulated card on a host
+#if defined(SD_TRANSPORT_SIM)
+#define SD_DEFAULT_TRANSPORT sd_transport_sim
+#elif defined(SD_TRANSPORT_LL)
+#define SD_DEFAULT_TRANSPORT sd_transport_ll
+#else
+#define SD_DEFAULT_TRANSPORT sd_transport_hal
+#endif
+
+// CS pin used by the HAL and LL transports
+#ifndef SD_CS_GPIO_PORT
+#define SD_CS_GPIO_PORT GPIOB
+#endif
+
+#ifndef SD_CS_PIN
+#define SD_CS_PIN GPIO_PIN_12
+#endif
+
+// Define SD_USE_DMA at build time (see Makefile) to move the data phase of
+// block transfers through DMA. The SPI handle must have its DMA channels
+// linked (hdmatx and hdmarx) and their interrupts enabled
+
+// Maximum number of bytes clocked by one call while waiting for a
+// response, a data token or the end of busy. The tick is checked once
+// per call
+#ifndef SD_POLL_CHUNK_SIZE
+#define SD_POLL_CHUNK_SIZE 16U
+#endif
+
+// With DMA, the CRC of a received block is calculated in parts of at least
+// this size while the rest of the block is being received
+#define SD_CRC_CHUNK_SIZE 64U
+
 // Macros --------------------------------------------------------------------
 
+// Synchronous transport functions. The LL transport is bound at compile
+// time: its functions are called directly, without the table (the table is
+// still used for the asynchronous transfers)
+#ifdef SD_TRANSPORT_LL
+#define SD_TRANSPORT(function) \
+  sd_card_ll_##function
+#else
+#define SD_TRANSPORT(function) \
+  sd_card_transport->function
+#endif
+
 #define SELECT_SD() \
-  HAL_GPIO_WritePin(GPIOB, GPIO_PIN_12, GPIO_PIN_RESET)
+  sd_card_select()
 
 #define DISELECT_SD() \
-  HAL_GPIO_WritePin(GPIOB, GPIO_PIN_12, GPIO_PIN_SET)
+  sd_card_deselect()
+
+#define SD_GET_TIMESTAMP() \
+  SD_TRANSPORT(get_timestamp)()
+
+// Microseconds
+#define SD_GET_TIME_US() \
+  sd_card_get_time_us()
 
 #define GET_VERSION_FROM_R7(r7) \
   (((r7).command_version_plus_reserved & 0xf0) >> 4)
@@ -34,7 +99,7 @@
 
 #define SEND_CMD(p_hspi, cmd, response, status) \
   SELECT_SD(); \
-  (status) |= HAL_SPI_Transmit((p_hspi), (uint8_t*)&(cmd), 6, HAL_MAX_DELAY); \
+  (status) |= sd_card_send_cmd((p_hspi), &(cmd)); \
   (status) |= sd_card_receive_cmd_response( \
     (p_hspi), (uint8_t*)&(response), sizeof(response) \
   ); \
@@ -116,10 +181,126 @@ typedef struct
   uint8_t version;
   sd_capacity capacity;
   bool error_in_initialization;
+  // CMD23 (from the SCR): multiple reads of a known length end without CMD12
+  bool block_count_supported;
 } sd_status;
 
+// Everything the driver needs from the hardware. Backends: sd_transport_hal,
+// sd_transport_ll (register level) and sd_transport_sim (host simulation)
+typedef struct
+{
+  // Full duplex exchange of one byte
+  sd_error (*exchange)(
+    SPI_HandleTypeDef *const hspi,
+    const uint8_t tx_data,
+    uint8_t *const rx_data
+  );
+  sd_error (*transmit)(
+    SPI_HandleTypeDef *const hspi,
+    const uint8_t *const data,
+    const uint16_t size
+  );
+  // 0xff is transmitted while receiving
+  sd_error (*receive)(
+    SPI_HandleTypeDef *const hspi,
+    uint8_t *const data,
+    const uint16_t size
+  );
+
+  // Asynchronous transfers (used with SD_USE_DMA), can be NULL.
+  // The end of the transfer is reported by sd_card_dma_complete
+  sd_error (*receive_start)(
+    SPI_HandleTypeDef *const hspi,
+    uint8_t *const data,
+    const uint16_t size
+  );
+  sd_error (*transmit_start)(
+    SPI_HandleTypeDef *const hspi,
+    const uint8_t *const data,
+    const uint16_t size
+  );
+  // Bytes not yet received by the started receive
+  uint16_t (*get_remaining)(SPI_HandleTypeDef *const hspi);
+  void (*abort)(SPI_HandleTypeDef *const hspi);
+
+  void (*select)(void);
+  void (*deselect)(void);
+
+  // Sets the fastest clock (Hz) that does not exceed max_clock
+  sd_error (*set_clock)(
+    SPI_HandleTypeDef *const hspi,
+    const uint32_t max_clock
+  );
+  uint32_t (*get_clock)(SPI_HandleTypeDef *const hspi);
+
+  // Free-running counter (e.g. the core cycle counter) and its frequency
+  // in Hz. The driver time is derived from it
+  uint32_t (*get_timestamp)(void);
+  uint32_t (*get_timestamp_frequency)(void);
+} sd_transport;
+
+// Constants -----------------------------------------------------------------
+
+// Frames of commands with constant arguments. Their CRC7 is calculated in
+// advance, so they are not rebuilt on every call (e.g. in ACMD41 loop)
+extern const sd_command sd_cmd_go_idle_state; // CMD0
+extern const sd_command sd_cmd_send_if_cond; // CMD8, 2.7-3.6V and 0x55
+extern const sd_command sd_cmd_send_csd; // CMD9
+extern const sd_command sd_cmd_stop_transmission; // CMD12
+extern const sd_command sd_cmd_erase; // CMD38
+extern const sd_command sd_cmd_app; // CMD55
+extern const sd_command sd_cmd_read_ocr; // CMD58
+extern const sd_command sd_cmd_crc_off; // CMD59
+extern const sd_command sd_cmd_crc_on; // CMD59
+extern const sd_command sd_acmd_send_op_cond; // ACMD41
+
+// Variables -----------------------------------------------------------------
+
+extern const sd_transport sd_transport_hal;
+extern const sd_transport sd_transport_ll;
+extern const sd_transport sd_transport_sim;
+
+// Transport used by the driver
+extern const sd_transport *sd_card_transport;
+
 // Functions -----------------------------------------------------------------
 
+// With SD_TRANSPORT_LL only the asynchronous transfers are affected
+void sd_card_set_transport(const sd_transport *const transport);
+
+// Takes CS. Held coalesced writes are written and an open read-ahead
+// stream is closed first
+void sd_card_select(void);
+
+// Releases CS. Bytes received ahead are dropped
+void sd_card_deselect(void);
+
+// Microseconds, wraps around after about 71 minutes. The timestamp is
+// extended in software with a whole number of ticks per microsecond, so
+// while something is timed it must be read more often than the timestamp
+// wraps (60 s for the cycle counter at 72 MHz). Longer gaps are lost:
+// times measured across application calls (coalescing, async steps) can
+// then end later. Not reentrant: it is called by the driver functions,
+// which do not run concurrently
+uint32_t sd_card_get_time_us(void);
+
+// Timestamp ticks in the given time. Short waits with a fixed limit
+// compare SD_GET_TIMESTAMP() differences with it and skip the
+// conversion to microseconds. The result must stay below the timestamp
+// period, e.g. 1 s is 72 000 000 ticks at 72 MHz
+uint32_t sd_card_get_ticks(const uint32_t time_us);
+
+#ifndef SD_TRANSPORT_SIM
+
+// DWT cycle counter of the Cortex-M3, started on the first call.
+// Timestamp of the HAL and LL transports
+uint32_t sd_card_dwt_get_timestamp(void);
+
+// Core clock (Hz)
+uint32_t sd_card_dwt_get_frequency(void);
+
+#endif
+
 sd_error sd_card_receive_byte(
   SPI_HandleTypeDef *const hspi, 
   uint8_t* data
@@ -148,17 +329,111 @@ sd_command sd_card_get_cmd_without_crc(
 
 sd_command sd_card_get_cmd(const uint8_t cmd_num, const uint32_t arg);
 
+sd_error sd_card_send_cmd(
+  SPI_HandleTypeDef *const hspi,
+  const sd_command *const cmd
+);
+
+#ifdef SD_USE_DMA
+
+// Starts a DMA transfer and returns immediately. Size is limited by
+// SD_BULK_TRANSFER_SIZE
+sd_error sd_card_dma_receive_start(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t* data,
+  const uint16_t size
+);
+
+sd_error sd_card_dma_transmit_start(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const data,
+  const uint16_t size
+);
+
+bool sd_card_dma_is_busy(void);
+
+// Number of bytes already in memory for the started receive of size bytes
+uint16_t sd_card_dma_get_received(
+  SPI_HandleTypeDef *const hspi,
+  const uint16_t size
+);
+
+// Stops the started DMA transfer
+void sd_card_dma_abort(SPI_HandleTypeDef *const hspi);
+
+// Waits for the end of the started DMA transfer.
+// sd_card_dma_idle_callback is called while waiting
+sd_error sd_card_dma_wait(SPI_HandleTypeDef *const hspi);
+
+sd_error sd_card_dma_receive(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t* data,
+  const uint16_t size
+);
+
+sd_error sd_card_dma_transmit(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const data,
+  const uint16_t size
+);
+
+// Weak. Can be overridden to do useful work while a block is moved by DMA
+void sd_card_dma_idle_callback(void);
+
+// Called by the transport when an asynchronous transfer ends
+void sd_card_dma_complete(
+  SPI_HandleTypeDef *const hspi,
+  const sd_error status
+);
+
+#endif
+
+// Starts receiving the data of a block whose start token has been received
+sd_error sd_card_receive_data_start(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t* data,
+  const uint16_t data_size
+);
+
+// Waits for the start token and starts receiving the data. With SD_USE_DMA
+// the data keeps moving in the background until the finish call
+sd_error sd_card_receive_data_block_start(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t* data,
+  const uint16_t data_size
+);
+
+// Completes receiving the data, receives and checks the CRC
+sd_error sd_card_receive_data_block_finish(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t* data,
+  const uint16_t data_size
+);
+
 sd_error sd_card_receive_data_block(
   SPI_HandleTypeDef *const hspi,
   uint8_t* data,
   const uint16_t data_size
 );
 
-// Waits for a value other than idle and writes it to received_value
+// Receives up to chunk_size (no more than SD_POLL_CHUNK_SIZE) bytes
+// looking for a value other than idle. SD_BUSY - only idle values
+// were received
+sd_error sd_card_poll_response(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t* received_value,
+  const uint8_t idle_value,
+  const uint16_t chunk_size
+);
+
+// Waits for a value other than idle and writes it to received_value.
+// Bytes are received in chunks, the ones after the found value are given
+// to the next receive calls. Timeout (us) - one of sd_card_timeouts
 sd_error sd_card_wait_response(
   SPI_HandleTypeDef *const hspi,
   uint8_t* received_value,
-  const uint8_t idle_value
+  const uint8_t idle_value,
+  const uint32_t timeout
 );
 
 sd_error sd_card_receive_cmd_response(
@@ -180,4 +455,12 @@ sd_error sd_card_set_block_len(
   const uint32_t length
 );
 
-#endif
\ No newline at end of file
+// Difference between the addresses of neighboring blocks: SDSC uses byte
+// unit address, SDHC and SDXC - block unit address
+uint32_t sd_card_get_address_step(const uint32_t block_length);
+
+#ifdef SD_TRANSPORT_LL
+#include "sd_driver_transport_ll.h"
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+/*
+Timeouts of the card operations. They are derived from the CSD (TAAC,
+NSAC, R2W_FACTOR), the SD status (erase) and the SPI clock
+*/
+
+#ifndef SD_DRIVER_TIMEOUT_H
+#define SD_DRIVER_TIMEOUT_H
+
+#include "sd_driver_init.h"
+
+// Defines -------------------------------------------------------------------
+
+// A response comes within 8 bytes (NCR), at any clock it is much less
+// than this (us)
+#define SD_COMMAND_TIMEOUT 1000U
+
+// Upper limits of the read and write timeouts (us). SDHC and SDXC cards
+// use them as fixed values
+#define SD_READ_TIMEOUT_MAX 100000U
+#define SD_WRITE_TIMEOUT_MAX 250000U
+#define SD_WRITE_TIMEOUT_MAX_SDXC 500000U
+
+// Erase time of one write block if the card does not report its erase
+// timeout in the SD status (us)
+#define SD_ERASE_TIMEOUT_PER_BLOCK 250000U
+
+// Structs -------------------------------------------------------------------
+
+// Microseconds
+typedef struct
+{
+  uint32_t command; // R1 after a command
+  uint32_t read; // Start token of a read block
+  uint32_t write; // Busy after a written block or the stop token
+  // Busy after CMD38: erase_offset + erase_per_unit for every
+  // started unit of erase_unit blocks, see sd_card_get_erase_timeout
+  uint32_t erase_offset;
+  uint32_t erase_per_unit;
+  uint32_t erase_unit; // Allocation unit (AU) of the card or one block
+} sd_timeouts;
+
+// Variables -----------------------------------------------------------------
+
+// Timeouts of the current card. Until sd_card_reset succeeds, all waits
+// are limited by SD_TRANSMISSION_TIMEOUT (except the command one)
+extern sd_timeouts sd_card_timeouts;
+
+// Functions -----------------------------------------------------------------
+
+// Back to the values for an unknown card. Called by sd_card_reset_start
+void sd_card_timeouts_reset(void);
+
+// Takes the card parameters. Called by sd_card_reset_finish.
+// ssr (SD status, ACMD13) can be NULL, then erase uses
+// SD_ERASE_TIMEOUT_PER_BLOCK
+void sd_card_timeouts_init(
+  SPI_HandleTypeDef *const hspi,
+  const sd_info *const info,
+  const uint8_t *const ssr
+);
+
+// Recalculates the timeouts for the current SPI clock (NSAC is given in
+// clock cycles). Called when the driver changes the clock
+void sd_card_timeouts_update(SPI_HandleTypeDef *const hspi);
+
+// Erase of the area from start_address to end_address inclusive
+// (addresses as for sd_card_set_erasable_area)
+uint32_t sd_card_get_erase_timeout(
+  const uint32_t start_address,
+  const uint32_t end_address
+);
+
+#endif
@@ -0,0 +1,46 @@
+/*
+Transport over SPI registers (LL). With SD_TRANSPORT_LL the driver calls
+these functions directly, without the transport table
+*/
+
+#ifndef SD_DRIVER_TRANSPORT_LL_H
+#define SD_DRIVER_TRANSPORT_LL_H
+
+#include "sd_driver_secondary.h"
+
+// Functions -----------------------------------------------------------------
+
+sd_error sd_card_ll_exchange(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t tx_data,
+  uint8_t *const rx_data
+);
+
+sd_error sd_card_ll_transmit(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const data,
+  const uint16_t size
+);
+
+sd_error sd_card_ll_receive(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t *const data,
+  const uint16_t size
+);
+
+void sd_card_ll_select(void);
+
+void sd_card_ll_deselect(void);
+
+sd_error sd_card_ll_set_clock(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t max_clock
+);
+
+uint32_t sd_card_ll_get_clock(SPI_HandleTypeDef *const hspi);
+
+uint32_t sd_card_ll_get_timestamp(void);
+
+uint32_t sd_card_ll_get_timestamp_frequency(void);
+
+#endif
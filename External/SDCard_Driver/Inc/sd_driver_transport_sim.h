@@ -0,0 +1,111 @@
+/*
+Simulated SD card in SPI mode for host builds (SD_TRANSPORT_SIM). The same
+driver code runs on a PC: bus traffic is served by a card model and time is
+virtual, so the results do not depend on the host speed
+*/
+
+#ifndef SD_DRIVER_TRANSPORT_SIM_H
+#define SD_DRIVER_TRANSPORT_SIM_H
+
+#include "sd_driver_secondary.h"
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_SECTOR_SIZE 512U
+
+// Values used for zero fields of the configuration
+#define SD_SIM_DEFAULT_BUS_CLOCK 36000000U
+#define SD_SIM_DEFAULT_POLL_NS 100U
+
+// Structs -------------------------------------------------------------------
+
+typedef struct
+{
+  // sectors * SD_SIM_SECTOR_SIZE bytes, supplied by the caller
+  uint8_t *storage;
+  uint32_t sectors;
+
+  bool version_1; // CMD8 is illegal
+  bool high_capacity; // SDHC: block unit address
+  bool high_speed; // CMD6 high speed function is supported
+  // CMD6 mode 1 (switch) does not select the high speed function,
+  // although mode 0 (check) reports it as available
+  bool high_speed_rejected;
+  bool block_count; // CMD23 is supported (CMD_SUPPORT in the SCR)
+  bool is_absent; // No card in the slot: the line stays high
+
+  // Peripheral clock, the SPI clock is bus_clock / 2^(1..8)
+  uint32_t bus_clock;
+
+  // Time from a read command to the data token
+  uint32_t read_latency_ns;
+  // Time between blocks of a multiple read
+  uint32_t read_gap_ns;
+  // Time from a register read (CMD6, CMD9, ACMD13, ACMD22, ACMD51)
+  // to the data token
+  uint32_t register_latency_ns;
+  // Busy time after a single written block and after the stop token
+  uint32_t write_busy_ns;
+  // Busy time after a block of a multiple write (0 - write_busy_ns).
+  // Cards program blocks of CMD25 faster
+  uint32_t write_multiple_busy_ns;
+  // Busy time after a block of a multiple write announced by ACMD23
+  // (0 - ACMD23 is illegal)
+  uint32_t pre_erased_busy_ns;
+  // Busy time after CMD12 that stops a multiple read
+  uint32_t stop_busy_ns;
+  // Busy time after CMD38
+  uint32_t erase_busy_ns;
+  // Number of ACMD41 answered with the idle state
+  uint16_t init_polls;
+
+  // Cost of one transport call (driver and HAL overhead on the target)
+  uint32_t call_overhead_ns;
+  // Time passed by every tick or DMA counter poll
+  uint32_t poll_ns;
+} sd_sim_config;
+
+typedef struct
+{
+  uint32_t calls; // Transport calls
+  uint32_t commands;
+  uint32_t crc_errors; // Commands and data blocks with a wrong CRC
+  uint64_t bytes; // Bytes clocked on the bus
+  uint64_t time_ns; // Virtual time
+} sd_sim_stats;
+
+// Variables -----------------------------------------------------------------
+
+// SPI handle for the driver calls on the host
+extern SPI_HandleTypeDef *const sd_card_sim_hspi;
+
+// Functions -----------------------------------------------------------------
+
+// Powers the card on: all registers and the state are reset
+void sd_card_sim_init(const sd_sim_config *const config);
+
+void sd_card_sim_get_stats(sd_sim_stats *const stats);
+
+void sd_card_sim_reset_stats(void);
+
+uint64_t sd_card_sim_get_time_ns(void);
+
+// Chip select state, true while the driver holds CS low
+bool sd_card_sim_is_selected(void);
+
+// True while the card sends the blocks of a multiple block read
+bool sd_card_sim_is_sending(void);
+
+// Time spent by the application outside the driver. A started
+// asynchronous transfer goes on meanwhile
+void sd_card_sim_wait(const uint32_t time_ns);
+
+// The block written after blocks_before more accepted blocks is answered
+// with a write error and not stored (once)
+void sd_card_sim_inject_write_error(const uint32_t blocks_before);
+
+// The CRC of the block read after blocks_before more blocks is
+// corrupted (once)
+void sd_card_sim_inject_read_error(const uint32_t blocks_before);
+
+#endif
@@ -7,8 +7,49 @@ Single and multiple recording functions on SD card
 
 #include "sd_driver_secondary.h"
 
+// Defines -------------------------------------------------------------------
+
+// sd_card_write_multiple_data sends ACMD23 (pre-erase hint) before
+// writing at least this many blocks. 0 - only on request, by
+// sd_card_write_multiple_data_pre_erase
+#ifndef SD_PRE_ERASE_THRESHOLD
+#define SD_PRE_ERASE_THRESHOLD 0U
+#endif
+
+// Structs -------------------------------------------------------------------
+
+typedef struct
+{
+  SPI_HandleTypeDef *hspi;
+  uint32_t next_address; // Address that continues the current CMD25
+  uint32_t block_length;
+  bool is_open;
+} sd_write_session;
+
 // Functions -----------------------------------------------------------------
 
+// Sends the start token and starts sending the data. With SD_USE_DMA the
+// data keeps moving in the background until the finish call.
+// CRC (2 bytes) is written to crc for the finish call
+sd_error sd_card_transmit_data_block_start(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const data,
+  const uint16_t data_size,
+  const uint8_t start_token,
+  uint8_t *const crc
+);
+
+// Completes sending the data, sends the CRC and checks the data response.
+// The busy signal that follows is not awaited
+sd_error sd_card_transmit_data_block_finish(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const crc
+);
+
+// Stop token during a multiple write (CMD25), then waits for the end
+// of busy. CS is released
+sd_error sd_card_close_multiple_write(SPI_HandleTypeDef *const hspi);
+
 // SDSC uses byte unit address and SDHC and SDXC Cards use
 // block unit address (512 bytes unit).
 // Use sd_card_set_block_len to set block length
@@ -27,4 +68,65 @@ sd_error sd_card_write_multiple_data(
   const uint32_t number_of_blocks
 );
 
+// ACMD23: the next CMD25 will write number_of_blocks blocks, so the card
+// can erase them in advance. The count is cleared at the end of the write
+sd_error sd_card_set_pre_erase_count(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t number_of_blocks
+);
+
+// sd_card_write_multiple_data preceded by ACMD23. If the write fails, the
+// pre-erased blocks that were not written may hold erased data
+sd_error sd_card_write_multiple_data_pre_erase(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  const uint8_t *const data,
+  const uint32_t block_length,
+  const uint32_t number_of_blocks
+);
+
+// ACMD22: number of blocks of the last multiple write that were written
+// without errors
+sd_error sd_card_get_written_blocks(
+  SPI_HandleTypeDef *const hspi,
+  uint32_t *const number_of_blocks
+);
+
+// sd_card_write_multiple_data that starts from block *written_blocks
+// (0 - from the beginning). After an error the number of blocks written
+// by the card is queried by ACMD22 and added to *written_blocks, so the
+// same call with the same arguments resumes the write from the first
+// unwritten block
+sd_error sd_card_write_multiple_data_resumable(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  const uint8_t *const data,
+  const uint32_t block_length,
+  const uint32_t number_of_blocks,
+  uint32_t *const written_blocks
+);
+
+// Write session. Blocks are sent one at a time within one CMD25 while
+// their addresses are contiguous, so only one block has to be kept in RAM.
+// The card stays selected while the session is open: other commands
+// must not be sent until sd_card_write_session_end
+sd_error sd_card_write_session_begin(
+  SPI_HandleTypeDef *const hspi,
+  sd_write_session *const session,
+  const uint32_t address,
+  const uint32_t block_length
+);
+
+// A non-contiguous address ends the current CMD25 and starts a new one.
+// A failed block ends it with the stop token, the next block opens
+// a new one
+sd_error sd_card_write_session_append(
+  sd_write_session *const session,
+  const uint32_t address,
+  const uint8_t *const data
+);
+
+// Sends the stop token and waits for the end of programming
+sd_error sd_card_write_session_end(sd_write_session *const session);
+
 #endif
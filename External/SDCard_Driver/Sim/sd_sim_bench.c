@@ -0,0 +1,55 @@
+/*
+Common part of the benchmarks of the driver on the simulated card
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_init.h"
+#include <stdlib.h>
+
+// Variables -----------------------------------------------------------------
+
+uint8_t sd_sim_bench_storage[SD_SIM_BENCH_SECTORS * SD_SIM_SECTOR_SIZE];
+
+// Implementations -----------------------------------------------------------
+
+sd_sim_config sd_sim_bench_get_config(void)
+{
+  return (sd_sim_config) {
+    .storage = sd_sim_bench_storage,
+    .sectors = SD_SIM_BENCH_SECTORS,
+    .high_capacity = true,
+    .high_speed = true,
+    .erase_busy_ns = 1000000,
+    .init_polls = 5,
+    .call_overhead_ns = 1000
+  };
+}
+
+sd_error sd_sim_bench_power_on(const sd_sim_config *const config)
+{
+  sd_sim_bench_fill(
+    sd_sim_bench_storage, SD_SIM_BENCH_SECTORS * SD_SIM_SECTOR_SIZE
+  );
+  sd_card_sim_init(config);
+
+  return sd_card_reset(sd_card_sim_hspi, true);
+}
+
+void sd_sim_bench_fill(uint8_t *const data, const uint32_t size)
+{
+  for (uint32_t i = 0; i < size; i++)
+    data[i] = rand();
+}
+
+double sd_sim_bench_get_time_us(void)
+{
+  sd_sim_stats stats = { 0 };
+
+  sd_card_sim_get_stats(&stats);
+  return stats.time_ns / 1e3;
+}
+
+double sd_sim_bench_get_mb_per_s(const uint64_t bytes)
+{
+  return bytes / sd_sim_bench_get_time_us();
+}
@@ -0,0 +1,35 @@
+/*
+Common part of the benchmarks of the driver on the simulated card. Times
+are virtual, so the results are the same on every host
+*/
+
+#ifndef SD_SIM_BENCH_H
+#define SD_SIM_BENCH_H
+
+#include "sd_driver_transport_sim.h"
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_SECTORS 8192U
+
+// Variables -----------------------------------------------------------------
+
+extern uint8_t sd_sim_bench_storage[];
+
+// Functions -----------------------------------------------------------------
+
+// SDHC card with high speed support, the timings are set by each benchmark
+sd_sim_config sd_sim_bench_get_config(void);
+
+// Fills the storage from rand(), powers the card on and resets it
+sd_error sd_sim_bench_power_on(const sd_sim_config *const config);
+
+void sd_sim_bench_fill(uint8_t *const data, const uint32_t size);
+
+// Virtual time since the last sd_card_sim_reset_stats (us)
+double sd_sim_bench_get_time_us(void);
+
+// Throughput of the bytes moved since the last sd_card_sim_reset_stats
+double sd_sim_bench_get_mb_per_s(const uint64_t bytes);
+
+#endif
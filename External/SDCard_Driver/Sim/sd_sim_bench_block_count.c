@@ -0,0 +1,88 @@
+/*
+Multiple block reads stopped by CMD12 against reads bounded by CMD23,
+50 reads of each size. Run without and with busy after CMD12
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_init.h"
+#include "sd_driver_read.h"
+#include <stdio.h>
+#include <string.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_READS 50U
+#define SD_SIM_BENCH_MAX_BLOCKS 32U
+
+// Static variables ----------------------------------------------------------
+
+static uint8_t sd_sim_bench_data[SD_SIM_BENCH_MAX_BLOCKS * SD_SIM_SECTOR_SIZE];
+
+// Static functions ----------------------------------------------------------
+
+static void sd_sim_bench_run(const uint32_t stop_busy_ns, const bool cmd23)
+{
+  sd_sim_config config = sd_sim_bench_get_config();
+  const uint32_t sizes[] = { 2, 4, 8, SD_SIM_BENCH_MAX_BLOCKS };
+
+  config.block_count = cmd23;
+  config.stop_busy_ns = stop_busy_ns;
+  config.read_latency_ns = 500000;
+  config.read_gap_ns = 30000;
+  config.write_busy_ns = 1500000;
+  if (sd_sim_bench_power_on(&config) ||
+    sd_card_status.block_count_supported != cmd23)
+  {
+    printf("reset failed\n");
+    return;
+  }
+
+  for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    uint32_t number_of_blocks = sizes[i];
+    sd_sim_stats stats = { 0 };
+    bool is_correct = true;
+
+    sd_card_sim_reset_stats();
+    for (uint32_t read = 0; read < SD_SIM_BENCH_READS; read++)
+    {
+      uint32_t address = 100 + read * 64;
+
+      is_correct &= sd_card_read_multiple_data(
+        sd_card_sim_hspi, address, sd_sim_bench_data, SD_SIM_SECTOR_SIZE,
+        number_of_blocks
+      ) == SD_OK;
+      is_correct &= memcmp(
+        sd_sim_bench_storage + address * SD_SIM_SECTOR_SIZE,
+        sd_sim_bench_data, number_of_blocks * SD_SIM_SECTOR_SIZE
+      ) == 0;
+    }
+
+    sd_card_sim_get_stats(&stats);
+    printf(
+      "stop busy %2lu us, %2lu blocks %s: %.1f us per read, "
+      "%llu bytes clocked, %s\n",
+      (unsigned long)(stop_busy_ns / 1000),
+      (unsigned long)number_of_blocks,
+      cmd23 ? "CMD23" : "CMD12",
+      stats.time_ns / 1e3 / SD_SIM_BENCH_READS,
+      (unsigned long long)stats.bytes / SD_SIM_BENCH_READS,
+      is_correct ? "ok" : "WRONG DATA"
+    );
+  }
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  const uint32_t stop_busy_ns[] = { 0, 50000 };
+
+  for (uint32_t i = 0; i < 2; i++)
+  {
+    sd_sim_bench_run(stop_busy_ns[i], false);
+    sd_sim_bench_run(stop_busy_ns[i], true);
+  }
+
+  return 0;
+}
@@ -0,0 +1,108 @@
+/*
+Sector cache on a metadata-like trace of 5000 operations: 40% reads of 4
+hot blocks, 30% of 8 index blocks, 20% random reads and 10% writes.
+Built with SD_CACHE_SIZE, the run without the cache invalidates it
+before every operation
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_read.h"
+#include "sd_driver_write.h"
+#include "sd_driver_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_OPERATIONS 5000U
+
+// Static variables ----------------------------------------------------------
+
+static uint8_t sd_sim_bench_reference[
+  SD_SIM_BENCH_SECTORS * SD_SIM_SECTOR_SIZE
+];
+
+// Static functions ----------------------------------------------------------
+
+static void sd_sim_bench_run(const bool use_cache)
+{
+  SPI_HandleTypeDef *hspi = sd_card_sim_hspi;
+  sd_sim_config config = sd_sim_bench_get_config();
+  sd_cache_stats cache_stats = { 0 };
+  uint8_t data[SD_SIM_SECTOR_SIZE];
+  bool is_correct = true;
+
+  config.read_latency_ns = 300000;
+  config.read_gap_ns = 50000;
+  config.write_busy_ns = 500000;
+  srand(1);
+  is_correct &= sd_sim_bench_power_on(&config) == SD_OK;
+  memcpy(
+    sd_sim_bench_reference, sd_sim_bench_storage,
+    sizeof(sd_sim_bench_reference)
+  );
+  sd_card_sim_reset_stats();
+  sd_card_cache_reset_stats();
+  srand(3);
+
+  for (uint32_t i = 0; i < SD_SIM_BENCH_OPERATIONS; i++)
+  {
+    uint32_t kind = rand() % 100;
+    uint32_t address = 0;
+
+    if (!use_cache)
+      sd_card_cache_invalidate_all();
+
+    if (kind < 40)
+      address = rand() % 4;
+    else if (kind < 70)
+      address = 16 + rand() % 8;
+    else if (kind < 90)
+      address = 100 + rand() % 2000;
+    else
+    {
+      address = rand() % 30;
+      sd_sim_bench_fill(data, sizeof(data));
+      is_correct &= sd_card_write_data(hspi, address, data, sizeof(data)) ==
+        SD_OK;
+      memcpy(
+        sd_sim_bench_reference + address * SD_SIM_SECTOR_SIZE, data,
+        sizeof(data)
+      );
+      continue;
+    }
+
+    is_correct &= sd_card_read_data(hspi, address, data, sizeof(data)) ==
+      SD_OK;
+    is_correct &= memcmp(
+      data, sd_sim_bench_reference + address * SD_SIM_SECTOR_SIZE,
+      sizeof(data)
+    ) == 0;
+  }
+
+  sd_card_cache_get_stats(&cache_stats);
+  if (use_cache)
+    printf(
+      "%2u sectors: hit rate %.1f%%, ",
+      SD_CACHE_SIZE,
+      100.0 * cache_stats.hits / (cache_stats.hits + cache_stats.misses)
+    );
+  else
+    printf("no cache  : ");
+  printf(
+    "%.1f us per operation, %s\n",
+    sd_sim_bench_get_time_us() / SD_SIM_BENCH_OPERATIONS,
+    is_correct ? "ok" : "WRONG DATA"
+  );
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  sd_sim_bench_run(false);
+  sd_sim_bench_run(true);
+
+  return 0;
+}
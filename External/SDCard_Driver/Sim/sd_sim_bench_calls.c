@@ -0,0 +1,118 @@
+/*
+Transport calls and time per 512-byte sector of single block reads and
+writes, with the block moved in one transfer and with one byte per call
+(the transfer path before the bulk transfers). Cycles are counted at the
+72 MHz core clock of the target
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_read.h"
+#include "sd_driver_write.h"
+#include <stdio.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_SECTORS_MOVED 100U
+#define SD_SIM_BENCH_CORE_CLOCK_MHZ 72U
+
+// Static variables ----------------------------------------------------------
+
+static uint8_t sd_sim_bench_data[SD_SIM_SECTOR_SIZE];
+
+// Static functions ----------------------------------------------------------
+
+static sd_error sd_sim_bench_bytewise_transmit(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const data,
+  const uint16_t size
+)
+{
+  sd_error status = SD_OK;
+  uint8_t rx_data = 0;
+
+  for (uint16_t i = 0; i < size; i++)
+    status |= sd_transport_sim.exchange(hspi, data[i], &rx_data);
+
+  return status;
+}
+
+static sd_error sd_sim_bench_bytewise_receive(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t *const data,
+  const uint16_t size
+)
+{
+  sd_error status = SD_OK;
+
+  for (uint16_t i = 0; i < size; i++)
+    status |= sd_transport_sim.exchange(hspi, 0xff, &data[i]);
+
+  return status;
+}
+
+// Single block reads and writes of SD_SIM_BENCH_SECTORS_MOVED sectors
+static sd_error sd_sim_bench_run(
+  const char *const name,
+  const sd_transport *const transport
+)
+{
+  SPI_HandleTypeDef *hspi = sd_card_sim_hspi;
+  sd_sim_stats stats = { 0 };
+  sd_error status = SD_OK;
+
+  sd_card_set_transport(transport);
+  for (uint32_t write = 0; write < 2; write++)
+  {
+    sd_card_sim_reset_stats();
+    for (uint32_t i = 0; i < SD_SIM_BENCH_SECTORS_MOVED; i++)
+    {
+      status |= write ?
+        sd_card_write_data(
+          hspi, 100 + i, sd_sim_bench_data, SD_SIM_SECTOR_SIZE
+        ) :
+        sd_card_read_data(
+          hspi, 100 + i, sd_sim_bench_data, SD_SIM_SECTOR_SIZE
+        );
+    }
+
+    sd_card_sim_get_stats(&stats);
+    printf(
+      "%-8s %s: %6.1f calls, %7.0f cycles, %5.1f us per sector\n",
+      name,
+      write ? "write" : "read ",
+      (double)stats.calls / SD_SIM_BENCH_SECTORS_MOVED,
+      stats.time_ns * SD_SIM_BENCH_CORE_CLOCK_MHZ / 1e3 /
+        SD_SIM_BENCH_SECTORS_MOVED,
+      stats.time_ns / 1e3 / SD_SIM_BENCH_SECTORS_MOVED
+    );
+  }
+  sd_card_set_transport(&sd_transport_sim);
+
+  return status;
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  sd_sim_config config = sd_sim_bench_get_config();
+  // The calls of the per-byte path, with no DMA
+  sd_transport bytewise = sd_transport_sim;
+  sd_error status = SD_OK;
+
+  bytewise.transmit = sd_sim_bench_bytewise_transmit;
+  bytewise.receive = sd_sim_bench_bytewise_receive;
+  bytewise.receive_start = NULL;
+  bytewise.transmit_start = NULL;
+
+  // The latency and the busy time are the same for both paths
+  config.read_latency_ns = 100000;
+  config.write_busy_ns = 300000;
+  config.call_overhead_ns = 2000;
+  status |= sd_sim_bench_power_on(&config);
+
+  status |= sd_sim_bench_run("bytewise", &bytewise);
+  status |= sd_sim_bench_run("block", &sd_transport_sim);
+
+  return status ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+/*
+Multiple block reads and writes at every prescaler step of a 72 MHz bus
+(SPI1 on PCLK2), 20 transfers of 16 blocks each. The high speed card
+accepts every step
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_clock.h"
+#include "sd_driver_read.h"
+#include "sd_driver_write.h"
+#include <stdio.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_BUS_CLOCK 72000000U
+#define SD_SIM_BENCH_PRESCALER_STEPS 8U
+#define SD_SIM_BENCH_TRANSFERS 20U
+#define SD_SIM_BENCH_BLOCKS 16U
+
+// Static variables ----------------------------------------------------------
+
+static uint8_t sd_sim_bench_data[SD_SIM_BENCH_BLOCKS * SD_SIM_SECTOR_SIZE];
+
+// Static functions ----------------------------------------------------------
+
+// MB/s of the reads or the writes at the current clock
+static double sd_sim_bench_run(const bool write, sd_error *const status)
+{
+  SPI_HandleTypeDef *hspi = sd_card_sim_hspi;
+
+  sd_card_sim_reset_stats();
+  for (uint32_t i = 0; i < SD_SIM_BENCH_TRANSFERS; i++)
+  {
+    uint32_t address = 100 + i * SD_SIM_BENCH_BLOCKS;
+
+    *status |= write ?
+      sd_card_write_multiple_data(
+        hspi, address, sd_sim_bench_data, SD_SIM_SECTOR_SIZE,
+        SD_SIM_BENCH_BLOCKS
+      ) :
+      sd_card_read_multiple_data(
+        hspi, address, sd_sim_bench_data, SD_SIM_SECTOR_SIZE,
+        SD_SIM_BENCH_BLOCKS
+      );
+  }
+
+  return sd_sim_bench_get_mb_per_s(
+    (uint64_t)SD_SIM_BENCH_TRANSFERS * sizeof(sd_sim_bench_data)
+  );
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  sd_sim_config config = sd_sim_bench_get_config();
+  sd_error status = SD_OK;
+
+  config.bus_clock = SD_SIM_BENCH_BUS_CLOCK;
+  config.read_latency_ns = 500000;
+  config.read_gap_ns = 30000;
+  config.write_busy_ns = 1500000;
+  config.write_multiple_busy_ns = 300000;
+  status |= sd_sim_bench_power_on(&config);
+
+  for (uint32_t step = 0; step < SD_SIM_BENCH_PRESCALER_STEPS; step++)
+  {
+    status |= sd_card_set_max_clock(
+      sd_card_sim_hspi, SD_SIM_BENCH_BUS_CLOCK >> (step + 1)
+    );
+    double read_mb_per_s = sd_sim_bench_run(false, &status);
+    double write_mb_per_s = sd_sim_bench_run(true, &status);
+
+    printf(
+      "prescaler %3u, %8lu Hz: read %.3f MB/s, write %.3f MB/s\n",
+      2U << step,
+      (unsigned long)sd_card_get_clock(sd_card_sim_hspi),
+      read_mb_per_s,
+      write_mb_per_s
+    );
+  }
+
+  return status ? 1 : 0;
+}
@@ -0,0 +1,108 @@
+/*
+Coalescing of single block writes: 4000 writes, sequential with a random
+jump for every 16th on average. Built with SD_COALESCE_BLOCKS, compared
+with direct CMD24 writes
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_read.h"
+#include "sd_driver_write.h"
+#include "sd_driver_coalesce.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_WRITES 4000U
+
+// Static variables ----------------------------------------------------------
+
+static uint8_t sd_sim_bench_reference[
+  SD_SIM_BENCH_SECTORS * SD_SIM_SECTOR_SIZE
+];
+
+// Static functions ----------------------------------------------------------
+
+static void sd_sim_bench_run(const bool use_coalescing)
+{
+  SPI_HandleTypeDef *hspi = sd_card_sim_hspi;
+  sd_sim_config config = sd_sim_bench_get_config();
+  sd_coalesce_stats coalesce_stats = { 0 };
+  uint8_t data[SD_SIM_SECTOR_SIZE];
+  uint32_t address = 500;
+  bool is_correct = true;
+
+  // Blocks inside CMD25 are programmed faster than single blocks
+  config.read_latency_ns = 500000;
+  config.read_gap_ns = 30000;
+  config.write_busy_ns = 1500000;
+  config.write_multiple_busy_ns = 300000;
+  srand(1);
+  is_correct &= sd_sim_bench_power_on(&config) == SD_OK;
+  memcpy(
+    sd_sim_bench_reference, sd_sim_bench_storage,
+    sizeof(sd_sim_bench_reference)
+  );
+  sd_card_sim_reset_stats();
+  sd_card_coalesce_reset_stats();
+  srand(4);
+
+  for (uint32_t i = 0; i < SD_SIM_BENCH_WRITES; i++)
+  {
+    address = rand() % 16 ? address + 1 :
+      rand() % (SD_SIM_BENCH_SECTORS - 10);
+    sd_sim_bench_fill(data, sizeof(data));
+    is_correct &= (use_coalescing ?
+      sd_card_coalesce_write(hspi, address, data, sizeof(data)) :
+      sd_card_write_data(hspi, address, data, sizeof(data))) == SD_OK;
+    memcpy(
+      sd_sim_bench_reference + address * SD_SIM_SECTOR_SIZE, data,
+      sizeof(data)
+    );
+
+    // Reads see the held blocks
+    if (i % 500 == 3)
+    {
+      is_correct &= sd_card_read_data(hspi, address, data, sizeof(data)) ==
+        SD_OK;
+      is_correct &= memcmp(
+        data, sd_sim_bench_reference + address * SD_SIM_SECTOR_SIZE,
+        sizeof(data)
+      ) == 0;
+    }
+  }
+
+  is_correct &= sd_card_coalesce_flush() == SD_OK;
+  is_correct &= memcmp(
+    sd_sim_bench_storage, sd_sim_bench_reference,
+    sizeof(sd_sim_bench_reference)
+  ) == 0;
+
+  printf(
+    "%s: %.1f us per sector, %.3f MB/s",
+    use_coalescing ? "coalesced" : "direct   ",
+    sd_sim_bench_get_time_us() / SD_SIM_BENCH_WRITES,
+    sd_sim_bench_get_mb_per_s((uint64_t)SD_SIM_BENCH_WRITES * sizeof(data))
+  );
+  if (use_coalescing)
+  {
+    sd_card_coalesce_get_stats(&coalesce_stats);
+    printf(
+      ", %lu runs, %lu full",
+      (unsigned long)coalesce_stats.runs,
+      (unsigned long)coalesce_stats.full_runs
+    );
+  }
+  printf(", %s\n", is_correct ? "ok" : "WRONG DATA");
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  sd_sim_bench_run(false);
+  sd_sim_bench_run(true);
+
+  return 0;
+}
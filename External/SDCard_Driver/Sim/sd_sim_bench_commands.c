@@ -0,0 +1,88 @@
+/*
+Cost of one command frame: a constant frame, a frame built with the CRC7
+table (sd_card_get_cmd) and one built with the bitwise CRC7
+(crc_bitwise.o, see the Makefile). The time is measured on the host clock
+*/
+
+#include "sd_sim_bench.h"
+#include "crc-buffer.h"
+#include <stdio.h>
+#include <time.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_FRAMES 1000000U
+
+// Functions -----------------------------------------------------------------
+
+uint8_t crc_bitwise_calculate_crc_7(
+  crc_buffer_7* buffer,
+  uint8_t* data,
+  const uint8_t data_length
+);
+
+// Static variables ----------------------------------------------------------
+
+// Written by every frame, so the builds are not optimized out
+static volatile sd_command sd_sim_bench_frame;
+
+// Static functions ----------------------------------------------------------
+
+static double sd_sim_bench_get_host_ns(void)
+{
+  struct timespec now = { 0 };
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static sd_command sd_sim_bench_get_constant_cmd(
+  const uint8_t cmd_num,
+  const uint32_t arg
+)
+{
+  return sd_cmd_app;
+}
+
+static sd_command sd_sim_bench_get_bitwise_cmd(
+  const uint8_t cmd_num,
+  const uint32_t arg
+)
+{
+  crc_buffer_7 crc_buffer;
+  sd_command cmd = sd_card_get_cmd_without_crc(cmd_num, arg);
+
+  cmd.crc_block = crc_bitwise_calculate_crc_7(
+    &crc_buffer, (uint8_t*)&cmd, sizeof(cmd) - 1
+  );
+
+  return cmd;
+}
+
+static void sd_sim_bench_run(
+  const char *const name,
+  sd_command (*get_cmd)(const uint8_t, const uint32_t)
+)
+{
+  double start_ns = sd_sim_bench_get_host_ns();
+
+  for (uint32_t i = 0; i < SD_SIM_BENCH_FRAMES; i++)
+    sd_sim_bench_frame = get_cmd(55, i);
+
+  printf(
+    "%-14s: %6.1f ns per command\n",
+    name,
+    (sd_sim_bench_get_host_ns() - start_ns) / SD_SIM_BENCH_FRAMES
+  );
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  sd_sim_bench_run("constant frame", sd_sim_bench_get_constant_cmd);
+  sd_sim_bench_run("CRC7 table", sd_card_get_cmd);
+  sd_sim_bench_run("CRC7 bitwise", sd_sim_bench_get_bitwise_cmd);
+
+  return 0;
+}
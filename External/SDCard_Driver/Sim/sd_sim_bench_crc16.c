@@ -0,0 +1,112 @@
+/*
+CRC16 of 512-byte blocks with every CRC_BUFFER_CRC16_METHOD. The Makefile
+links one copy of the CRC module per method, its functions renamed to
+crc_<method>_*. Unlike the other benchmarks, the time is measured on the
+host clock, and every result is compared with the bitwise method
+*/
+
+#include "sd_sim_bench.h"
+#include "crc-buffer.h"
+#include <stdio.h>
+#include <time.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_BLOCKS 20000U
+
+// Functions of one copy of the CRC module
+#define SD_SIM_BENCH_DECLARE_CRC16(method) \
+  crc_16_result crc_##method##_calculate_crc_16( \
+    crc_buffer_16* buffer, \
+    uint8_t* data, \
+    const uint16_t data_length \
+  )
+
+// Structs -------------------------------------------------------------------
+
+typedef struct
+{
+  const char *name;
+  uint32_t table_size; // Bytes of tables in flash
+  crc_16_result (*calculate)(crc_buffer_16*, uint8_t*, const uint16_t);
+} sd_sim_bench_crc16_method;
+
+// Functions -----------------------------------------------------------------
+
+SD_SIM_BENCH_DECLARE_CRC16(bitwise);
+SD_SIM_BENCH_DECLARE_CRC16(nibble);
+SD_SIM_BENCH_DECLARE_CRC16(byte);
+SD_SIM_BENCH_DECLARE_CRC16(slice_4);
+SD_SIM_BENCH_DECLARE_CRC16(slice_8);
+
+// Static functions ----------------------------------------------------------
+
+static double sd_sim_bench_get_host_ns(void)
+{
+  struct timespec now = { 0 };
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  const sd_sim_bench_crc16_method methods[] = {
+    { "bitwise", 0, crc_bitwise_calculate_crc_16 },
+    { "nibble", 16 * sizeof(uint16_t), crc_nibble_calculate_crc_16 },
+    { "byte", 256 * sizeof(uint16_t), crc_byte_calculate_crc_16 },
+    { "slice-4", 4 * 256 * sizeof(uint16_t), crc_slice_4_calculate_crc_16 },
+    { "slice-8", 8 * 256 * sizeof(uint16_t), crc_slice_8_calculate_crc_16 }
+  };
+  const uint32_t number_of_methods = sizeof(methods) / sizeof(methods[0]);
+  bool is_correct = true;
+
+  // The blocks are taken from the storage in turn
+  sd_sim_bench_fill(
+    sd_sim_bench_storage, SD_SIM_BENCH_SECTORS * SD_SIM_SECTOR_SIZE
+  );
+
+  for (uint32_t i = 0; i < number_of_methods; i++)
+  {
+    crc_buffer_16 buffer = 0;
+    uint32_t mismatches = 0;
+    double start_ns = sd_sim_bench_get_host_ns();
+
+    for (uint32_t block = 0; block < SD_SIM_BENCH_BLOCKS; block++)
+    {
+      uint8_t *data = sd_sim_bench_storage +
+        (block % SD_SIM_BENCH_SECTORS) * SD_SIM_SECTOR_SIZE;
+
+      methods[i].calculate(&buffer, data, SD_SIM_SECTOR_SIZE);
+    }
+    double time_ns = sd_sim_bench_get_host_ns() - start_ns;
+
+    // The same result as the bitwise method for every block
+    for (uint32_t block = 0; block < SD_SIM_BENCH_SECTORS; block++)
+    {
+      uint8_t *data = sd_sim_bench_storage + block * SD_SIM_SECTOR_SIZE;
+      crc_16_result expected = methods[0].calculate(
+        &buffer, data, SD_SIM_SECTOR_SIZE
+      );
+
+      if (methods[i].calculate(&buffer, data, SD_SIM_SECTOR_SIZE).i16 !=
+        expected.i16)
+      {
+        mismatches++;
+      }
+    }
+    is_correct &= mismatches == 0;
+
+    printf(
+      "%-8s: %6.2f ns per byte, %4lu bytes of tables, %s\n",
+      methods[i].name,
+      time_ns / ((double)SD_SIM_BENCH_BLOCKS * SD_SIM_SECTOR_SIZE),
+      (unsigned long)methods[i].table_size,
+      mismatches ? "WRONG RESULT" : "ok"
+    );
+  }
+
+  return is_correct ? 0 : 1;
+}
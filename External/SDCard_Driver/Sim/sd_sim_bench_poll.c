@@ -0,0 +1,133 @@
+/*
+Transport calls spent waiting for the card. Single block writes over
+a range of busy times, then a fixed sequence of reads, writes and an
+erase. "make sim-bench" also builds it with SD_POLL_CHUNK_SIZE = 1
+(sd_sim_bench_poll_chunk_1), which polls one byte per call
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_read.h"
+#include "sd_driver_write.h"
+#include "sd_driver_erase.h"
+#include <stdio.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_WRITES 50U
+
+// Static variables ----------------------------------------------------------
+
+static uint8_t sd_sim_bench_data[8 * SD_SIM_SECTOR_SIZE];
+
+// Static functions ----------------------------------------------------------
+
+static sd_sim_config sd_sim_bench_get_poll_config(const uint32_t busy_ns)
+{
+  sd_sim_config config = sd_sim_bench_get_config();
+
+  config.read_latency_ns = 100000;
+  config.read_gap_ns = 20000;
+  config.write_busy_ns = busy_ns;
+  config.call_overhead_ns = 2000;
+
+  return config;
+}
+
+// Calls and time per single block write
+static sd_error sd_sim_bench_write(
+  const uint32_t busy_ns,
+  double *const calls,
+  double *const time_us
+)
+{
+  sd_sim_config config = sd_sim_bench_get_poll_config(busy_ns);
+  sd_sim_stats stats = { 0 };
+  sd_error status = sd_sim_bench_power_on(&config);
+
+  sd_card_sim_reset_stats();
+  for (uint32_t i = 0; i < SD_SIM_BENCH_WRITES; i++)
+  {
+    status |= sd_card_write_data(
+      sd_card_sim_hspi, 100 + i, sd_sim_bench_data, SD_SIM_SECTOR_SIZE
+    );
+  }
+
+  sd_card_sim_get_stats(&stats);
+  *calls = (double)stats.calls / SD_SIM_BENCH_WRITES;
+  *time_us = stats.time_ns / 1e3 / SD_SIM_BENCH_WRITES;
+
+  return status;
+}
+
+static sd_error sd_sim_bench_run_sequence(void)
+{
+  SPI_HandleTypeDef *hspi = sd_card_sim_hspi;
+  sd_sim_config config = sd_sim_bench_get_poll_config(300000);
+  sd_sim_stats stats = { 0 };
+  sd_error status = sd_sim_bench_power_on(&config);
+
+  sd_card_sim_reset_stats();
+  status |= sd_card_read_data(hspi, 3, sd_sim_bench_data, SD_SIM_SECTOR_SIZE);
+  status |= sd_card_read_multiple_data(
+    hspi, 10, sd_sim_bench_data, SD_SIM_SECTOR_SIZE, 8
+  );
+  status |= sd_card_write_data(
+    hspi, 100, sd_sim_bench_data, SD_SIM_SECTOR_SIZE
+  );
+  status |= sd_card_write_multiple_data(
+    hspi, 200, sd_sim_bench_data, SD_SIM_SECTOR_SIZE, 8
+  );
+  status |= sd_card_read_multiple_data(
+    hspi, 200, sd_sim_bench_data, SD_SIM_SECTOR_SIZE, 8
+  );
+  status |= sd_card_set_erasable_area(hspi, 200, 201);
+  status |= sd_card_erase(hspi);
+
+  sd_card_sim_get_stats(&stats);
+  printf(
+    "sequence: calls %lu, commands %lu, bytes %llu, time %.1f us\n",
+    (unsigned long)stats.calls,
+    (unsigned long)stats.commands,
+    (unsigned long long)stats.bytes,
+    stats.time_ns / 1e3
+  );
+
+  return status;
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  const uint32_t busy_times_ns[] = {
+    0, 20000, 100000, 300000, 1000000, 3000000
+  };
+  const uint32_t busy_times = sizeof(busy_times_ns) / sizeof(busy_times_ns[0]);
+  double base_calls = 0;
+  double base_time_us = 0;
+  sd_error status = SD_OK;
+
+  printf("SD_POLL_CHUNK_SIZE %u\n", (unsigned)SD_POLL_CHUNK_SIZE);
+
+  // Without busy time the write costs the command, the block and the
+  // first poll. The rest is the busy wait
+  status |= sd_sim_bench_write(0, &base_calls, &base_time_us);
+
+  for (uint32_t i = 1; i < busy_times; i++)
+  {
+    double calls = 0;
+    double time_us = 0;
+
+    status |= sd_sim_bench_write(busy_times_ns[i], &calls, &time_us);
+    printf(
+      "busy %4lu us: %6.1f calls, %7.1f us per busy wait\n",
+      (unsigned long)(busy_times_ns[i] / 1000),
+      calls - base_calls,
+      time_us - base_time_us
+    );
+  }
+
+  status |= sd_sim_bench_run_sequence();
+
+  return status ? 1 : 0;
+}
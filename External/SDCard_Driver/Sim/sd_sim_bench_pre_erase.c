@@ -0,0 +1,77 @@
+/*
+Multiple block writes with and without the pre-erase hint (ACMD23),
+20 writes of each size
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_write.h"
+#include <stdio.h>
+#include <string.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_WRITES 20U
+#define SD_SIM_BENCH_MAX_BLOCKS 64U
+
+// Static variables ----------------------------------------------------------
+
+static uint8_t sd_sim_bench_data[SD_SIM_BENCH_MAX_BLOCKS * SD_SIM_SECTOR_SIZE];
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  SPI_HandleTypeDef *hspi = sd_card_sim_hspi;
+  sd_sim_config config = sd_sim_bench_get_config();
+  const uint32_t sizes[] = { 2, 8, 32, SD_SIM_BENCH_MAX_BLOCKS };
+
+  config.read_latency_ns = 500000;
+  config.read_gap_ns = 30000;
+  config.write_busy_ns = 1500000;
+  config.write_multiple_busy_ns = 400000;
+  config.pre_erased_busy_ns = 150000;
+  if (sd_sim_bench_power_on(&config))
+    return 1;
+
+  for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    for (uint32_t pre_erase = 0; pre_erase < 2; pre_erase++)
+    {
+      uint32_t number_of_blocks = sizes[i];
+      uint32_t size = number_of_blocks * SD_SIM_SECTOR_SIZE;
+      bool is_correct = true;
+
+      sd_card_sim_reset_stats();
+      for (uint32_t write = 0; write < SD_SIM_BENCH_WRITES; write++)
+      {
+        uint32_t address = 100 + write * SD_SIM_BENCH_MAX_BLOCKS;
+
+        sd_sim_bench_fill(sd_sim_bench_data, size);
+        is_correct &= (pre_erase ?
+          sd_card_write_multiple_data_pre_erase(
+            hspi, address, sd_sim_bench_data, SD_SIM_SECTOR_SIZE,
+            number_of_blocks
+          ) :
+          sd_card_write_multiple_data(
+            hspi, address, sd_sim_bench_data, SD_SIM_SECTOR_SIZE,
+            number_of_blocks
+          )) == SD_OK;
+        is_correct &= memcmp(
+          sd_sim_bench_storage + address * SD_SIM_SECTOR_SIZE,
+          sd_sim_bench_data, size
+        ) == 0;
+      }
+
+      printf(
+        "%2lu blocks %s: %.1f us per block, %.3f MB/s, %s\n",
+        (unsigned long)number_of_blocks,
+        pre_erase ? "ACMD23" : "plain ",
+        sd_sim_bench_get_time_us() / (SD_SIM_BENCH_WRITES * number_of_blocks),
+        sd_sim_bench_get_mb_per_s((uint64_t)SD_SIM_BENCH_WRITES * size),
+        is_correct ? "ok" : "WRONG DATA"
+      );
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,132 @@
+/*
+Read-ahead of single block reads, 3000 reads per workload. Built with
+SD_PREFETCH_DEPTH, the run without it reads through
+sd_card_read_multiple_data, which the prefetcher does not serve
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_read.h"
+#include "sd_driver_write.h"
+#include "sd_driver_prefetch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_READS 3000U
+
+// Structs -------------------------------------------------------------------
+
+typedef enum
+{
+  SD_SIM_BENCH_SEQUENTIAL = 0x0U,
+  SD_SIM_BENCH_RANDOM,
+  // Sequential with a jump for every 10th read and a write for every 100th
+  SD_SIM_BENCH_MIXED,
+  // Sequential up to the last sector, again and again
+  SD_SIM_BENCH_TO_END,
+  SD_SIM_BENCH_WORKLOADS
+} sd_sim_bench_workload;
+
+// Static variables ----------------------------------------------------------
+
+static const char *const sd_sim_bench_names[SD_SIM_BENCH_WORKLOADS] = {
+  "sequential", "random", "mixed 90/10", "to the end"
+};
+
+// Static functions ----------------------------------------------------------
+
+static uint32_t sd_sim_bench_get_address(
+  const sd_sim_bench_workload workload,
+  const uint32_t index,
+  const uint32_t last_address
+)
+{
+  switch (workload)
+  {
+    case SD_SIM_BENCH_SEQUENTIAL:
+      return last_address + 1;
+    case SD_SIM_BENCH_RANDOM:
+      return rand() % SD_SIM_BENCH_SECTORS;
+    case SD_SIM_BENCH_MIXED:
+      return rand() % 10 ? last_address + 1 :
+        rand() % (SD_SIM_BENCH_SECTORS - 100);
+    default:
+      return SD_SIM_BENCH_SECTORS - 300 + index % 300;
+  }
+}
+
+static void sd_sim_bench_run(
+  const sd_sim_bench_workload workload,
+  const bool use_prefetch
+)
+{
+  SPI_HandleTypeDef *hspi = sd_card_sim_hspi;
+  sd_prefetch_stats prefetch_stats = { 0 };
+  uint8_t data[SD_SIM_SECTOR_SIZE];
+  uint32_t address = 1000;
+  bool is_correct = true;
+
+  sd_card_prefetch_reset_stats();
+  sd_card_sim_reset_stats();
+  srand(9);
+
+  for (uint32_t i = 0; i < SD_SIM_BENCH_READS; i++)
+  {
+    address = sd_sim_bench_get_address(workload, i, address);
+    if (workload == SD_SIM_BENCH_MIXED && i % 100 == 50)
+    {
+      memset(data, i, sizeof(data));
+      is_correct &= sd_card_write_data(hspi, address + 1, data, sizeof(data))
+        == SD_OK;
+    }
+
+    is_correct &= (use_prefetch ?
+      sd_card_read_data(hspi, address, data, sizeof(data)) :
+      sd_card_read_multiple_data(hspi, address, data, sizeof(data), 1)) ==
+      SD_OK;
+    is_correct &= memcmp(
+      data, sd_sim_bench_storage + address * SD_SIM_SECTOR_SIZE, sizeof(data)
+    ) == 0;
+  }
+
+  printf(
+    "%-12s %-13s: %.3f MB/s",
+    sd_sim_bench_names[workload],
+    use_prefetch ? "read-ahead" : "no read-ahead",
+    sd_sim_bench_get_mb_per_s((uint64_t)SD_SIM_BENCH_READS * sizeof(data))
+  );
+  if (use_prefetch)
+  {
+    sd_card_prefetch_get_stats(&prefetch_stats);
+    printf(
+      ", %lu streams, accuracy %.1f%%",
+      (unsigned long)prefetch_stats.streams,
+      prefetch_stats.prefetched ?
+        100.0 * prefetch_stats.used / prefetch_stats.prefetched : 0.0
+    );
+  }
+  printf(", %s\n", is_correct ? "ok" : "WRONG DATA");
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  sd_sim_config config = sd_sim_bench_get_config();
+
+  config.read_latency_ns = 800000;
+  config.read_gap_ns = 30000;
+  config.write_busy_ns = 800000;
+  if (sd_sim_bench_power_on(&config))
+    return 1;
+
+  for (uint32_t workload = 0; workload < SD_SIM_BENCH_WORKLOADS; workload++)
+  {
+    sd_sim_bench_run(workload, false);
+    sd_sim_bench_run(workload, true);
+  }
+
+  return 0;
+}
@@ -0,0 +1,88 @@
+/*
+Latency histograms of the transfer phases (SD_PROFILE) for 100 single
+and 10 x 16-block writes and reads and one erase
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_read.h"
+#include "sd_driver_write.h"
+#include "sd_driver_erase.h"
+#include "sd_driver_profile.h"
+#include <stdio.h>
+#include <string.h>
+
+// Static variables ----------------------------------------------------------
+
+static const char *const sd_sim_bench_phase_names[SD_PROFILE_PHASES] = {
+  "command", "R1", "token", "data", "CRC", "busy"
+};
+
+static uint8_t sd_sim_bench_data[16 * SD_SIM_SECTOR_SIZE];
+
+// Static functions ----------------------------------------------------------
+
+static void sd_sim_bench_print(const sd_profile_stats *const stats)
+{
+  // Microseconds per timestamp tick
+  double tick_us = 1e6 / stats->frequency;
+
+  for (uint32_t i = 0; i < SD_PROFILE_PHASES; i++)
+  {
+    const sd_profile_histogram *histogram = &stats->phases[i];
+
+    printf(
+      "%-8s %4lu samples, min %8.1f us, average %8.1f us, "
+      "p50 <= %8.1f us, p99 <= %8.1f us, max %8.1f us\n",
+      sd_sim_bench_phase_names[i],
+      (unsigned long)histogram->count,
+      histogram->min * tick_us,
+      histogram->count ? histogram->total * tick_us / histogram->count : 0.0,
+      sd_card_profile_get_percentile(histogram, 50) * tick_us,
+      sd_card_profile_get_percentile(histogram, 99) * tick_us,
+      histogram->max * tick_us
+    );
+  }
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  SPI_HandleTypeDef *hspi = sd_card_sim_hspi;
+  sd_sim_config config = sd_sim_bench_get_config();
+  sd_profile_stats stats = { 0 };
+  sd_error status = SD_OK;
+
+  config.read_latency_ns = 300000;
+  config.write_busy_ns = 800000;
+  config.erase_busy_ns = 2000000;
+  status |= sd_sim_bench_power_on(&config);
+  sd_card_profile_reset_stats();
+
+  for (uint32_t i = 0; i < 100; i++)
+  {
+    memset(sd_sim_bench_data, i, SD_SIM_SECTOR_SIZE);
+    status |= sd_card_write_data(
+      hspi, i, sd_sim_bench_data, SD_SIM_SECTOR_SIZE
+    );
+    status |= sd_card_read_data(
+      hspi, i, sd_sim_bench_data, SD_SIM_SECTOR_SIZE
+    );
+  }
+  for (uint32_t i = 0; i < 10; i++)
+  {
+    status |= sd_card_write_multiple_data(
+      hspi, 200 + 16 * i, sd_sim_bench_data, SD_SIM_SECTOR_SIZE, 16
+    );
+    status |= sd_card_read_multiple_data(
+      hspi, 200 + 16 * i, sd_sim_bench_data, SD_SIM_SECTOR_SIZE, 16
+    );
+  }
+  status |= sd_card_set_erasable_area(hspi, 1000, 1999);
+  status |= sd_card_erase(hspi);
+
+  sd_card_profile_get_stats(&stats);
+  sd_sim_bench_print(&stats);
+
+  return status ? 1 : 0;
+}
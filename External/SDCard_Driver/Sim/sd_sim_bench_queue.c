@@ -0,0 +1,173 @@
+/*
+Request queue against the same requests carried out one by one:
+100 rounds of 16 reads and writes
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_read.h"
+#include "sd_driver_write.h"
+#include "sd_driver_queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_ROUNDS 100U
+#define SD_SIM_BENCH_REQUESTS 16U
+#define SD_SIM_BENCH_MAX_BLOCKS 4U
+
+// Static variables ----------------------------------------------------------
+
+// Contents the card must have
+static uint8_t sd_sim_bench_reference[
+  SD_SIM_BENCH_SECTORS * SD_SIM_SECTOR_SIZE
+];
+static uint8_t sd_sim_bench_data[SD_SIM_BENCH_REQUESTS][
+  SD_SIM_BENCH_MAX_BLOCKS * SD_SIM_SECTOR_SIZE
+];
+
+// Static functions ----------------------------------------------------------
+
+static sd_error sd_sim_bench_run_direct(const sd_queue_request *const request)
+{
+  SPI_HandleTypeDef *hspi = sd_card_sim_hspi;
+
+  if (request->operation == SD_QUEUE_WRITE)
+    return request->number_of_blocks > 1 ?
+      sd_card_write_multiple_data(
+        hspi, request->address, request->data, SD_SIM_SECTOR_SIZE,
+        request->number_of_blocks
+      ) :
+      sd_card_write_data(
+        hspi, request->address, request->data, SD_SIM_SECTOR_SIZE
+      );
+
+  return request->number_of_blocks > 1 ?
+    sd_card_read_multiple_data(
+      hspi, request->address, request->data, SD_SIM_SECTOR_SIZE,
+      request->number_of_blocks
+    ) :
+    sd_card_read_data(
+      hspi, request->address, request->data, SD_SIM_SECTOR_SIZE
+    );
+}
+
+// Requests take effect in the order of submission
+static bool sd_sim_bench_check(const sd_queue_request *const request)
+{
+  uint8_t *reference =
+    sd_sim_bench_reference + request->address * SD_SIM_SECTOR_SIZE;
+  uint32_t size = request->number_of_blocks * SD_SIM_SECTOR_SIZE;
+
+  if (request->operation == SD_QUEUE_WRITE)
+  {
+    memcpy(reference, request->data, size);
+    return true;
+  }
+
+  return memcmp(reference, request->data, size) == 0;
+}
+
+// mixed: every request continues a sequential stream of 1-4 blocks.
+// Otherwise single blocks, every second one at a random address
+static void sd_sim_bench_run(const bool use_queue, const bool mixed)
+{
+  sd_sim_config config = sd_sim_bench_get_config();
+  sd_queue queue = { 0 };
+  sd_sim_stats stats = { 0 };
+  uint32_t sectors = 0;
+  uint32_t data_commands = 0;
+  bool is_correct = true;
+
+  config.read_latency_ns = 300000;
+  config.read_gap_ns = 50000;
+  config.write_busy_ns = 500000;
+  srand(1);
+  is_correct &= sd_sim_bench_power_on(&config) == SD_OK;
+  memcpy(
+    sd_sim_bench_reference, sd_sim_bench_storage,
+    sizeof(sd_sim_bench_reference)
+  );
+  sd_card_queue_init(&queue, sd_card_sim_hspi, SD_SIM_SECTOR_SIZE);
+  sd_card_sim_reset_stats();
+  srand(7);
+
+  for (uint32_t round = 0; round < SD_SIM_BENCH_ROUNDS; round++)
+  {
+    sd_queue_request requests[SD_SIM_BENCH_REQUESTS] = { 0 };
+    uint32_t address = rand() % (SD_SIM_BENCH_SECTORS - 200U);
+
+    for (uint32_t i = 0; i < SD_SIM_BENCH_REQUESTS; i++)
+    {
+      sd_queue_request *request = &requests[i];
+
+      request->number_of_blocks =
+        1U + rand() % (mixed ? SD_SIM_BENCH_MAX_BLOCKS : 1U);
+      if (mixed || i % 2)
+      {
+        request->address = address;
+        address += request->number_of_blocks;
+      }
+      else
+        request->address = rand() % (SD_SIM_BENCH_SECTORS - 8U);
+      request->operation = rand() % 2 ? SD_QUEUE_WRITE : SD_QUEUE_READ;
+      request->data = sd_sim_bench_data[i];
+      if (request->operation == SD_QUEUE_WRITE)
+        sd_sim_bench_fill(
+          request->data, request->number_of_blocks * SD_SIM_SECTOR_SIZE
+        );
+      sectors += request->number_of_blocks;
+
+      if (use_queue)
+        is_correct &= sd_card_queue_submit(&queue, request) == SD_OK;
+      else
+      {
+        is_correct &= sd_sim_bench_run_direct(request) == SD_OK;
+        is_correct &= sd_sim_bench_check(request);
+        data_commands++;
+      }
+    }
+
+    if (!use_queue)
+      continue;
+
+    is_correct &= sd_card_queue_dispatch(&queue) == SD_OK;
+    for (uint32_t i = 0; i < SD_SIM_BENCH_REQUESTS; i++)
+    {
+      is_correct &= requests[i].is_done && requests[i].status == SD_OK;
+      is_correct &= sd_sim_bench_check(&requests[i]);
+    }
+  }
+
+  is_correct &= memcmp(
+    sd_sim_bench_storage, sd_sim_bench_reference,
+    sizeof(sd_sim_bench_reference)
+  ) == 0;
+  if (use_queue)
+    data_commands = queue.stats.runs;
+
+  sd_card_sim_get_stats(&stats);
+  printf(
+    "%s %-27s: %.3f commands per sector, %lu data commands, %.1f KB/s, %s\n",
+    use_queue ? "queue " : "direct",
+    mixed ? "sequential 1-4 blocks" : "random + sequential 1 block",
+    (double)stats.commands / sectors,
+    (unsigned long)data_commands,
+    sectors * (double)SD_SIM_SECTOR_SIZE / 1024 / (stats.time_ns / 1e9),
+    is_correct ? "ok" : "WRONG DATA"
+  );
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  for (uint32_t use_queue = 0; use_queue < 2; use_queue++)
+  {
+    sd_sim_bench_run(use_queue, true);
+    sd_sim_bench_run(use_queue, false);
+  }
+
+  return 0;
+}
@@ -0,0 +1,83 @@
+/*
+64-block read with one CRC error at block 51: only the rest of the
+transfer is read again. Run with CMD12 and with CMD23 bounded reads
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_read.h"
+#include <stdio.h>
+#include <string.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_BLOCKS 64U
+#define SD_SIM_BENCH_ADDRESS 1000U
+// Blocks received before the corrupted one
+#define SD_SIM_BENCH_FAILED_BLOCK 50U
+
+// Static variables ----------------------------------------------------------
+
+static uint8_t sd_sim_bench_data[SD_SIM_BENCH_BLOCKS * SD_SIM_SECTOR_SIZE];
+
+// Static functions ----------------------------------------------------------
+
+static double sd_sim_bench_read(sd_read_retry_stats *const retry_stats)
+{
+  memset(sd_sim_bench_data, 0, sizeof(sd_sim_bench_data));
+  sd_card_sim_reset_stats();
+
+  if (sd_card_read_multiple_data_with_stats(
+    sd_card_sim_hspi, SD_SIM_BENCH_ADDRESS, sd_sim_bench_data,
+    SD_SIM_SECTOR_SIZE, SD_SIM_BENCH_BLOCKS, retry_stats
+  ) || memcmp(
+    sd_sim_bench_data,
+    sd_sim_bench_storage + SD_SIM_BENCH_ADDRESS * SD_SIM_SECTOR_SIZE,
+    sizeof(sd_sim_bench_data)
+  ))
+    return -1.0;
+
+  return sd_sim_bench_get_time_us();
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  sd_sim_config config = sd_sim_bench_get_config();
+
+  config.read_latency_ns = 500000;
+  config.read_gap_ns = 30000;
+  config.write_busy_ns = 1500000;
+
+  for (uint32_t cmd23 = 0; cmd23 < 2; cmd23++)
+  {
+    sd_read_retry_stats retry_stats = { 0 };
+
+    config.block_count = cmd23;
+    if (sd_sim_bench_power_on(&config))
+      return 1;
+
+    double clean_time = sd_sim_bench_read(&retry_stats);
+    sd_card_sim_inject_read_error(SD_SIM_BENCH_FAILED_BLOCK);
+    double fault_time = sd_sim_bench_read(&retry_stats);
+
+    if (clean_time < 0 || fault_time < 0)
+    {
+      printf("%s: read failed\n", cmd23 ? "CMD23" : "CMD12");
+      continue;
+    }
+    printf(
+      "%s: clean %.1f us, fault at block %lu %.1f us "
+      "(+%.1f us, %lu retry; a whole re-read would add %.1f us)\n",
+      cmd23 ? "CMD23" : "CMD12",
+      clean_time,
+      (unsigned long)retry_stats.blocks[0],
+      fault_time,
+      fault_time - clean_time,
+      (unsigned long)retry_stats.retries,
+      clean_time
+    );
+  }
+
+  return 0;
+}
@@ -0,0 +1,77 @@
+/*
+Recovery from a 64-block write that fails at block 41: the whole write
+repeated against a resumable write continued after ACMD22
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_write.h"
+#include <stdio.h>
+#include <string.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_BLOCKS 64U
+// Accepted blocks before the rejected one
+#define SD_SIM_BENCH_FAILED_BLOCK 40U
+#define SD_SIM_BENCH_MAX_CALLS 5U
+
+// Static variables ----------------------------------------------------------
+
+static uint8_t sd_sim_bench_data[SD_SIM_BENCH_BLOCKS * SD_SIM_SECTOR_SIZE];
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  SPI_HandleTypeDef *hspi = sd_card_sim_hspi;
+  sd_sim_config config = sd_sim_bench_get_config();
+
+  config.read_latency_ns = 500000;
+  config.read_gap_ns = 30000;
+  config.write_busy_ns = 1500000;
+  config.write_multiple_busy_ns = 400000;
+  if (sd_sim_bench_power_on(&config))
+    return 1;
+
+  for (uint32_t resume = 0; resume < 2; resume++)
+  {
+    uint32_t address = 1000 + resume * 100;
+    uint32_t written_blocks = 0;
+    uint32_t calls = 0;
+    sd_sim_stats stats = { 0 };
+    sd_error status = SD_OK;
+
+    sd_sim_bench_fill(sd_sim_bench_data, sizeof(sd_sim_bench_data));
+    sd_card_sim_inject_write_error(SD_SIM_BENCH_FAILED_BLOCK);
+    sd_card_sim_reset_stats();
+
+    do
+    {
+      status = resume ?
+        sd_card_write_multiple_data_resumable(
+          hspi, address, sd_sim_bench_data, SD_SIM_SECTOR_SIZE,
+          SD_SIM_BENCH_BLOCKS, &written_blocks
+        ) :
+        sd_card_write_multiple_data(
+          hspi, address, sd_sim_bench_data, SD_SIM_SECTOR_SIZE,
+          SD_SIM_BENCH_BLOCKS
+        );
+      calls++;
+    } while (status && calls < SD_SIM_BENCH_MAX_CALLS);
+
+    sd_card_sim_get_stats(&stats);
+    printf(
+      "%s: %lu calls, %.1f us, %llu bytes clocked, %s\n",
+      resume ? "resume " : "rewrite",
+      (unsigned long)calls,
+      stats.time_ns / 1e3,
+      (unsigned long long)stats.bytes,
+      status == SD_OK && memcmp(
+        sd_sim_bench_storage + address * SD_SIM_SECTOR_SIZE,
+        sd_sim_bench_data, sizeof(sd_sim_bench_data)
+      ) == 0 ? "ok" : "WRONG DATA"
+    );
+  }
+
+  return 0;
+}
@@ -0,0 +1,87 @@
+/*
+Read stream of 200 blocks with a consumer of increasing cost per block.
+Built with SD_USE_DMA, so the next block is received while the consumer
+works. A stall is a block the consumer had to wait for
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_read.h"
+#include <stdio.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_STREAM_BLOCKS 200U
+#define SD_SIM_BENCH_BUFFERS 3U
+
+// Structs -------------------------------------------------------------------
+
+typedef struct
+{
+  uint32_t cost_ns; // Time the consumer spends on every block
+  uint32_t blocks; // Blocks to take before stopping the stream
+} sd_sim_bench_consumer;
+
+// Static variables ----------------------------------------------------------
+
+static uint8_t sd_sim_bench_buffers[SD_SIM_BENCH_BUFFERS * SD_SIM_SECTOR_SIZE];
+
+// Static functions ----------------------------------------------------------
+
+static bool sd_sim_bench_consume(
+  uint8_t *const data,
+  const uint32_t block_index,
+  void *const context
+)
+{
+  const sd_sim_bench_consumer *consumer = context;
+
+  sd_card_sim_wait(consumer->cost_ns);
+  return block_index + 1 < consumer->blocks;
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  sd_sim_config config = sd_sim_bench_get_config();
+  const uint32_t costs_us[] = { 0, 50, 100, 200, 300, 500 };
+  sd_error status = SD_OK;
+
+  config.read_latency_ns = 500000;
+  config.read_gap_ns = 30000;
+  config.stop_busy_ns = 20000;
+  status |= sd_sim_bench_power_on(&config);
+
+  for (uint32_t i = 0; i < sizeof(costs_us) / sizeof(costs_us[0]); i++)
+  {
+    sd_sim_bench_consumer consumer = {
+      .cost_ns = costs_us[i] * 1000,
+      .blocks = SD_SIM_BENCH_STREAM_BLOCKS
+    };
+    sd_read_stream_stats stats = { 0 };
+
+    sd_card_sim_reset_stats();
+    status |= sd_card_read_stream(
+      sd_card_sim_hspi,
+      100,
+      sd_sim_bench_buffers,
+      SD_SIM_BENCH_BUFFERS,
+      SD_SIM_SECTOR_SIZE,
+      sd_sim_bench_consume,
+      &consumer,
+      &stats
+    );
+
+    printf(
+      "consumer %3lu us per block: %.3f MB/s, %lu blocks, %lu stalls\n",
+      (unsigned long)costs_us[i],
+      sd_sim_bench_get_mb_per_s(
+        (uint64_t)stats.blocks * SD_SIM_SECTOR_SIZE
+      ),
+      (unsigned long)stats.blocks,
+      (unsigned long)stats.stalls
+    );
+  }
+
+  return status ? 1 : 0;
+}
@@ -0,0 +1,69 @@
+/*
+Card timeouts derived from the registers, and how long a reset takes to
+fail without a card
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_clock.h"
+#include "sd_driver_timeout.h"
+#include <stdio.h>
+
+// Static functions ----------------------------------------------------------
+
+static void sd_sim_bench_print_timeouts(const char *const name)
+{
+  // The whole storage
+  uint32_t end_address = (SD_SIM_BENCH_SECTORS - 1) *
+    sd_card_get_address_step(SD_SIM_SECTOR_SIZE);
+
+  printf(
+    "%s at %lu Hz: command %lu us, read %lu us, write %lu us, "
+    "erase of one block %lu us, of %lu MB %lu us\n",
+    name,
+    (unsigned long)sd_card_get_clock(sd_card_sim_hspi),
+    (unsigned long)sd_card_timeouts.command,
+    (unsigned long)sd_card_timeouts.read,
+    (unsigned long)sd_card_timeouts.write,
+    (unsigned long)sd_card_get_erase_timeout(0, 0),
+    (unsigned long)(SD_SIM_BENCH_SECTORS / 2048U),
+    (unsigned long)sd_card_get_erase_timeout(0, end_address)
+  );
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  sd_sim_config config = sd_sim_bench_get_config();
+  sd_error status = SD_OK;
+
+  config.read_latency_ns = 500000;
+  config.write_busy_ns = 1500000;
+  status |= sd_sim_bench_power_on(&config);
+  sd_sim_bench_print_timeouts("SDHC");
+
+  config.high_capacity = false;
+  status |= sd_sim_bench_power_on(&config);
+  sd_sim_bench_print_timeouts("SDSC");
+
+  // SDSC timeouts follow TAAC and NSAC, here 100 us and 1000 clocks
+  sd_info info = {
+    .access_time = 100000.0f,
+    .access_clocks = 1000,
+    .write_speed_factor = 4
+  };
+  sd_card_timeouts_init(sd_card_sim_hspi, &info, NULL);
+  sd_sim_bench_print_timeouts("SDSC, 100 us + 1000 clocks");
+
+  config.is_absent = true;
+  sd_card_sim_init(&config);
+  uint64_t start_ns = sd_card_sim_get_time_ns();
+  sd_error absent_status = sd_card_reset(sd_card_sim_hspi, true);
+  printf(
+    "no card: reset status %d after %.2f ms\n",
+    absent_status,
+    (sd_card_sim_get_time_ns() - start_ns) / 1e6
+  );
+
+  return status ? 1 : 0;
+}
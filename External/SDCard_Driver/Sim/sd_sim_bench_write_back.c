@@ -0,0 +1,151 @@
+/*
+Write-back cache on 1000 transactions: each one updates 4 log and 2 index
+sectors, then writes a commit sector after a barrier. Every 8th commit is
+written through (FUA) and followed by a flush. Built with SD_CACHE_SIZE,
+compared with direct CMD24 writes
+*/
+
+#include "sd_sim_bench.h"
+#include "sd_driver_read.h"
+#include "sd_driver_write.h"
+#include "sd_driver_erase.h"
+#include "sd_driver_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_BENCH_TRANSACTIONS 1000U
+
+// Static variables ----------------------------------------------------------
+
+static uint8_t sd_sim_bench_reference[
+  SD_SIM_BENCH_SECTORS * SD_SIM_SECTOR_SIZE
+];
+
+// Static functions ----------------------------------------------------------
+
+static bool sd_sim_bench_write(
+  const bool write_back,
+  const uint32_t address,
+  const uint8_t *const data,
+  const bool force_unit_access
+)
+{
+  sd_error status = write_back ?
+    sd_card_cache_write_back(
+      sd_card_sim_hspi, address, data, SD_SIM_SECTOR_SIZE, force_unit_access
+    ) :
+    sd_card_write_data(sd_card_sim_hspi, address, data, SD_SIM_SECTOR_SIZE);
+
+  memcpy(
+    sd_sim_bench_reference + address * SD_SIM_SECTOR_SIZE, data,
+    SD_SIM_SECTOR_SIZE
+  );
+  return status == SD_OK;
+}
+
+static bool sd_sim_bench_is_read_back(
+  const uint32_t address,
+  const uint32_t number_of_blocks
+)
+{
+  uint8_t data[8 * SD_SIM_SECTOR_SIZE];
+
+  return sd_card_read_multiple_data(
+    sd_card_sim_hspi, address, data, SD_SIM_SECTOR_SIZE, number_of_blocks
+  ) == SD_OK && memcmp(
+    data, sd_sim_bench_reference + address * SD_SIM_SECTOR_SIZE,
+    number_of_blocks * SD_SIM_SECTOR_SIZE
+  ) == 0;
+}
+
+static void sd_sim_bench_run(const bool write_back)
+{
+  sd_sim_config config = sd_sim_bench_get_config();
+  sd_cache_stats cache_stats = { 0 };
+  uint8_t data[SD_SIM_SECTOR_SIZE];
+  uint32_t writes = 0;
+  bool is_correct = true;
+
+  config.read_latency_ns = 300000;
+  config.read_gap_ns = 50000;
+  config.write_busy_ns = 800000;
+  srand(1);
+  is_correct &= sd_sim_bench_power_on(&config) == SD_OK;
+  memcpy(
+    sd_sim_bench_reference, sd_sim_bench_storage,
+    sizeof(sd_sim_bench_reference)
+  );
+  sd_card_sim_reset_stats();
+  sd_card_cache_reset_stats();
+  srand(5);
+
+  for (uint32_t transaction = 0; transaction < SD_SIM_BENCH_TRANSACTIONS;
+    transaction++)
+  {
+    bool is_durable = transaction % 8 == 7;
+
+    for (uint32_t i = 0; i < 6; i++)
+    {
+      uint32_t address = i < 4 ?
+        200 + (transaction % 16) * 2 + (i & 1) : 10 + rand() % 4;
+      uint32_t offset = rand() % (SD_SIM_SECTOR_SIZE - 1);
+
+      memcpy(
+        data, sd_sim_bench_reference + address * SD_SIM_SECTOR_SIZE,
+        sizeof(data)
+      );
+      data[offset] = rand();
+      data[offset + 1] = rand();
+      is_correct &= sd_sim_bench_write(write_back, address, data, false);
+      writes++;
+    }
+
+    if (write_back)
+      sd_card_cache_barrier();
+    memset(data, transaction, sizeof(data));
+    is_correct &= sd_sim_bench_write(write_back, 0, data, is_durable);
+    writes++;
+    if (write_back)
+    {
+      sd_card_cache_barrier();
+      if (is_durable)
+        is_correct &= sd_card_cache_flush(sd_card_sim_hspi) == SD_OK;
+    }
+
+    // Reads see the dirty sectors
+    if (transaction % 50 == 0)
+      is_correct &= sd_sim_bench_is_read_back(198, 8) &&
+        sd_sim_bench_is_read_back(11, 1);
+  }
+
+  if (write_back)
+    is_correct &= sd_card_cache_flush(sd_card_sim_hspi) == SD_OK;
+  is_correct &= memcmp(
+    sd_sim_bench_storage, sd_sim_bench_reference,
+    sizeof(sd_sim_bench_reference)
+  ) == 0;
+
+  sd_card_cache_get_stats(&cache_stats);
+  printf(
+    "%s: %lu writes, %lu program cycles in %lu runs, %.1f ms, %s\n",
+    write_back ? "write-back" : "direct    ",
+    (unsigned long)writes,
+    (unsigned long)(write_back ? cache_stats.flushed_blocks : writes),
+    (unsigned long)(write_back ? cache_stats.flush_runs : writes),
+    sd_sim_bench_get_time_us() / 1e3,
+    is_correct ? "ok" : "WRONG DATA"
+  );
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  sd_sim_bench_run(false);
+  sd_sim_bench_run(true);
+
+  return 0;
+}
@@ -0,0 +1,884 @@
+/*
+Tests of the driver on the simulated card. "make sim-test" builds and runs
+them with several feature sets, a failed check makes the program fail
+*/
+
+#include "sd_driver_init.h"
+#include "sd_driver_clock.h"
+#include "sd_driver_read.h"
+#include "sd_driver_write.h"
+#include "sd_driver_erase.h"
+#include "sd_driver_async.h"
+#include "sd_driver_queue.h"
+#include "sd_driver_cache.h"
+#include "sd_driver_coalesce.h"
+#include "sd_driver_transport_sim.h"
+#include "crc-buffer.h"
+#include <stdio.h>
+#include <string.h>
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_TEST_SECTORS 4096U
+
+// Size of the data buffers in blocks
+#define SD_SIM_TEST_BLOCKS 16U
+
+// Blocks the stream consumer takes before it stops the stream
+#define SD_SIM_TEST_STREAM_BLOCKS 10U
+
+// A failed check is reported, the test goes on
+#define SD_SIM_CHECK(condition) \
+  sd_sim_test_check((condition), #condition, __LINE__)
+
+// Functions -----------------------------------------------------------------
+
+// The bit at a time CRC7 (crc_bitwise.o, see the Makefile). The driver
+// uses the table version
+uint8_t crc_bitwise_calculate_crc_7(
+  crc_buffer_7* buffer,
+  uint8_t* data,
+  const uint8_t data_length
+);
+
+// Static variables ----------------------------------------------------------
+
+static uint8_t sd_sim_test_storage[SD_SIM_TEST_SECTORS * SD_SIM_SECTOR_SIZE];
+static uint8_t sd_sim_test_data[SD_SIM_TEST_BLOCKS * SD_SIM_SECTOR_SIZE];
+static uint8_t sd_sim_test_buffer[SD_SIM_TEST_BLOCKS * SD_SIM_SECTOR_SIZE];
+
+static const char *sd_sim_test_name = "";
+static uint32_t sd_sim_test_checks = 0;
+static uint32_t sd_sim_test_failures = 0;
+
+// Static functions ----------------------------------------------------------
+
+static void sd_sim_test_check(
+  const bool condition,
+  const char *const text,
+  const int line
+)
+{
+  sd_sim_test_checks++;
+  if (condition)
+    return;
+
+  sd_sim_test_failures++;
+  printf("FAIL %s, line %d: %s\n", sd_sim_test_name, line, text);
+}
+
+// SDHC card with typical timings
+static sd_sim_config sd_sim_test_get_config(void)
+{
+  return (sd_sim_config) {
+    .storage = sd_sim_test_storage,
+    .sectors = SD_SIM_TEST_SECTORS,
+    .high_capacity = true,
+    .high_speed = true,
+    .read_latency_ns = 100000,
+    .read_gap_ns = 20000,
+    .write_busy_ns = 300000,
+    .stop_busy_ns = 20000,
+    .erase_busy_ns = 1000000,
+    .init_polls = 5,
+    .call_overhead_ns = 1000
+  };
+}
+
+// Different contents for every seed
+static void sd_sim_test_fill(
+  uint8_t *const data,
+  const uint32_t size,
+  const uint32_t seed
+)
+{
+  uint32_t value = seed * 2654435761U + 1U;
+
+  for (uint32_t i = 0; i < size; i++)
+  {
+    value = value * 1103515245U + 12345U;
+    data[i] = value >> 16;
+  }
+}
+
+// Powers the card on with a known storage and initializes it
+static sd_error sd_sim_test_power_on(const sd_sim_config *const config)
+{
+  sd_sim_test_fill(sd_sim_test_storage, sizeof(sd_sim_test_storage), 1);
+  sd_card_sim_init(config);
+
+  return sd_card_reset(sd_card_sim_hspi, true);
+}
+
+// Card address of the sector
+static uint32_t sd_sim_test_get_address(const uint32_t sector)
+{
+  return sector * sd_card_get_address_step(SD_SIM_SECTOR_SIZE);
+}
+
+static bool sd_sim_test_is_stored(
+  const uint32_t sector,
+  const uint8_t *const data,
+  const uint32_t number_of_blocks
+)
+{
+  return memcmp(
+    sd_sim_test_storage + sector * SD_SIM_SECTOR_SIZE,
+    data,
+    number_of_blocks * SD_SIM_SECTOR_SIZE
+  ) == 0;
+}
+
+// The card still answers: a block read after a failure returns the data
+static bool sd_sim_test_is_readable(const uint32_t sector)
+{
+  sd_error status = sd_card_read_data(
+    sd_card_sim_hspi,
+    sd_sim_test_get_address(sector),
+    sd_sim_test_buffer,
+    SD_SIM_SECTOR_SIZE
+  );
+
+  return status == SD_OK && sd_sim_test_is_stored(sector, sd_sim_test_buffer, 1);
+}
+
+static void sd_sim_test_async_run(sd_async_request *const request)
+{
+  sd_error status = sd_card_async_submit(sd_card_sim_hspi, request);
+  SD_SIM_CHECK(status == SD_OK);
+  if (status)
+    return;
+
+  while (request->state != SD_ASYNC_DONE)
+    sd_card_async_process();
+}
+
+// Tests ---------------------------------------------------------------------
+
+// The frames with constant arguments equal the ones built at run time,
+// and the CRC7 table gives the same result as the bitwise calculation
+static void sd_sim_test_command_frames(void)
+{
+  const struct
+  {
+    const sd_command *frame;
+    uint8_t cmd_num;
+    uint32_t arg;
+  } frames[] = {
+    { &sd_cmd_go_idle_state, 0, 0 },
+    { &sd_cmd_send_if_cond, 8, 0x155 },
+    { &sd_cmd_send_csd, 9, 0 },
+    { &sd_cmd_stop_transmission, 12, 0 },
+    { &sd_cmd_erase, 38, 0 },
+    { &sd_cmd_app, 55, 0 },
+    { &sd_cmd_read_ocr, 58, 0 },
+    { &sd_cmd_crc_off, 59, 0 },
+    { &sd_cmd_crc_on, 59, 1 },
+    { &sd_acmd_send_op_cond, 41, 0 }
+  };
+
+  for (uint32_t i = 0; i < sizeof(frames) / sizeof(frames[0]); i++)
+  {
+    sd_command cmd = sd_card_get_cmd(frames[i].cmd_num, frames[i].arg);
+
+    SD_SIM_CHECK(memcmp(&cmd, frames[i].frame, sizeof(cmd)) == 0);
+  }
+
+  // Command frames (40 bits) and CID/CSD contents (120 bits)
+  uint32_t mismatches = 0;
+
+  for (uint32_t seed = 0; seed < 1000; seed++)
+  {
+    uint8_t data[15] = { 0 };
+    crc_buffer_7 table_buffer = 0;
+    crc_buffer_7 bitwise_buffer = 0;
+    uint8_t length = seed % 2 ? 15 : 5;
+
+    sd_sim_test_fill(data, sizeof(data), seed);
+    data[0] = 0x40 | (data[0] & 0x3f);
+    if (crc_buffer_calculate_crc_7(&table_buffer, data, length) !=
+      crc_bitwise_calculate_crc_7(&bitwise_buffer, data, length))
+    {
+      mismatches++;
+    }
+  }
+  SD_SIM_CHECK(mismatches == 0);
+}
+
+static void sd_sim_test_reset(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  SD_SIM_CHECK(sd_card_status.capacity == HIGH_OR_EXTENDED);
+  SD_SIM_CHECK(sd_sim_test_is_readable(7));
+
+  config.high_capacity = false;
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  SD_SIM_CHECK(sd_card_status.capacity != HIGH_OR_EXTENDED);
+  SD_SIM_CHECK(sd_sim_test_is_readable(7));
+
+  config.version_1 = true;
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_readable(7));
+
+  // On a 72 MHz bus the high speed ceiling (50 MHz) gives 36 MHz, the
+  // default speed from the CSD (TRAN_SPEED, 25 MHz) gives 18 MHz
+  config = sd_sim_test_get_config();
+  config.bus_clock = 72000000;
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  SD_SIM_CHECK(sd_card_get_clock(sd_card_sim_hspi) == 36000000);
+
+  config.high_speed = false;
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  SD_SIM_CHECK(sd_card_get_clock(sd_card_sim_hspi) == 18000000);
+
+  config.high_speed = true;
+  config.high_speed_rejected = true;
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  SD_SIM_CHECK(sd_card_get_clock(sd_card_sim_hspi) == 18000000);
+  SD_SIM_CHECK(sd_sim_test_is_readable(7));
+
+  config = sd_sim_test_get_config();
+  config.is_absent = true;
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) != SD_OK);
+}
+
+static void sd_sim_test_single_block(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+
+  sd_sim_test_fill(sd_sim_test_data, SD_SIM_SECTOR_SIZE, 2);
+  SD_SIM_CHECK(sd_card_write_data(
+    sd_card_sim_hspi,
+    sd_sim_test_get_address(100),
+    sd_sim_test_data,
+    SD_SIM_SECTOR_SIZE
+  ) == SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_stored(100, sd_sim_test_data, 1));
+  SD_SIM_CHECK(sd_sim_test_is_readable(100));
+  SD_SIM_CHECK(sd_sim_test_is_readable(SD_SIM_TEST_SECTORS - 1));
+
+  // Out of range
+  SD_SIM_CHECK(sd_card_read_data(
+    sd_card_sim_hspi,
+    sd_sim_test_get_address(SD_SIM_TEST_SECTORS),
+    sd_sim_test_buffer,
+    SD_SIM_SECTOR_SIZE
+  ) != SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_readable(100));
+}
+
+static void sd_sim_test_multiple_block(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+
+  // With CMD12 and with CMD23 bounded reads
+  for (uint32_t block_count = 0; block_count < 2; block_count++)
+  {
+    config.block_count = block_count;
+    SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+
+    sd_sim_test_fill(sd_sim_test_data, sizeof(sd_sim_test_data), 3);
+    SD_SIM_CHECK(sd_card_write_multiple_data(
+      sd_card_sim_hspi,
+      sd_sim_test_get_address(200),
+      sd_sim_test_data,
+      SD_SIM_SECTOR_SIZE,
+      SD_SIM_TEST_BLOCKS
+    ) == SD_OK);
+    SD_SIM_CHECK(sd_sim_test_is_stored(
+      200, sd_sim_test_data, SD_SIM_TEST_BLOCKS
+    ));
+
+    memset(sd_sim_test_buffer, 0, sizeof(sd_sim_test_buffer));
+    SD_SIM_CHECK(sd_card_read_multiple_data(
+      sd_card_sim_hspi,
+      sd_sim_test_get_address(200),
+      sd_sim_test_buffer,
+      SD_SIM_SECTOR_SIZE,
+      SD_SIM_TEST_BLOCKS
+    ) == SD_OK);
+    SD_SIM_CHECK(memcmp(
+      sd_sim_test_buffer, sd_sim_test_data, sizeof(sd_sim_test_data)
+    ) == 0);
+    SD_SIM_CHECK(sd_sim_test_is_readable(300));
+  }
+}
+
+static void sd_sim_test_erase(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+
+  SD_SIM_CHECK(sd_card_set_erasable_area(
+    sd_card_sim_hspi, sd_sim_test_get_address(50), sd_sim_test_get_address(52)
+  ) == SD_OK);
+  SD_SIM_CHECK(sd_card_erase(sd_card_sim_hspi) == SD_OK);
+  // CS is released once the card is no longer busy
+  SD_SIM_CHECK(!sd_card_sim_is_selected());
+
+  memset(sd_sim_test_data, 0, 3 * SD_SIM_SECTOR_SIZE);
+  SD_SIM_CHECK(sd_sim_test_is_stored(50, sd_sim_test_data, 3));
+  SD_SIM_CHECK(!sd_sim_test_is_stored(53, sd_sim_test_data, 1));
+  SD_SIM_CHECK(sd_sim_test_is_readable(50));
+}
+
+static void sd_sim_test_write_session(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  sd_write_session session = { 0 };
+  sd_error status = SD_OK;
+
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  sd_sim_test_fill(sd_sim_test_data, 4 * SD_SIM_SECTOR_SIZE, 4);
+
+  // The gap before the last block opens a new CMD25
+  uint32_t sectors[] = { 400, 401, 402, 404 };
+  status |= sd_card_write_session_begin(
+    sd_card_sim_hspi, &session, sd_sim_test_get_address(400),
+    SD_SIM_SECTOR_SIZE
+  );
+  for (uint32_t i = 0; i < 4; i++)
+  {
+    status |= sd_card_write_session_append(
+      &session,
+      sd_sim_test_get_address(sectors[i]),
+      sd_sim_test_data + i * SD_SIM_SECTOR_SIZE
+    );
+  }
+  status |= sd_card_write_session_end(&session);
+
+  SD_SIM_CHECK(status == SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_stored(400, sd_sim_test_data, 3));
+  SD_SIM_CHECK(sd_sim_test_is_stored(
+    404, sd_sim_test_data + 3 * SD_SIM_SECTOR_SIZE, 1
+  ));
+  SD_SIM_CHECK(sd_sim_test_is_readable(403));
+}
+
+// A failed block closes the CMD25 of the session, other commands work
+// and the next block opens a new one
+static void sd_sim_test_write_session_error(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  sd_write_session session = { 0 };
+
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  sd_sim_test_fill(sd_sim_test_data, 4 * SD_SIM_SECTOR_SIZE, 10);
+
+  SD_SIM_CHECK(sd_card_write_session_begin(
+    sd_card_sim_hspi, &session, sd_sim_test_get_address(500),
+    SD_SIM_SECTOR_SIZE
+  ) == SD_OK);
+  sd_card_sim_inject_write_error(1);
+  for (uint32_t i = 0; i < 2; i++)
+  {
+    sd_error status = sd_card_write_session_append(
+      &session,
+      sd_sim_test_get_address(500 + i),
+      sd_sim_test_data + i * SD_SIM_SECTOR_SIZE
+    );
+    SD_SIM_CHECK(i == 0 ? status == SD_OK : status != SD_OK);
+  }
+  SD_SIM_CHECK(sd_sim_test_is_readable(520));
+
+  for (uint32_t i = 1; i < 4; i++)
+  {
+    SD_SIM_CHECK(sd_card_write_session_append(
+      &session,
+      sd_sim_test_get_address(500 + i),
+      sd_sim_test_data + i * SD_SIM_SECTOR_SIZE
+    ) == SD_OK);
+  }
+  SD_SIM_CHECK(sd_card_write_session_end(&session) == SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_stored(500, sd_sim_test_data, 4));
+  SD_SIM_CHECK(sd_sim_test_is_readable(520));
+}
+
+// A block rejected by the card fails the write, the card is usable after it
+// and the resumable write continues from the rejected block
+static void sd_sim_test_write_error(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  uint32_t written_blocks = 0;
+
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  sd_sim_test_fill(sd_sim_test_data, 8 * SD_SIM_SECTOR_SIZE, 5);
+
+  sd_card_sim_inject_write_error(3);
+  SD_SIM_CHECK(sd_card_write_multiple_data(
+    sd_card_sim_hspi,
+    sd_sim_test_get_address(600),
+    sd_sim_test_data,
+    SD_SIM_SECTOR_SIZE,
+    8
+  ) != SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_readable(600));
+
+  sd_card_sim_inject_write_error(5);
+  SD_SIM_CHECK(sd_card_write_multiple_data_resumable(
+    sd_card_sim_hspi,
+    sd_sim_test_get_address(700),
+    sd_sim_test_data,
+    SD_SIM_SECTOR_SIZE,
+    8,
+    &written_blocks
+  ) != SD_OK);
+  SD_SIM_CHECK(written_blocks == 5);
+  SD_SIM_CHECK(sd_card_write_multiple_data_resumable(
+    sd_card_sim_hspi,
+    sd_sim_test_get_address(700),
+    sd_sim_test_data,
+    SD_SIM_SECTOR_SIZE,
+    8,
+    &written_blocks
+  ) == SD_OK);
+  SD_SIM_CHECK(written_blocks == 8);
+  SD_SIM_CHECK(sd_sim_test_is_stored(700, sd_sim_test_data, 8));
+}
+
+// A block with a wrong CRC is read again
+// Copies every block into context and stops the stream after
+// SD_SIM_TEST_STREAM_BLOCKS blocks
+static bool sd_sim_test_consume_block(
+  uint8_t *const data,
+  const uint32_t block_index,
+  void *const context
+)
+{
+  uint8_t *copy = context;
+
+  memcpy(copy + block_index * SD_SIM_SECTOR_SIZE, data, SD_SIM_SECTOR_SIZE);
+  return block_index + 1 < SD_SIM_TEST_STREAM_BLOCKS;
+}
+
+static void sd_sim_test_read_stream(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  sd_read_stream_stats stats = { 0 };
+  uint8_t buffers[3 * SD_SIM_SECTOR_SIZE];
+
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  memset(sd_sim_test_buffer, 0, sizeof(sd_sim_test_buffer));
+
+  SD_SIM_CHECK(sd_card_read_stream(
+    sd_card_sim_hspi,
+    sd_sim_test_get_address(500),
+    buffers,
+    3,
+    SD_SIM_SECTOR_SIZE,
+    sd_sim_test_consume_block,
+    sd_sim_test_buffer,
+    &stats
+  ) == SD_OK);
+  SD_SIM_CHECK(stats.blocks == SD_SIM_TEST_STREAM_BLOCKS);
+  SD_SIM_CHECK(sd_sim_test_is_stored(
+    500, sd_sim_test_buffer, SD_SIM_TEST_STREAM_BLOCKS
+  ));
+  // CMD12 ended the transfer after the consumer stopped it
+  SD_SIM_CHECK(!sd_card_sim_is_sending());
+  SD_SIM_CHECK(sd_sim_test_is_readable(500));
+}
+
+static void sd_sim_test_read_error(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  sd_read_retry_stats stats = { 0 };
+
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+
+  sd_card_sim_inject_read_error(5);
+  SD_SIM_CHECK(sd_card_read_multiple_data_with_stats(
+    sd_card_sim_hspi,
+    sd_sim_test_get_address(800),
+    sd_sim_test_buffer,
+    SD_SIM_SECTOR_SIZE,
+    SD_SIM_TEST_BLOCKS,
+    &stats
+  ) == SD_OK);
+  SD_SIM_CHECK(stats.retries == 1 && stats.blocks[0] == 5);
+  SD_SIM_CHECK(sd_sim_test_is_stored(
+    800, sd_sim_test_buffer, SD_SIM_TEST_BLOCKS
+  ));
+  SD_SIM_CHECK(sd_sim_test_is_readable(800));
+}
+
+// CRC errors in a row lower the clock by one step. A good block in
+// between starts the count again
+static void sd_sim_test_clock_step_down(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  uint32_t sector = 1400;
+
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  uint32_t clock = sd_card_get_clock(sd_card_sim_hspi);
+
+  for (uint32_t i = 0; i + 1 < SD_CLOCK_CRC_ERROR_LIMIT; i++)
+  {
+    sd_card_sim_inject_read_error(0);
+    // Sectors apart, so neither the cache nor read-ahead serves them
+    sector += 10;
+    SD_SIM_CHECK(sd_card_read_data(
+      sd_card_sim_hspi,
+      sd_sim_test_get_address(sector),
+      sd_sim_test_buffer,
+      SD_SIM_SECTOR_SIZE
+    ) == SD_CRC_ERROR);
+  }
+  sector += 10;
+  SD_SIM_CHECK(sd_sim_test_is_readable(sector));
+  SD_SIM_CHECK(sd_card_get_clock(sd_card_sim_hspi) == clock);
+
+  for (uint32_t i = 0; i < SD_CLOCK_CRC_ERROR_LIMIT; i++)
+  {
+    sd_card_sim_inject_read_error(0);
+    sector += 10;
+    SD_SIM_CHECK(sd_card_read_data(
+      sd_card_sim_hspi,
+      sd_sim_test_get_address(sector),
+      sd_sim_test_buffer,
+      SD_SIM_SECTOR_SIZE
+    ) == SD_CRC_ERROR);
+  }
+  SD_SIM_CHECK(sd_card_get_clock(sd_card_sim_hspi) == clock / 2);
+  sector += 10;
+  SD_SIM_CHECK(sd_sim_test_is_readable(sector));
+}
+
+// Short data blocks (ACMD22) can arrive entirely with the token
+static void sd_sim_test_register_read(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  uint32_t failures = 0;
+
+  for (uint32_t latency = 0; latency < 20000; latency += 137)
+  {
+    uint32_t written_blocks = 0;
+
+    config.register_latency_ns = latency;
+    if (sd_sim_test_power_on(&config) ||
+      sd_card_write_multiple_data(
+        sd_card_sim_hspi,
+        sd_sim_test_get_address(10),
+        sd_sim_test_data,
+        SD_SIM_SECTOR_SIZE,
+        4
+      ) ||
+      sd_card_get_written_blocks(sd_card_sim_hspi, &written_blocks) ||
+      written_blocks != 4)
+      failures++;
+  }
+
+  SD_SIM_CHECK(failures == 0);
+}
+
+static void sd_sim_test_async(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  sd_async_request request = { 0 };
+
+  sd_sim_test_fill(sd_sim_test_storage, sizeof(sd_sim_test_storage), 1);
+  sd_card_sim_init(&config);
+
+  request = (sd_async_request) {
+    .operation = SD_ASYNC_RESET,
+    .crc_enable = true
+  };
+  sd_sim_test_async_run(&request);
+  SD_SIM_CHECK(request.status == SD_OK);
+
+  sd_sim_test_fill(sd_sim_test_data, 6 * SD_SIM_SECTOR_SIZE, 6);
+  request = (sd_async_request) {
+    .operation = SD_ASYNC_WRITE,
+    .address = sd_sim_test_get_address(900),
+    .data = sd_sim_test_data,
+    .block_length = SD_SIM_SECTOR_SIZE,
+    .number_of_blocks = 6
+  };
+  sd_sim_test_async_run(&request);
+  SD_SIM_CHECK(request.status == SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_stored(900, sd_sim_test_data, 6));
+
+  request = (sd_async_request) {
+    .operation = SD_ASYNC_READ,
+    .address = sd_sim_test_get_address(900),
+    .data = sd_sim_test_buffer,
+    .block_length = SD_SIM_SECTOR_SIZE,
+    .number_of_blocks = 6
+  };
+  sd_sim_test_async_run(&request);
+  SD_SIM_CHECK(request.status == SD_OK && request.blocks_done == 6);
+  SD_SIM_CHECK(sd_sim_test_is_stored(900, sd_sim_test_buffer, 6));
+  SD_SIM_CHECK(sd_sim_test_is_readable(900));
+}
+
+// A failed multiple block request stops the transfer, so the card
+// answers the next commands
+static void sd_sim_test_async_error(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  sd_async_request request = { 0 };
+
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  sd_sim_test_fill(sd_sim_test_data, 8 * SD_SIM_SECTOR_SIZE, 13);
+
+  sd_card_sim_inject_write_error(3);
+  request = (sd_async_request) {
+    .operation = SD_ASYNC_WRITE,
+    .address = sd_sim_test_get_address(950),
+    .data = sd_sim_test_data,
+    .block_length = SD_SIM_SECTOR_SIZE,
+    .number_of_blocks = 8
+  };
+  sd_sim_test_async_run(&request);
+  SD_SIM_CHECK(request.status != SD_OK && request.blocks_done == 3);
+  SD_SIM_CHECK(sd_sim_test_is_stored(950, sd_sim_test_data, 3));
+  SD_SIM_CHECK(sd_sim_test_is_readable(990));
+  SD_SIM_CHECK(sd_card_write_multiple_data(
+    sd_card_sim_hspi,
+    sd_sim_test_get_address(950),
+    sd_sim_test_data,
+    SD_SIM_SECTOR_SIZE,
+    8
+  ) == SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_stored(950, sd_sim_test_data, 8));
+
+  sd_card_sim_inject_read_error(2);
+  request = (sd_async_request) {
+    .operation = SD_ASYNC_READ,
+    .address = sd_sim_test_get_address(950),
+    .data = sd_sim_test_buffer,
+    .block_length = SD_SIM_SECTOR_SIZE,
+    .number_of_blocks = 8
+  };
+  sd_sim_test_async_run(&request);
+  SD_SIM_CHECK(request.status != SD_OK && request.blocks_done == 2);
+  SD_SIM_CHECK(sd_sim_test_is_readable(990));
+
+  // The next request starts with a command too
+  request.state = SD_ASYNC_IDLE;
+  sd_sim_test_async_run(&request);
+  SD_SIM_CHECK(request.status == SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_stored(950, sd_sim_test_buffer, 8));
+}
+
+static void sd_sim_test_queue(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  sd_queue queue = { 0 };
+  sd_queue_request requests[4] = { 0 };
+  // Two adjacent writes and reads of one run each
+  uint32_t sectors[] = { 1001, 1000, 1100, 1101 };
+
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  sd_card_queue_init(&queue, sd_card_sim_hspi, SD_SIM_SECTOR_SIZE);
+  sd_sim_test_fill(sd_sim_test_data, 2 * SD_SIM_SECTOR_SIZE, 7);
+
+  for (uint32_t i = 0; i < 4; i++)
+  {
+    requests[i] = (sd_queue_request) {
+      .operation = i < 2 ? SD_QUEUE_WRITE : SD_QUEUE_READ,
+      .address = sd_sim_test_get_address(sectors[i]),
+      .data = i < 2 ? sd_sim_test_data + i * SD_SIM_SECTOR_SIZE :
+        sd_sim_test_buffer + (i - 2) * SD_SIM_SECTOR_SIZE,
+      .number_of_blocks = 1
+    };
+    SD_SIM_CHECK(sd_card_queue_submit(&queue, &requests[i]) == SD_OK);
+  }
+  SD_SIM_CHECK(sd_card_queue_dispatch(&queue) == SD_OK);
+
+  for (uint32_t i = 0; i < 4; i++)
+    SD_SIM_CHECK(requests[i].is_done && requests[i].status == SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_stored(
+    1001, sd_sim_test_data, 1
+  ));
+  SD_SIM_CHECK(sd_sim_test_is_stored(
+    1000, sd_sim_test_data + SD_SIM_SECTOR_SIZE, 1
+  ));
+  SD_SIM_CHECK(sd_sim_test_is_stored(1100, sd_sim_test_buffer, 2));
+}
+
+// A failed block of a merged write run fails its request and the later
+// ones, the card is usable after it
+static void sd_sim_test_queue_error(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  sd_queue queue = { 0 };
+  sd_queue_request requests[3] = { 0 };
+
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  sd_card_queue_init(&queue, sd_card_sim_hspi, SD_SIM_SECTOR_SIZE);
+  sd_sim_test_fill(sd_sim_test_data, 6 * SD_SIM_SECTOR_SIZE, 12);
+
+  for (uint32_t i = 0; i < 3; i++)
+  {
+    requests[i] = (sd_queue_request) {
+      .operation = SD_QUEUE_WRITE,
+      .address = sd_sim_test_get_address(1150 + 2 * i),
+      .data = sd_sim_test_data + 2 * i * SD_SIM_SECTOR_SIZE,
+      .number_of_blocks = 2
+    };
+    SD_SIM_CHECK(sd_card_queue_submit(&queue, &requests[i]) == SD_OK);
+  }
+
+  // The second block of the second request
+  sd_card_sim_inject_write_error(3);
+  SD_SIM_CHECK(sd_card_queue_dispatch(&queue) != SD_OK);
+  SD_SIM_CHECK(requests[0].is_done && requests[0].status == SD_OK);
+  SD_SIM_CHECK(requests[1].is_done && requests[1].status != SD_OK);
+  SD_SIM_CHECK(requests[2].is_done && requests[2].status != SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_readable(1190));
+
+  for (uint32_t i = 1; i < 3; i++)
+    SD_SIM_CHECK(sd_card_queue_submit(&queue, &requests[i]) == SD_OK);
+  SD_SIM_CHECK(sd_card_queue_dispatch(&queue) == SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_stored(1150, sd_sim_test_data, 6));
+}
+
+#ifdef SD_CACHE_SIZE
+
+static void sd_sim_test_cache(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  sd_card_cache_invalidate_all();
+  sd_sim_test_fill(sd_sim_test_data, 3 * SD_SIM_SECTOR_SIZE, 8);
+
+  // Dirty sectors are read back before they reach the card
+  for (uint32_t i = 0; i < 3; i++)
+  {
+    SD_SIM_CHECK(sd_card_cache_write_back(
+      sd_card_sim_hspi,
+      sd_sim_test_get_address(1200 + i),
+      sd_sim_test_data + i * SD_SIM_SECTOR_SIZE,
+      SD_SIM_SECTOR_SIZE,
+      false
+    ) == SD_OK);
+  }
+  SD_SIM_CHECK(!sd_sim_test_is_stored(1200, sd_sim_test_data, 3));
+  SD_SIM_CHECK(sd_card_read_multiple_data(
+    sd_card_sim_hspi,
+    sd_sim_test_get_address(1200),
+    sd_sim_test_buffer,
+    SD_SIM_SECTOR_SIZE,
+    3
+  ) == SD_OK);
+  SD_SIM_CHECK(memcmp(
+    sd_sim_test_buffer, sd_sim_test_data, 3 * SD_SIM_SECTOR_SIZE
+  ) == 0);
+
+  SD_SIM_CHECK(sd_card_cache_flush(sd_card_sim_hspi) == SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_stored(1200, sd_sim_test_data, 3));
+}
+
+// A failed flush leaves the card usable and the sectors dirty, so the
+// flush can be repeated
+static void sd_sim_test_cache_flush_error(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  sd_card_cache_invalidate_all();
+  sd_sim_test_fill(sd_sim_test_data, 4 * SD_SIM_SECTOR_SIZE, 11);
+
+  for (uint32_t i = 0; i < 4; i++)
+  {
+    SD_SIM_CHECK(sd_card_cache_write_back(
+      sd_card_sim_hspi,
+      sd_sim_test_get_address(1250 + i),
+      sd_sim_test_data + i * SD_SIM_SECTOR_SIZE,
+      SD_SIM_SECTOR_SIZE,
+      false
+    ) == SD_OK);
+  }
+
+  sd_card_sim_inject_write_error(2);
+  SD_SIM_CHECK(sd_card_cache_flush(sd_card_sim_hspi) != SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_readable(1290));
+
+  SD_SIM_CHECK(sd_card_cache_flush(sd_card_sim_hspi) == SD_OK);
+  SD_SIM_CHECK(sd_sim_test_is_stored(1250, sd_sim_test_data, 4));
+  SD_SIM_CHECK(sd_sim_test_is_readable(1290));
+}
+
+#endif
+
+#ifdef SD_COALESCE_BLOCKS
+
+static void sd_sim_test_coalesce(void)
+{
+  sd_sim_config config = sd_sim_test_get_config();
+  sd_error status = SD_OK;
+
+  SD_SIM_CHECK(sd_sim_test_power_on(&config) == SD_OK);
+  sd_sim_test_fill(sd_sim_test_data, 4 * SD_SIM_SECTOR_SIZE, 9);
+
+  for (uint32_t i = 0; i < 4; i++)
+  {
+    status |= sd_card_coalesce_write(
+      sd_card_sim_hspi,
+      sd_sim_test_get_address(1300 + i),
+      sd_sim_test_data + i * SD_SIM_SECTOR_SIZE,
+      SD_SIM_SECTOR_SIZE
+    );
+  }
+  SD_SIM_CHECK(status == SD_OK);
+
+  // A read writes the held run first
+  SD_SIM_CHECK(sd_sim_test_is_readable(1299));
+  SD_SIM_CHECK(sd_sim_test_is_stored(1300, sd_sim_test_data, 4));
+  SD_SIM_CHECK(sd_card_coalesce_flush() == SD_OK);
+}
+
+#endif
+
+static void sd_sim_test_run(const char *const name, void (*test)(void))
+{
+  uint32_t failures = sd_sim_test_failures;
+
+  sd_sim_test_name = name;
+  test();
+  printf(
+    "%-16s %s\n", name, failures == sd_sim_test_failures ? "ok" : "FAILED"
+  );
+}
+
+// Implementations -----------------------------------------------------------
+
+int main(void)
+{
+  sd_sim_test_run("command frames", sd_sim_test_command_frames);
+  sd_sim_test_run("reset", sd_sim_test_reset);
+  sd_sim_test_run("single block", sd_sim_test_single_block);
+  sd_sim_test_run("multiple block", sd_sim_test_multiple_block);
+  sd_sim_test_run("erase", sd_sim_test_erase);
+  sd_sim_test_run("write session", sd_sim_test_write_session);
+  sd_sim_test_run("session error", sd_sim_test_write_session_error);
+  sd_sim_test_run("write error", sd_sim_test_write_error);
+  sd_sim_test_run("read stream", sd_sim_test_read_stream);
+  sd_sim_test_run("read error", sd_sim_test_read_error);
+  sd_sim_test_run("clock step down", sd_sim_test_clock_step_down);
+  sd_sim_test_run("register read", sd_sim_test_register_read);
+  sd_sim_test_run("async", sd_sim_test_async);
+  sd_sim_test_run("async error", sd_sim_test_async_error);
+  sd_sim_test_run("queue", sd_sim_test_queue);
+  sd_sim_test_run("queue error", sd_sim_test_queue_error);
+#ifdef SD_CACHE_SIZE
+  sd_sim_test_run("cache", sd_sim_test_cache);
+  sd_sim_test_run("flush error", sd_sim_test_cache_flush_error);
+#endif
+#ifdef SD_COALESCE_BLOCKS
+  sd_sim_test_run("coalesce", sd_sim_test_coalesce);
+#endif
+
+  printf(
+    "%lu checks, %lu failed\n",
+    (unsigned long)sd_sim_test_checks,
+    (unsigned long)sd_sim_test_failures
+  );
+
+  return sd_sim_test_failures ? 1 : 0;
+}
@@ -3,6 +3,16 @@ SD card erase functions
 */
 
 #include "sd_driver_erase.h"
+#include "sd_driver_cache.h"
+#include "sd_driver_timeout.h"
+#include "sd_driver_profile.h"
+
+// Static variables ----------------------------------------------------------
+
+// Area set for the next erase: its size gives the timeout, its blocks
+// are dropped from the cache
+static uint32_t sd_card_erase_start = 0;
+static uint32_t sd_card_erase_end = 0;
 
 // Implementations -----------------------------------------------------------
 
@@ -13,19 +23,21 @@ sd_error sd_card_set_erasable_area(
 )
 {
   sd_command cmd_erase_start_addr = sd_card_get_cmd(32, start_address);
-  sd_command cmd_erase_end_addr = sd_card_get_cmd(33, start_address);
+  sd_command cmd_erase_end_addr = sd_card_get_cmd(33, end_address);
   sd_r1_response r1 = { 0 };
   sd_error status = { 0 };
 
   SEND_CMD(hspi, cmd_erase_start_addr, r1, status);
   SEND_CMD(hspi, cmd_erase_end_addr, r1, status);
 
+  sd_card_erase_start = start_address;
+  sd_card_erase_end = end_address;
+
   return status;
 }
 
 sd_error sd_card_erase(SPI_HandleTypeDef *const hspi)
 {
-  sd_command cmd_erase = sd_card_get_cmd(38, 0x0);
   sd_r1_response r1b = { 0 };
   sd_error status = { 0 };
   uint8_t busy_signal = 0;
@@ -34,15 +46,25 @@ sd_error sd_card_erase(SPI_HandleTypeDef *const hspi)
   //status |= sd_card_wait_response(hspi, &busy_signal, 0x0);
 
   SELECT_SD();
-  status |= HAL_SPI_Transmit(
+  status |= sd_card_send_cmd(hspi, &sd_cmd_erase);
+  status |= sd_card_receive_cmd_response(hspi, &r1b, 1);  
+  SD_PROFILE_START(timestamp);
+  status |= sd_card_wait_response(
     hspi,
-    (uint8_t*)&cmd_erase,
-    sizeof(cmd_erase),
-    SD_TRANSMISSION_TIMEOUT
+    &busy_signal,
+    0x0,
+    sd_card_get_erase_timeout(sd_card_erase_start, sd_card_erase_end)
   );
-  status |= sd_card_receive_cmd_response(hspi, &r1b, 1);  
-  status |= sd_card_wait_response(hspi, &busy_signal, 0x0);
-  SELECT_SD();
+  SD_PROFILE_RECORD(SD_PROFILE_BUSY, timestamp);
+  DISELECT_SD();
+
+#ifdef SD_CACHE_SIZE
+  // The end address is the address of the last erased block
+  sd_card_cache_invalidate(
+    sd_card_erase_start,
+    sd_card_erase_end + sd_card_get_address_step(SD_CACHE_BLOCK_SIZE)
+  );
+#endif
 
   return status;
 }
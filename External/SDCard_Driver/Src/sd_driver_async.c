@@ -0,0 +1,422 @@
+/*
+Non-blocking operations: a state machine over the driver steps
+*/
+
+#include "sd_driver_async.h"
+#include "sd_driver_init.h"
+#include "sd_driver_read.h"
+#include "sd_driver_write.h"
+#include "sd_driver_cache.h"
+#include "sd_driver_timeout.h"
+
+// Structs -------------------------------------------------------------------
+
+typedef enum
+{
+  SD_ASYNC_STEP_COMMAND = 0x0U,
+  SD_ASYNC_STEP_INITIALIZATION, // ACMD41 until the card is ready
+  SD_ASYNC_STEP_TOKEN, // Start token of a read block
+  SD_ASYNC_STEP_RECEIVE, // Data of a read block
+  SD_ASYNC_STEP_SEND, // Start of a written block
+  SD_ASYNC_STEP_TRANSMIT, // Data of a written block and its response
+  SD_ASYNC_STEP_BUSY,
+  SD_ASYNC_STEP_STOP, // Busy after the stop token does not start at once
+  SD_ASYNC_STEP_STOP_BUSY,
+  SD_ASYNC_STEP_DONE
+} sd_async_step;
+
+// Static variables ----------------------------------------------------------
+
+static SPI_HandleTypeDef *sd_async_hspi = NULL;
+static sd_async_request *volatile sd_async_current = NULL;
+static sd_async_step sd_async_current_step = SD_ASYNC_STEP_COMMAND;
+static uint32_t sd_async_step_time = 0;
+static uint32_t sd_async_step_timeout = 0; // us
+static uint8_t sd_async_crc[2] = { 0 };
+static volatile bool sd_async_is_processing = false;
+
+// Static functions ----------------------------------------------------------
+
+static sd_error sd_async_enter_step(
+  const sd_async_step step,
+  const uint32_t timeout
+)
+{
+  sd_async_current_step = step;
+  sd_async_step_time = SD_GET_TIME_US();
+  sd_async_step_timeout = timeout;
+
+  return SD_OK;
+}
+
+static bool sd_async_is_multiple(const sd_async_request *const request)
+{
+  return request->number_of_blocks > 1;
+}
+
+static uint8_t *sd_async_get_block(const sd_async_request *const request)
+{
+  return request->data + request->blocks_done * request->block_length;
+}
+
+static sd_error sd_async_start_command(sd_async_request *const request)
+{
+  sd_r1_response r1 = { 0 };
+  sd_error status = SD_OK;
+  bool is_multiple = sd_async_is_multiple(request);
+  sd_command cmd = { 0 };
+
+  switch (request->operation)
+  {
+    case SD_ASYNC_RESET:
+      status = sd_card_reset_start(sd_async_hspi, request->crc_enable);
+      if (status)
+        return status;
+      return sd_async_enter_step(
+        SD_ASYNC_STEP_INITIALIZATION, SD_INITIALIZATION_TIMEOUT * 1000U
+      );
+    case SD_ASYNC_ERASE:
+      cmd = sd_card_get_cmd(32, request->address);
+      SEND_CMD(sd_async_hspi, cmd, r1, status);
+      cmd = sd_card_get_cmd(33, request->end_address);
+      SEND_CMD(sd_async_hspi, cmd, r1, status);
+      cmd = sd_cmd_erase;
+      break;
+    case SD_ASYNC_READ:
+      cmd = sd_card_get_cmd(is_multiple ? 18 : 17, request->address);
+      break;
+    case SD_ASYNC_WRITE:
+      cmd = sd_card_get_cmd(is_multiple ? 25 : 24, request->address);
+      break;
+  }
+
+  if (status)
+    return status;
+
+  SELECT_SD();
+  status |= sd_card_send_cmd(sd_async_hspi, &cmd);
+  status |= sd_card_receive_cmd_response(sd_async_hspi, &r1, 1);
+
+  if (r1)
+    status = SD_TRANSMISSION_ERROR;
+  if (status)
+    return status;
+
+  if (request->operation == SD_ASYNC_READ)
+    return sd_async_enter_step(SD_ASYNC_STEP_TOKEN, sd_card_timeouts.read);
+  if (request->operation == SD_ASYNC_WRITE)
+    return sd_async_enter_step(SD_ASYNC_STEP_SEND, 0);
+
+  return sd_async_enter_step(
+    SD_ASYNC_STEP_BUSY,
+    sd_card_get_erase_timeout(request->address, request->end_address)
+  );
+}
+
+static sd_error sd_async_initialize(sd_async_request *const request)
+{
+  (void)request;
+  sd_error status = sd_card_reset_poll(sd_async_hspi);
+  if (status)
+    return status;
+
+  status = sd_card_reset_finish(sd_async_hspi, SD_OK);
+  if (status)
+    return status;
+
+  return sd_async_enter_step(SD_ASYNC_STEP_DONE, 0);
+}
+
+static sd_error sd_async_wait_token(sd_async_request *const request)
+{
+  uint8_t token = 0xff;
+
+  sd_error status = sd_card_poll_response(
+    sd_async_hspi, &token, 0xff, SD_POLL_CHUNK_SIZE
+  );
+  if (status)
+    return status;
+  if (token != 0xfe)
+    return SD_ERROR;
+
+  status = sd_card_receive_data_start(
+    sd_async_hspi, sd_async_get_block(request), request->block_length
+  );
+  if (status)
+    return status;
+
+  return sd_async_enter_step(
+    SD_ASYNC_STEP_RECEIVE, SD_TRANSMISSION_TIMEOUT * 1000U
+  );
+}
+
+static sd_error sd_async_receive(sd_async_request *const request)
+{
+#ifdef SD_USE_DMA
+  if (sd_card_dma_is_busy())
+    return SD_BUSY;
+#endif
+
+  sd_error status = sd_card_receive_data_block_finish(
+    sd_async_hspi, sd_async_get_block(request), request->block_length
+  );
+  if (status)
+    return status;
+
+  request->blocks_done++;
+  if (request->blocks_done < request->number_of_blocks)
+    return sd_async_enter_step(SD_ASYNC_STEP_TOKEN, sd_card_timeouts.read);
+  if (!sd_async_is_multiple(request))
+    return sd_async_enter_step(SD_ASYNC_STEP_DONE, 0);
+
+  // Busy after CMD12 is short, it is awaited here
+  status = sd_card_stop_transmission(sd_async_hspi);
+  if (status)
+    return status;
+
+  return sd_async_enter_step(SD_ASYNC_STEP_DONE, 0);
+}
+
+static sd_error sd_async_send(sd_async_request *const request)
+{
+  // 0xfc - start token of multiple block write, 0xfe - of single one
+  sd_error status = sd_card_transmit_data_block_start(
+    sd_async_hspi,
+    sd_async_get_block(request),
+    request->block_length,
+    sd_async_is_multiple(request) ? 0xfc : 0xfe,
+    sd_async_crc
+  );
+  if (status)
+    return status;
+
+  return sd_async_enter_step(
+    SD_ASYNC_STEP_TRANSMIT, SD_TRANSMISSION_TIMEOUT * 1000U
+  );
+}
+
+static sd_error sd_async_transmit(sd_async_request *const request)
+{
+#ifdef SD_USE_DMA
+  if (sd_card_dma_is_busy())
+    return SD_BUSY;
+#endif
+
+  sd_error status = sd_card_transmit_data_block_finish(
+    sd_async_hspi, sd_async_crc
+  );
+  if (status)
+    return status;
+
+  request->blocks_done++;
+  return sd_async_enter_step(SD_ASYNC_STEP_BUSY, sd_card_timeouts.write);
+}
+
+static sd_error sd_async_wait_busy(sd_async_request *const request)
+{
+  uint8_t busy_signal = 0;
+  uint8_t stop_token = 0xfd;
+
+  sd_error status = sd_card_poll_response(
+    sd_async_hspi, &busy_signal, 0x0, SD_POLL_CHUNK_SIZE
+  );
+  if (status)
+    return status;
+
+  if (request->operation != SD_ASYNC_WRITE)
+    return sd_async_enter_step(SD_ASYNC_STEP_DONE, 0);
+  if (request->blocks_done < request->number_of_blocks)
+    return sd_async_enter_step(SD_ASYNC_STEP_SEND, 0);
+  if (!sd_async_is_multiple(request))
+    return sd_async_enter_step(SD_ASYNC_STEP_DONE, 0);
+
+  status = sd_card_transmit_byte(sd_async_hspi, &stop_token);
+  if (status)
+    return status;
+
+  return sd_async_enter_step(SD_ASYNC_STEP_STOP, sd_card_timeouts.command);
+}
+
+static sd_error sd_async_wait_stop(sd_async_request *const request)
+{
+  (void)request;
+  uint8_t busy_signal = 0;
+
+  sd_error status = sd_card_poll_response(
+    sd_async_hspi, &busy_signal, 0xff, SD_POLL_CHUNK_SIZE
+  );
+  if (status)
+    return status;
+
+  return sd_async_enter_step(SD_ASYNC_STEP_STOP_BUSY, sd_card_timeouts.write);
+}
+
+static sd_error sd_async_wait_stop_busy(sd_async_request *const request)
+{
+  (void)request;
+  uint8_t busy_signal = 0;
+
+  sd_error status = sd_card_poll_response(
+    sd_async_hspi, &busy_signal, 0x0, SD_POLL_CHUNK_SIZE
+  );
+  if (status)
+    return status;
+
+  return sd_async_enter_step(SD_ASYNC_STEP_DONE, 0);
+}
+
+// SD_OK - the step is done, SD_BUSY - the card is not ready yet
+static sd_error sd_async_do_step(sd_async_request *const request)
+{
+  switch (sd_async_current_step)
+  {
+    case SD_ASYNC_STEP_COMMAND:
+      return sd_async_start_command(request);
+    case SD_ASYNC_STEP_INITIALIZATION:
+      return sd_async_initialize(request);
+    case SD_ASYNC_STEP_TOKEN:
+      return sd_async_wait_token(request);
+    case SD_ASYNC_STEP_RECEIVE:
+      return sd_async_receive(request);
+    case SD_ASYNC_STEP_SEND:
+      return sd_async_send(request);
+    case SD_ASYNC_STEP_TRANSMIT:
+      return sd_async_transmit(request);
+    case SD_ASYNC_STEP_BUSY:
+      return sd_async_wait_busy(request);
+    case SD_ASYNC_STEP_STOP:
+      return sd_async_wait_stop(request);
+    case SD_ASYNC_STEP_STOP_BUSY:
+      return sd_async_wait_stop_busy(request);
+    default:
+      return SD_OK;
+  }
+}
+
+// CMD18 or CMD25 was accepted and has not been stopped yet
+static bool sd_async_is_transfer_open(const sd_async_request *const request)
+{
+  if (!sd_async_is_multiple(request))
+    return false;
+
+  switch (sd_async_current_step)
+  {
+    case SD_ASYNC_STEP_TOKEN:
+    case SD_ASYNC_STEP_RECEIVE:
+      // CMD12 after the last block is sent by the receive step
+      return request->operation == SD_ASYNC_READ &&
+        request->blocks_done < request->number_of_blocks;
+    case SD_ASYNC_STEP_SEND:
+    case SD_ASYNC_STEP_TRANSMIT:
+    case SD_ASYNC_STEP_BUSY:
+      return request->operation == SD_ASYNC_WRITE;
+    default:
+      return false;
+  }
+}
+
+static void sd_async_complete(
+  sd_async_request *const request,
+  const sd_error status
+)
+{
+#ifdef SD_USE_DMA
+  // A failed step may leave a transfer running
+  if (status)
+    sd_card_dma_abort(sd_async_hspi);
+#endif
+  // The card has to leave the data state, or it rejects the next commands
+  if (status && sd_async_is_transfer_open(request))
+  {
+    if (request->operation == SD_ASYNC_WRITE)
+      sd_card_close_multiple_write(sd_async_hspi);
+    else
+      sd_card_stop_transmission(sd_async_hspi);
+  }
+  DISELECT_SD();
+
+#ifdef SD_CACHE_SIZE
+  if (request->operation == SD_ASYNC_WRITE)
+    sd_card_cache_write(
+      request->address,
+      request->data,
+      request->block_length,
+      request->number_of_blocks,
+      status
+    );
+  else if (request->operation == SD_ASYNC_READ && status == SD_OK)
+    sd_card_cache_overlay(
+      request->address,
+      request->data,
+      request->block_length,
+      request->number_of_blocks
+    );
+  else if (request->operation == SD_ASYNC_ERASE)
+    sd_card_cache_invalidate(request->address, request->end_address + 1);
+#endif
+
+  // Reset keeps the result in sd_card_status
+  if (request->operation == SD_ASYNC_RESET && status)
+    sd_card_reset_finish(sd_async_hspi, status);
+
+  request->status = status;
+  request->state = SD_ASYNC_DONE;
+  sd_async_current = NULL;
+
+  if (request->callback)
+    request->callback(request);
+}
+
+// Implementations -----------------------------------------------------------
+
+sd_error sd_card_async_submit(
+  SPI_HandleTypeDef *const hspi,
+  sd_async_request *const request
+)
+{
+  if (sd_async_current)
+    return SD_BUSY;
+  if (request->operation != SD_ASYNC_RESET &&
+    request->operation != SD_ASYNC_ERASE &&
+    (request->number_of_blocks == 0 || request->data == NULL))
+    return SD_INCORRECT_ARGUMENT;
+
+  request->state = SD_ASYNC_IN_PROGRESS;
+  request->status = SD_OK;
+  request->blocks_done = 0;
+
+  sd_async_hspi = hspi;
+  sd_async_enter_step(SD_ASYNC_STEP_COMMAND, 0);
+  sd_async_current = request;
+
+  return SD_OK;
+}
+
+void sd_card_async_process(void)
+{
+  // The call from an interrupt must not interfere with the main loop one
+  if (sd_async_is_processing || sd_async_current == NULL)
+    return;
+  sd_async_is_processing = true;
+
+  sd_async_request *request = sd_async_current;
+  sd_error status = SD_OK;
+
+  // Steps that do not have to wait are done within one call
+  while (status == SD_OK && sd_async_current_step != SD_ASYNC_STEP_DONE)
+    status = sd_async_do_step(request);
+
+  if (status == SD_BUSY &&
+    (SD_GET_TIME_US() - sd_async_step_time) > sd_async_step_timeout)
+    status = SD_TIMEOUT;
+
+  if (status != SD_BUSY)
+    sd_async_complete(request, status);
+
+  sd_async_is_processing = false;
+}
+
+bool sd_card_async_is_busy(void)
+{
+  return sd_async_current != NULL;
+}
@@ -0,0 +1,374 @@
+/*
+Sector cache with LRU eviction and write-back
+*/
+
+#ifdef SD_CACHE_SIZE
+
+#include "sd_driver_cache.h"
+#include "sd_driver_write.h"
+#include "string.h"
+
+// Structs -------------------------------------------------------------------
+
+typedef struct
+{
+  uint32_t address;
+  uint32_t last_use; // Value of the use counter at the last access
+  uint32_t epoch; // Barrier interval of the dirty data
+  bool is_valid;
+  bool is_dirty; // Newer than the card
+  uint8_t data[SD_CACHE_BLOCK_SIZE];
+} sd_cache_entry;
+
+// Static variables ----------------------------------------------------------
+
+static sd_cache_entry sd_cache_entries[SD_CACHE_SIZE];
+static uint32_t sd_cache_use_counter = 0;
+static uint32_t sd_cache_epoch = 0;
+static sd_cache_stats sd_cache_current_stats = { 0 };
+// Writes of the flush itself must not change the entries
+static bool sd_cache_is_flushing = false;
+
+// Static functions ----------------------------------------------------------
+
+static sd_cache_entry *sd_cache_find(const uint32_t address)
+{
+  for (uint32_t i = 0; i < SD_CACHE_SIZE; i++)
+  {
+    if (sd_cache_entries[i].is_valid &&
+      sd_cache_entries[i].address == address)
+      return &sd_cache_entries[i];
+  }
+
+  return NULL;
+}
+
+// A free entry or the least recently used clean one. NULL - all are dirty
+static sd_cache_entry *sd_cache_get_victim(void)
+{
+  sd_cache_entry *victim = NULL;
+
+  for (uint32_t i = 0; i < SD_CACHE_SIZE; i++)
+  {
+    if (!sd_cache_entries[i].is_valid)
+      return &sd_cache_entries[i];
+    if (sd_cache_entries[i].is_dirty)
+      continue;
+
+    // The difference also works after the counter overflows
+    if (victim == NULL ||
+      (sd_cache_use_counter - sd_cache_entries[i].last_use) >
+      (sd_cache_use_counter - victim->last_use))
+      victim = &sd_cache_entries[i];
+  }
+
+  return victim;
+}
+
+static void sd_cache_touch(sd_cache_entry *const entry)
+{
+  entry->last_use = ++sd_cache_use_counter;
+}
+
+static bool sd_cache_is_written_before(
+  const sd_cache_entry *const first,
+  const sd_cache_entry *const second
+)
+{
+  if (first->epoch != second->epoch)
+    return first->epoch < second->epoch;
+
+  return first->address < second->address;
+}
+
+// Dirty entries in the order of writing. Returns their number
+static uint32_t sd_cache_get_dirty(sd_cache_entry **const dirty)
+{
+  uint32_t number_of_dirty = 0;
+
+  for (uint32_t i = 0; i < SD_CACHE_SIZE; i++)
+  {
+    sd_cache_entry *entry = &sd_cache_entries[i];
+    if (!entry->is_valid || !entry->is_dirty)
+      continue;
+
+    // Insertion sort, the cache is small
+    uint32_t j = number_of_dirty++;
+    for (; j > 0 && sd_cache_is_written_before(entry, dirty[j - 1]); j--)
+      dirty[j] = dirty[j - 1];
+    dirty[j] = entry;
+  }
+
+  return number_of_dirty;
+}
+
+// Adjacent sectors of one barrier interval go within one CMD25
+static sd_error sd_cache_write_run(
+  SPI_HandleTypeDef *const hspi,
+  sd_cache_entry **const run,
+  const uint32_t run_length
+)
+{
+  sd_write_session session = { 0 };
+
+  if (run_length == 1)
+  {
+    return sd_card_write_data(
+      hspi, run[0]->address, run[0]->data, SD_CACHE_BLOCK_SIZE
+    );
+  }
+
+#if SD_PRE_ERASE_THRESHOLD
+  // The hint is optional, its result does not matter
+  if (run_length >= SD_PRE_ERASE_THRESHOLD)
+    sd_card_set_pre_erase_count(hspi, run_length);
+#endif
+
+  sd_error status = sd_card_write_session_begin(
+    hspi, &session, run[0]->address, SD_CACHE_BLOCK_SIZE
+  );
+  for (uint32_t i = 0; i < run_length && !status; i++)
+  {
+    status = sd_card_write_session_append(
+      &session, run[i]->address, run[i]->data
+    );
+  }
+  status |= sd_card_write_session_end(&session);
+
+  return status;
+}
+
+// Implementations -----------------------------------------------------------
+
+bool sd_card_cache_read(
+  const uint32_t address,
+  uint8_t *const data,
+  const uint32_t block_length
+)
+{
+  if (block_length != SD_CACHE_BLOCK_SIZE)
+    return false;
+
+  sd_cache_entry *entry = sd_cache_find(address);
+  if (entry == NULL)
+  {
+    sd_cache_current_stats.misses++;
+    return false;
+  }
+
+  memcpy(data, entry->data, SD_CACHE_BLOCK_SIZE);
+  sd_cache_touch(entry);
+  sd_cache_current_stats.hits++;
+
+  return true;
+}
+
+void sd_card_cache_store(
+  const uint32_t address,
+  const uint8_t *const data,
+  const uint32_t block_length
+)
+{
+  if (block_length != SD_CACHE_BLOCK_SIZE)
+    return;
+
+  sd_cache_entry *entry = sd_cache_find(address);
+  // The card data is older than the dirty one
+  if (entry && entry->is_dirty)
+    return;
+  if (entry == NULL)
+  {
+    entry = sd_cache_get_victim();
+    if (entry == NULL)
+      return;
+    if (entry->is_valid)
+      sd_cache_current_stats.evictions++;
+  }
+
+  entry->address = address;
+  entry->is_valid = true;
+  entry->is_dirty = false;
+  memcpy(entry->data, data, SD_CACHE_BLOCK_SIZE);
+  sd_cache_touch(entry);
+}
+
+void sd_card_cache_overlay(
+  const uint32_t address,
+  uint8_t *const data,
+  const uint32_t block_length,
+  const uint32_t number_of_blocks
+)
+{
+  uint32_t address_step = sd_card_get_address_step(block_length);
+  uint32_t end_address = address + (number_of_blocks * address_step);
+
+  if (block_length != SD_CACHE_BLOCK_SIZE)
+    return;
+
+  for (uint32_t i = 0; i < SD_CACHE_SIZE; i++)
+  {
+    sd_cache_entry *entry = &sd_cache_entries[i];
+    if (!entry->is_valid || !entry->is_dirty ||
+      entry->address < address || entry->address >= end_address)
+      continue;
+
+    memcpy(
+      data + ((entry->address - address) / address_step) * block_length,
+      entry->data,
+      SD_CACHE_BLOCK_SIZE
+    );
+  }
+}
+
+void sd_card_cache_write(
+  const uint32_t address,
+  const uint8_t *const data,
+  const uint32_t block_length,
+  const uint32_t number_of_blocks,
+  const sd_error status
+)
+{
+  uint32_t address_step = sd_card_get_address_step(block_length);
+
+  if (sd_cache_is_flushing)
+    return;
+
+  // It is not known which blocks of a failed write reached the card
+  if (status || block_length != SD_CACHE_BLOCK_SIZE)
+  {
+    sd_card_cache_invalidate(
+      address, address + (number_of_blocks * address_step)
+    );
+    return;
+  }
+
+  // Written blocks are not added: the cache is for reads
+  for (uint32_t i = 0; i < number_of_blocks; i++)
+  {
+    sd_cache_entry *entry = sd_cache_find(address + (i * address_step));
+    if (entry == NULL)
+      continue;
+
+    memcpy(entry->data, data + (i * block_length), SD_CACHE_BLOCK_SIZE);
+    entry->is_dirty = false;
+  }
+}
+
+void sd_card_cache_invalidate(
+  const uint32_t start_address,
+  const uint32_t end_address
+)
+{
+  for (uint32_t i = 0; i < SD_CACHE_SIZE; i++)
+  {
+    if (sd_cache_entries[i].address >= start_address &&
+      sd_cache_entries[i].address < end_address)
+      sd_cache_entries[i].is_valid = false;
+  }
+}
+
+void sd_card_cache_invalidate_all(void)
+{
+  for (uint32_t i = 0; i < SD_CACHE_SIZE; i++)
+    sd_cache_entries[i].is_valid = false;
+}
+
+sd_error sd_card_cache_write_back(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  const uint8_t *const data,
+  const uint32_t block_length,
+  const bool force_unit_access
+)
+{
+  sd_error status = SD_OK;
+
+  if (force_unit_access || block_length != SD_CACHE_BLOCK_SIZE)
+    return sd_card_write_data(hspi, address, data, block_length);
+
+  sd_cache_entry *entry = sd_cache_find(address);
+  sd_cache_current_stats.buffered_writes++;
+
+  // The older data must reach the card before the writes after the barrier
+  if (entry && entry->is_dirty && entry->epoch != sd_cache_epoch)
+    status = sd_card_cache_flush(hspi);
+  if (status)
+    return status;
+
+  if (entry && entry->is_dirty)
+    sd_cache_current_stats.absorbed_writes++;
+
+  if (entry == NULL)
+  {
+    entry = sd_cache_get_victim();
+    if (entry == NULL)
+    {
+      status = sd_card_cache_flush(hspi);
+      if (status)
+        return status;
+      entry = sd_cache_get_victim();
+    }
+    if (entry->is_valid)
+      sd_cache_current_stats.evictions++;
+  }
+
+  entry->address = address;
+  entry->epoch = sd_cache_epoch;
+  entry->is_valid = true;
+  entry->is_dirty = true;
+  memcpy(entry->data, data, SD_CACHE_BLOCK_SIZE);
+  sd_cache_touch(entry);
+
+  return status;
+}
+
+sd_error sd_card_cache_flush(SPI_HandleTypeDef *const hspi)
+{
+  sd_cache_entry *dirty[SD_CACHE_SIZE] = { 0 };
+  uint32_t number_of_dirty = sd_cache_get_dirty(dirty);
+  uint32_t run_start = 0;
+  sd_error status = SD_OK;
+
+  sd_cache_is_flushing = true;
+
+  // Runs are written in order: after an error the later ones stay dirty
+  for (uint32_t i = 1; i <= number_of_dirty && !status; i++)
+  {
+    if (i < number_of_dirty &&
+      dirty[i]->epoch == dirty[i - 1]->epoch &&
+      dirty[i]->address == dirty[i - 1]->address +
+      sd_card_get_address_step(SD_CACHE_BLOCK_SIZE))
+      continue;
+
+    status = sd_cache_write_run(hspi, dirty + run_start, i - run_start);
+    sd_cache_current_stats.flush_runs++;
+
+    if (status == SD_OK)
+    {
+      for (uint32_t j = run_start; j < i; j++)
+        dirty[j]->is_dirty = false;
+      sd_cache_current_stats.flushed_blocks += i - run_start;
+    }
+    run_start = i;
+  }
+
+  sd_cache_is_flushing = false;
+  return status;
+}
+
+void sd_card_cache_barrier(void)
+{
+  sd_cache_epoch++;
+}
+
+void sd_card_cache_get_stats(sd_cache_stats *const stats)
+{
+  *stats = sd_cache_current_stats;
+}
+
+void sd_card_cache_reset_stats(void)
+{
+  sd_cache_current_stats = (sd_cache_stats) { 0 };
+}
+
+#endif
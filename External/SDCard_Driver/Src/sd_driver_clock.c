@@ -0,0 +1,52 @@
+/*
+SPI clock management: slow identification, then the fastest clock allowed
+by the card and the peripheral bus
+*/
+
+#include "sd_driver_clock.h"
+#include "sd_driver_timeout.h"
+
+// Static variables ----------------------------------------------------------
+
+static uint8_t sd_card_crc_errors_in_row = 0;
+
+// Implementations -----------------------------------------------------------
+
+sd_error sd_card_set_max_clock(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t max_clock
+)
+{
+  sd_error status = SD_TRANSPORT(set_clock)(hspi, max_clock);
+  if (!status)
+    sd_card_crc_errors_in_row = 0;
+  sd_card_timeouts_update(hspi);
+
+  return status;
+}
+
+uint32_t sd_card_get_clock(SPI_HandleTypeDef *const hspi)
+{
+  return SD_TRANSPORT(get_clock)(hspi);
+}
+
+void sd_card_clock_report_crc(
+  SPI_HandleTypeDef *const hspi,
+  const bool crc_error
+)
+{
+  if (!crc_error)
+  {
+    sd_card_crc_errors_in_row = 0;
+    return;
+  }
+
+  if (++sd_card_crc_errors_in_row < SD_CLOCK_CRC_ERROR_LIMIT)
+    return;
+
+  sd_card_crc_errors_in_row = 0;
+
+  // Nothing changes if the clock is already the slowest one
+  SD_TRANSPORT(set_clock)(hspi, sd_card_get_clock(hspi) / 2);
+  sd_card_timeouts_update(hspi);
+}
@@ -0,0 +1,159 @@
+/*
+Coalescing of adjacent single block writes
+*/
+
+#ifdef SD_COALESCE_BLOCKS
+
+#include "sd_driver_coalesce.h"
+#include "sd_driver_write.h"
+#include "sd_driver_cache.h"
+#include "sd_driver_prefetch.h"
+#include "string.h"
+
+// Static variables ----------------------------------------------------------
+
+static SPI_HandleTypeDef *sd_coalesce_hspi = NULL;
+static uint8_t sd_coalesce_buffer[SD_COALESCE_BLOCKS][SD_COALESCE_BLOCK_SIZE];
+static uint32_t sd_coalesce_address = 0; // First held block
+static uint32_t sd_coalesce_length = 0;
+static uint32_t sd_coalesce_time = 0; // When the first block was held (us)
+// Error of a run written in the background
+static sd_error sd_coalesce_error = SD_OK;
+static sd_coalesce_stats sd_coalesce_current_stats = { 0 };
+
+// Static functions ----------------------------------------------------------
+
+static sd_error sd_coalesce_take_error(void)
+{
+  sd_error status = sd_coalesce_error;
+  sd_coalesce_error = SD_OK;
+
+  return status;
+}
+
+static bool sd_coalesce_is_expired(void)
+{
+  return sd_coalesce_length &&
+    (SD_GET_TIME_US() - sd_coalesce_time) > SD_COALESCE_TIMEOUT * 1000U;
+}
+
+// Implementations -----------------------------------------------------------
+
+sd_error sd_card_coalesce_write(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  const uint8_t *const data,
+  const uint32_t block_length
+)
+{
+  uint32_t address_step = sd_card_get_address_step(block_length);
+
+  if (block_length != SD_COALESCE_BLOCK_SIZE)
+  {
+    sd_card_coalesce_release();
+    sd_error status = sd_card_write_data(hspi, address, data, block_length);
+    return status | sd_coalesce_take_error();
+  }
+
+  sd_coalesce_current_stats.writes++;
+
+  if (sd_coalesce_length && (sd_coalesce_hspi != hspi ||
+    address != sd_coalesce_address + (sd_coalesce_length * address_step)))
+    sd_card_coalesce_release();
+  else if (sd_coalesce_is_expired())
+  {
+    sd_coalesce_current_stats.timeouts++;
+    sd_card_coalesce_release();
+  }
+
+  if (sd_coalesce_length == 0)
+  {
+    sd_coalesce_hspi = hspi;
+    sd_coalesce_address = address;
+    sd_coalesce_time = SD_GET_TIME_US();
+  }
+
+  memcpy(
+    sd_coalesce_buffer[sd_coalesce_length++], data, SD_COALESCE_BLOCK_SIZE
+  );
+
+  // Reads that do not select the card must not return the old data
+#ifdef SD_CACHE_SIZE
+  sd_card_cache_write(address, data, block_length, 1, SD_OK);
+#endif
+#ifdef SD_PREFETCH_DEPTH
+  sd_card_prefetch_stop();
+#endif
+
+  if (sd_coalesce_length == SD_COALESCE_BLOCKS)
+  {
+    sd_coalesce_current_stats.full_runs++;
+    sd_card_coalesce_release();
+  }
+
+  return sd_coalesce_take_error();
+}
+
+sd_error sd_card_coalesce_poll(void)
+{
+  if (sd_coalesce_is_expired())
+  {
+    sd_coalesce_current_stats.timeouts++;
+    sd_card_coalesce_release();
+  }
+
+  return sd_coalesce_take_error();
+}
+
+sd_error sd_card_coalesce_flush(void)
+{
+  sd_card_coalesce_release();
+  return sd_coalesce_take_error();
+}
+
+void sd_card_coalesce_release(void)
+{
+  uint32_t number_of_blocks = sd_coalesce_length;
+  sd_error status = SD_OK;
+
+  if (number_of_blocks == 0)
+    return;
+
+  // The selection inside the write must not release the run again
+  sd_coalesce_length = 0;
+  sd_coalesce_current_stats.runs++;
+
+  if (number_of_blocks == 1)
+  {
+    status = sd_card_write_data(
+      sd_coalesce_hspi,
+      sd_coalesce_address,
+      sd_coalesce_buffer[0],
+      SD_COALESCE_BLOCK_SIZE
+    );
+  }
+  else
+  {
+    status = sd_card_write_multiple_data(
+      sd_coalesce_hspi,
+      sd_coalesce_address,
+      (const uint8_t*)sd_coalesce_buffer,
+      SD_COALESCE_BLOCK_SIZE,
+      number_of_blocks
+    );
+  }
+
+  sd_coalesce_error |= status;
+}
+
+void sd_card_coalesce_get_stats(sd_coalesce_stats *const stats)
+{
+  *stats = sd_coalesce_current_stats;
+}
+
+void sd_card_coalesce_reset_stats(void)
+{
+  sd_coalesce_current_stats = (sd_coalesce_stats) { 0 };
+}
+
+#endif
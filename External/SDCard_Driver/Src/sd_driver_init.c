@@ -3,6 +3,9 @@ Initializing SD cards of different versions and sizes
 */
 
 #include "sd_driver_init.h"
+#include "sd_driver_clock.h"
+#include "sd_driver_cache.h"
+#include "sd_driver_timeout.h"
 #include "math.h"
 
 // Variables -----------------------------------------------------------------
@@ -22,7 +25,7 @@ static sd_error sd_card_power_on(SPI_HandleTypeDef *const hspi)
 
   // Clock occurs only during transmission
   for (uint8_t i = 0; i < 10; i++) // Need at least 74 ticks
-    status |= HAL_SPI_Transmit(hspi, &dummy_data, 1, SD_TRANSMISSION_TIMEOUT);
+    status |= sd_card_transmit_byte(hspi, &dummy_data);
 
   // Just in case, we get the result
   status |= sd_card_receive_byte(hspi, &dummy_data);
@@ -32,7 +35,6 @@ static sd_error sd_card_power_on(SPI_HandleTypeDef *const hspi)
 static sd_error sd_card_enter_spi_mode(SPI_HandleTypeDef *const hspi)
 {
   static bool sd_card_is_spi_mode = false;
-  sd_command cmd_go_idle_state = sd_card_get_cmd(0, 0x0);
   sd_r1_response r1 = 0;
 
   if (sd_card_is_spi_mode)
@@ -43,19 +45,15 @@ static sd_error sd_card_enter_spi_mode(SPI_HandleTypeDef *const hspi)
     return status;
 
   SELECT_SD();
-  status |= HAL_SPI_Transmit(
-    hspi,
-    (uint8_t*)&cmd_go_idle_state,
-    sizeof(cmd_go_idle_state),
-    SD_TRANSMISSION_TIMEOUT
-  );
+  status |= sd_card_send_cmd(hspi, &sd_cmd_go_idle_state);
   status |= sd_card_receive_byte(hspi, &r1);
 
-  uint32_t tickstart = HAL_GetTick();
+  uint32_t timeout = sd_card_get_ticks(sd_card_timeouts.command);
+  uint32_t start_time = SD_GET_TIMESTAMP();
   do
   {
     status |= sd_card_receive_byte(hspi, &r1);
-    if (HAL_GetTick() - tickstart > 500)
+    if (SD_GET_TIMESTAMP() - start_time > timeout)
       return SD_TIMEOUT;
   } while (r1 != R1_IN_IDLE_STATE);
 
@@ -73,151 +71,225 @@ static sd_error sd_card_crc_on_off(
   const bool crc_enable
 ) 
 {
-  sd_command cmd_crc_on_off = sd_card_get_cmd(59, crc_enable ? 0x1 : 0x0);
   sd_r1_response r1 = { 0 };
   sd_error status = SD_OK;
 
-  SEND_CMD(hspi, cmd_crc_on_off, r1, status);
+  if (crc_enable)
+  {
+    SEND_CMD(hspi, sd_cmd_crc_on, r1, status);
+  }
+  else
+  {
+    SEND_CMD(hspi, sd_cmd_crc_off, r1, status);
+  }
   if (r1 != R1_IN_IDLE_STATE)
     return SD_TRANSMISSION_ERROR;
 
   return status;
 }
 
-static sd_error sd_card_v1_init_process(SPI_HandleTypeDef *const hspi)
+// Check voltage. The card must support 2.7-3.6V
+static sd_error sd_card_check_voltage(SPI_HandleTypeDef *const hspi)
 {
-  // Reads OCR to get supported voltage
-  sd_command cmd_read_ocr = sd_card_get_cmd(58, 0x0);
-  // Next - application specific command
-  sd_command cmd_app = sd_card_get_cmd(55, 0x0);
-  // Send operating conditions
-  sd_command acmd_send_op_cond = sd_card_get_cmd(41, 0x0);
   sd_r3_response ocr_response = { 0 };
-  sd_r1_response app_response = { 0 };
-  sd_r1_response send_op_cond_response = { 0 };
   sd_error status = SD_OK;
 
-  SEND_CMD(hspi, cmd_read_ocr, ocr_response, status);
+  SEND_CMD(hspi, sd_cmd_read_ocr, ocr_response, status);
+  if (status)
+    return status;
 	
-  // Check voltage. The card must support 2.7-3.6V
   // MSB. Second byte is 23 - 16 bits of OCR
   // Third byte starts with 15 bit oof OCR
   if (!((ocr_response.ocr_register_content[1] & 0x1f) &&
     (ocr_response.ocr_register_content[2] & 0x80)))
-    return SD_ERROR;
-
-  uint32_t tickstart = HAL_GetTick();
-  while (true)
-  {
-    SEND_CMD(hspi, cmd_app, app_response, status);
-    SEND_CMD(hspi, acmd_send_op_cond, send_op_cond_response, status);
-		
-    if (send_op_cond_response == R1_CLEAR_FLAGS)
-      break;
-    if (send_op_cond_response & R1_ILLEGAL_COMMAND)
-      return SD_UNUSABLE_CARD;
-    // Card initialization shall be completed within 1 second 
-    // from the first ACMD41
-    if (HAL_GetTick() - tickstart > 1000)
-      return SD_TIMEOUT;
-  }
-
-  sd_card_status.version = 1;
-  sd_card_status.capacity = STANDART;
+    return sd_card_status.version == 1 ? SD_ERROR : SD_UNUSABLE_CARD;
 
-  return status;
+  return SD_OK;
 }
 
-static sd_error sd_card_v2_init_process(
-  SPI_HandleTypeDef *const hspi
-)
+// Must be done after the end of initialization (ACMD41)
+static sd_error sd_card_read_capacity(SPI_HandleTypeDef *const hspi)
 {
-  // Reads OCR to get supported voltage
-  sd_command cmd_read_ocr = sd_card_get_cmd(58, 0x0);
-   // Next - application specific command
-  sd_command cmd_app = sd_card_get_cmd(55, 0x0);
-  sd_command acmd_send_op_cond = sd_card_get_cmd(41, 0x0);
   sd_r3_response ocr_response = { 0 };
-  sd_r1_response app_response = { 0 };
-  sd_r1_response send_op_cond_response = { 0 };
   sd_error status = SD_OK;
 
-  SEND_CMD(hspi, cmd_read_ocr, ocr_response, status);
-	
-  // Check voltage. The card must support 2.7-3.6V
-  // MSB. Second byte is 23 - 16 bits of OCR
-  // Third byte starts with 15 bit oof OCR
-  if (!((ocr_response.ocr_register_content[1] & 0x1f) &&
-    (ocr_response.ocr_register_content[2] & 0x80)))
-    return SD_UNUSABLE_CARD;
-
-  uint32_t tickstart = HAL_GetTick();
-  while (true)
-	{
-    SEND_CMD(hspi, cmd_app, app_response, status);
-    SEND_CMD(hspi, acmd_send_op_cond, send_op_cond_response, status);
-		
-    if (send_op_cond_response == R1_CLEAR_FLAGS)
-      break;
-    // Card initialization shall be completed within 1 second 
-    // from the first ACMD41
-    if (HAL_GetTick() - tickstart > 1000)
-      return SD_TIMEOUT;
+  if (sd_card_status.version == 1)
+  {
+    sd_card_status.capacity = STANDART;
+    return SD_OK;
   }
 
-  // Check OCR to identify card capacity
-  if (ocr_response.ocr_register_content[0] & 0x2) // Check CCS
+  SEND_CMD(hspi, sd_cmd_read_ocr, ocr_response, status);
+
+  // Check CCS (bit 30 of OCR)
+  if (ocr_response.ocr_register_content[0] & 0x40)
     sd_card_status.capacity = HIGH_OR_EXTENDED;
   else
     sd_card_status.capacity = STANDART;
-  sd_card_status.version = 2;
-	
+
   return status;
 }
 
+// Function support bits of the group in the switch status
+static bool sd_card_is_function_supported(
+  const uint8_t *const switch_status,
+  const uint8_t group,
+  const uint8_t function
+)
+{
+  // Group 1 support - bits 415:400 (bytes 12-13), group 2 - 431:416, etc.
+  uint8_t byte_index = 13 - ((group - 1) << 1) - (function >> 3);
+
+  return switch_status[byte_index] & (1 << (function & 0x7));
+}
+
+// Function that is (or will be) selected in the group, 0xf - error
+static uint8_t sd_card_get_selected_function(
+  const uint8_t *const switch_status,
+  const uint8_t group
+)
+{
+  // Group 1 result - bits 379:376 (low nibble of byte 16),
+  // group 2 - 383:380 (high nibble of byte 16), etc.
+  uint8_t byte = switch_status[16 - ((group - 1) >> 1)];
+
+  return ((group - 1) & 0x1) ? byte >> 4 : byte & 0xf;
+}
+
 // Implementations -----------------------------------------------------------
 
-sd_error sd_card_reset(SPI_HandleTypeDef *const hspi, const bool crc_enable)
+sd_error sd_card_reset_start(
+  SPI_HandleTypeDef *const hspi,
+  const bool crc_enable
+)
 {
   // 2.7-3.6V and check pattern
   // Send interface condition
-  sd_command cmd_send_if_cond = sd_card_get_cmd(8, (1 << 8) | 0x55);
   sd_r7_response send_if_cond_response = { 0 };
 
-  sd_error status = sd_card_enter_spi_mode(hspi);
+  // The timeouts of the previous card do not apply
+  sd_card_timeouts_reset();
+
+  sd_error status = sd_card_set_max_clock(hspi, SD_IDENTIFICATION_CLOCK);
+  status |= sd_card_enter_spi_mode(hspi);
 
   if (status)
-    goto end_of_initialization;
+    return status;
 
-  SEND_CMD(hspi, cmd_send_if_cond, send_if_cond_response, status);
+  SEND_CMD(hspi, sd_cmd_send_if_cond, send_if_cond_response, status);
 
   if (status)
-    goto end_of_initialization;
+    return status;
 	
   status |= sd_card_crc_on_off(hspi, crc_enable);
 
   // Illegal command hence version 1.0 sd card
   if (send_if_cond_response.high_order_part & R1_ILLEGAL_COMMAND)
   {
-    status |= sd_card_v1_init_process(hspi);
-    goto end_of_initialization;
+    sd_card_status.version = 1;
   }
+  else
+  {
+    // Check pattern or voltage inconsistency
+    if (!(send_if_cond_response.echo_back_of_check_pattern == 0x55 &&
+      GET_VOLTAGE_FROM_R7(send_if_cond_response) == 0x1))
+      return status | SD_UNUSABLE_CARD;
+
+    sd_card_status.version = 2;
+  }
+
+  if (status)
+    return status;
+
+  return sd_card_check_voltage(hspi);
+}
+
+sd_error sd_card_reset_poll(SPI_HandleTypeDef *const hspi)
+{
+  sd_r1_response app_response = { 0 };
+  sd_r1_response send_op_cond_response = { 0 };
+  sd_error status = SD_OK;
+
+  SEND_CMD(hspi, sd_cmd_app, app_response, status);
+  SEND_CMD(hspi, sd_acmd_send_op_cond, send_op_cond_response, status);
+
+  if (status)
+    return status;
+  if (send_op_cond_response == R1_CLEAR_FLAGS)
+    return SD_OK;
+  if (sd_card_status.version == 1 &&
+    (send_op_cond_response & R1_ILLEGAL_COMMAND))
+    return SD_UNUSABLE_CARD;
+
+  return SD_BUSY;
+}
+
+sd_error sd_card_reset_finish(
+  SPI_HandleTypeDef *const hspi,
+  sd_error status
+)
+{
+  sd_info info = { 0 };
+  uint8_t scr_register[SD_SCR_SIZE] = { 0 };
+  uint8_t ssr_register[SD_SSR_SIZE] = { 0 };
+
+#ifdef SD_CACHE_SIZE
+  // Another card may have been inserted
+  sd_card_cache_invalidate_all();
+#endif
 
-  // Check pattern or voltage inconsistency
-  if (!(send_if_cond_response.echo_back_of_check_pattern == 0x55 &&
-    GET_VOLTAGE_FROM_R7(send_if_cond_response) == 0x1))
+  if (status == SD_OK)
+    status |= sd_card_read_capacity(hspi);
+  // After identification the card can work at the speed from its CSD
+  if (status == SD_OK)
+    status |= sd_card_get_common_info(hspi, &info);
+  // High speed is optional: if the switch fails, the card stays 
+  // at default speed
+  if (status == SD_OK && sd_card_switch_high_speed(hspi, &info) != SD_OK)
+    status |= sd_card_set_max_clock(
+      hspi, (uint32_t)(info.max_transfer_speed * 1000000.f)
+    );
+  // CMD23 is optional: without it multiple reads are stopped by CMD12
+  sd_card_status.block_count_supported = status == SD_OK &&
+    sd_card_get_scr(hspi, scr_register) == SD_OK &&
+    IS_BLOCK_COUNT_SUPPORTED(scr_register);
+  // Without the SD status the erase timeout is estimated per block
+  if (status == SD_OK)
   {
-    status |= SD_UNUSABLE_CARD;
-    goto end_of_initialization;
+    sd_card_timeouts_init(
+      hspi,
+      &info,
+      sd_card_get_ssr(hspi, ssr_register) == SD_OK ? ssr_register : NULL
+    );
   }
-	
-  status |= sd_card_v2_init_process(hspi);
 
-end_of_initialization:
   sd_card_status.error_in_initialization = (bool)status;
   return status;
 }
 
+sd_error sd_card_reset(SPI_HandleTypeDef *const hspi, const bool crc_enable)
+{
+  sd_error status = sd_card_reset_start(hspi, crc_enable);
+
+  // Card initialization shall be completed within 1 second 
+  // from the first ACMD41
+  uint32_t timeout = sd_card_get_ticks(SD_INITIALIZATION_TIMEOUT * 1000U);
+  uint32_t start_time = SD_GET_TIMESTAMP();
+  while (status == SD_OK)
+  {
+    status = sd_card_reset_poll(hspi);
+    if (status != SD_BUSY)
+      break;
+
+    if (SD_GET_TIMESTAMP() - start_time > timeout)
+      status = SD_TIMEOUT;
+    else
+      status = SD_OK;
+  }
+
+  return sd_card_reset_finish(hspi, status);
+}
+
 sd_error sd_card_get_common_info(
   SPI_HandleTypeDef *const hspi, sd_info *const info
 )
@@ -227,6 +299,7 @@ sd_error sd_card_get_common_info(
   // We request the CSD register to check the ability to set the block size
   sd_error status = sd_card_get_csd(hspi, (uint8_t *const)&csd_register);
   float transfer_rate_unit[] = { 0.1f, 1.f, 10.f, 100.f };
+  float time_unit[] = { 1.f, 10.f, 100.f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f };
   float time_value[] = { 
     0.f, 1.f, 1.2f, 1.3f, 1.5f, 2.f, 
     2.5f, 3.f, 3.5f, 4.f, 4.5f, 
@@ -242,6 +315,10 @@ sd_error sd_card_get_common_info(
     ((csd_register[5] & 0xf0) >> 4);
   info->max_data_block_size = powf(2.f, (float)(csd_register[5] & 0xf));
   info->partial_blocks_allowed = csd_register[6] & 0x80;
+  info->access_time = time_unit[csd_register[1] & 0x7] *
+    time_value[(csd_register[1] & 0x78) >> 3];
+  info->access_clocks = (uint32_t)csd_register[2] * 100;
+  info->write_speed_factor = 1 << ((csd_register[12] & 0x1c) >> 2);
 
   // Calculate size
   if (sd_card_status.version == 1)
@@ -263,3 +340,126 @@ sd_error sd_card_get_common_info(
 
   return SD_OK;
 }
+
+sd_error sd_card_get_scr(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t *const scr
+)
+{
+  sd_command acmd_send_scr = sd_card_get_cmd(51, 0);
+  sd_r1_response app_response = { 0 };
+  sd_r1_response r1 = { 0 };
+  sd_error status = SD_OK;
+
+  SEND_CMD(hspi, sd_cmd_app, app_response, status);
+
+  SELECT_SD();
+  status |= sd_card_send_cmd(hspi, &acmd_send_scr);
+  status |= sd_card_receive_cmd_response(hspi, &r1, 1);
+
+  if (app_response || r1)
+    status = SD_TRANSMISSION_ERROR;
+  if (status)
+    goto end_scr;
+
+  status |= sd_card_receive_data_block(hspi, scr, SD_SCR_SIZE);
+
+end_scr:
+  DISELECT_SD();
+  return status;
+}
+
+sd_error sd_card_get_ssr(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t *const ssr
+)
+{
+  sd_command acmd_sd_status = sd_card_get_cmd(13, 0);
+  sd_r1_response app_response = { 0 };
+  sd_r2_response r2 = { 0 };
+  sd_error status = SD_OK;
+
+  SEND_CMD(hspi, sd_cmd_app, app_response, status);
+
+  SELECT_SD();
+  status |= sd_card_send_cmd(hspi, &acmd_sd_status);
+  status |= sd_card_receive_cmd_response(hspi, (uint8_t*)&r2, sizeof(r2));
+
+  if (app_response || r2.high_order_part || r2.card_status)
+    status = SD_TRANSMISSION_ERROR;
+  if (status)
+    goto end_ssr;
+
+  status |= sd_card_receive_data_block(hspi, ssr, SD_SSR_SIZE);
+
+end_ssr:
+  DISELECT_SD();
+  return status;
+}
+
+sd_error sd_card_switch_function(
+  SPI_HandleTypeDef *const hspi,
+  const bool switch_mode,
+  const uint8_t group,
+  const uint8_t function,
+  uint8_t *const status
+)
+{
+  if (group < 1 || group > 6 || function > 0xf)
+    return SD_INCORRECT_ARGUMENT;
+
+  // 0xf in the group - no influence
+  uint8_t shift = (group - 1) << 2;
+  uint32_t argument = ((uint32_t)switch_mode << 31) | 
+    (0xffffffU & ~(0xfU << shift)) | ((uint32_t)function << shift);
+  sd_command cmd_switch_func = sd_card_get_cmd(6, argument);
+  sd_r1_response r1 = { 0 };
+
+  SELECT_SD();
+  sd_error result = sd_card_send_cmd(hspi, &cmd_switch_func);
+  result |= sd_card_receive_cmd_response(hspi, &r1, 1);
+
+  if (r1)
+    result = SD_TRANSMISSION_ERROR;
+  if (result)
+    goto end_switch;
+
+  result |= sd_card_receive_data_block(hspi, status, SD_SWITCH_STATUS_SIZE);
+
+end_switch:
+  DISELECT_SD();
+  return result;
+}
+
+sd_error sd_card_switch_high_speed(
+  SPI_HandleTypeDef *const hspi, const sd_info *const info
+)
+{
+  uint8_t switch_status[SD_SWITCH_STATUS_SIZE] = { 0 };
+  uint8_t dummy_data = 0xff;
+
+  if (!IS_SWITCH_FUNCTION_SUPPORTED(*info))
+    return SD_UNUSABLE_CARD;
+
+  // Group 1 - access mode, function 1 - high speed
+  sd_error status = sd_card_switch_function(
+    hspi, false, 1, 1, switch_status
+  );
+  if (status)
+    return status;
+  if (!sd_card_is_function_supported(switch_status, 1, 1) ||
+    sd_card_get_selected_function(switch_status, 1) != 1)
+    return SD_UNUSABLE_CARD;
+
+  status = sd_card_switch_function(hspi, true, 1, 1, switch_status);
+  if (status)
+    return status;
+  if (sd_card_get_selected_function(switch_status, 1) != 1)
+    return SD_ERROR;
+
+  // The new mode takes effect 8 clocks after the end of the status
+  status |= sd_card_transmit_byte(hspi, &dummy_data);
+  status |= sd_card_set_max_clock(hspi, SD_HIGH_SPEED_CLOCK);
+
+  return status;
+}
@@ -0,0 +1,171 @@
+/*
+Sequential read-ahead over an open CMD18
+*/
+
+#ifdef SD_PREFETCH_DEPTH
+
+#include "sd_driver_prefetch.h"
+#include "sd_driver_read.h"
+#include "string.h"
+
+// Static variables ----------------------------------------------------------
+
+static SPI_HandleTypeDef *sd_prefetch_hspi = NULL;
+static bool sd_prefetch_is_open = false;
+// Address expected from the next sequential request
+static uint32_t sd_prefetch_next_address = 0;
+static uint32_t sd_prefetch_sequential_reads = 0;
+
+static uint8_t sd_prefetch_ring[SD_PREFETCH_DEPTH][SD_PREFETCH_BLOCK_SIZE];
+static uint32_t sd_prefetch_ring_head = 0;
+static uint32_t sd_prefetch_ring_length = 0;
+
+static sd_prefetch_stats sd_prefetch_current_stats = { 0 };
+
+// Static functions ----------------------------------------------------------
+
+static void sd_prefetch_close(void)
+{
+  if (!sd_prefetch_is_open)
+    return;
+
+  // The next command must not see the stream as open
+  sd_prefetch_is_open = false;
+  sd_card_stop_transmission(sd_prefetch_hspi);
+  DISELECT_SD();
+}
+
+static sd_error sd_prefetch_open(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address
+)
+{
+  sd_command cmd_read_multiple_block = sd_card_get_cmd(18, address);
+  sd_r1_response r1 = { 0 };
+
+  SELECT_SD();
+  sd_error status = sd_card_send_cmd(hspi, &cmd_read_multiple_block);
+  status |= sd_card_receive_cmd_response(hspi, &r1, 1);
+
+  if (r1)
+    status = SD_TRANSMISSION_ERROR;
+  if (status)
+  {
+    DISELECT_SD();
+    return status;
+  }
+
+  sd_prefetch_hspi = hspi;
+  sd_prefetch_is_open = true;
+  sd_prefetch_current_stats.streams++;
+
+  return status;
+}
+
+// Reads the requested block and the ones after it into the ring
+static sd_error sd_prefetch_fill(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address
+)
+{
+  sd_error status = SD_OK;
+
+  if (!sd_prefetch_is_open)
+    status = sd_prefetch_open(hspi, address);
+  if (status)
+    return status;
+
+  sd_prefetch_ring_head = 0;
+  while (sd_prefetch_ring_length < SD_PREFETCH_DEPTH)
+  {
+    status = sd_card_receive_data_block(
+      hspi,
+      sd_prefetch_ring[sd_prefetch_ring_length],
+      SD_PREFETCH_BLOCK_SIZE
+    );
+    if (status)
+      break;
+
+    sd_prefetch_ring_length++;
+  }
+
+  // E.g. the end of the card: the blocks already read are still valid
+  if (status)
+    sd_prefetch_close();
+  if (sd_prefetch_ring_length == 0)
+    return status;
+
+  sd_prefetch_current_stats.prefetched += sd_prefetch_ring_length - 1;
+  return SD_OK;
+}
+
+// Implementations -----------------------------------------------------------
+
+bool sd_card_prefetch_read(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  uint8_t *const data,
+  const uint32_t block_length,
+  sd_error *const status
+)
+{
+  uint32_t address_step = sd_card_get_address_step(block_length);
+
+  // A random read served by the cache keeps the stream open. A read from
+  // the card closes it when the command is selected
+  if (address != sd_prefetch_next_address ||
+    block_length != SD_PREFETCH_BLOCK_SIZE)
+  {
+    if (!sd_prefetch_is_open)
+    {
+      sd_prefetch_next_address = address + address_step;
+      sd_prefetch_sequential_reads = 0;
+    }
+    return false;
+  }
+
+  sd_prefetch_next_address = address + address_step;
+  if (sd_prefetch_sequential_reads < SD_PREFETCH_TRIGGER)
+  {
+    sd_prefetch_sequential_reads++;
+    return false;
+  }
+
+  bool is_read_ahead = (sd_prefetch_ring_length > 0);
+  if (!is_read_ahead)
+  {
+    *status = sd_prefetch_fill(hspi, address);
+    if (*status)
+      return true;
+  }
+
+  memcpy(
+    data, sd_prefetch_ring[sd_prefetch_ring_head], SD_PREFETCH_BLOCK_SIZE
+  );
+  sd_prefetch_ring_head++;
+  sd_prefetch_ring_length--;
+
+  if (is_read_ahead)
+    sd_prefetch_current_stats.used++;
+
+  *status = SD_OK;
+  return true;
+}
+
+void sd_card_prefetch_stop(void)
+{
+  sd_prefetch_ring_length = 0;
+  sd_prefetch_close();
+}
+
+void sd_card_prefetch_get_stats(sd_prefetch_stats *const stats)
+{
+  *stats = sd_prefetch_current_stats;
+}
+
+void sd_card_prefetch_reset_stats(void)
+{
+  sd_prefetch_current_stats = (sd_prefetch_stats) { 0 };
+}
+
+#endif
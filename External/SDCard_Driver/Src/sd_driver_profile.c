@@ -0,0 +1,85 @@
+/*
+Latency histograms of the transfer phases
+*/
+
+#ifdef SD_PROFILE
+
+#include "sd_driver_profile.h"
+
+// Static variables ----------------------------------------------------------
+
+static sd_profile_histogram sd_profile_histograms[SD_PROFILE_PHASES];
+
+// Static functions ----------------------------------------------------------
+
+static uint32_t sd_profile_get_bucket(const uint32_t duration)
+{
+  if (duration == 0)
+    return 0;
+
+  // Number of significant bits
+  uint32_t bucket = 32U - (uint32_t)__builtin_clz(duration);
+
+  return bucket < SD_PROFILE_BUCKETS ? bucket : SD_PROFILE_BUCKETS - 1;
+}
+
+// Implementations -----------------------------------------------------------
+
+uint32_t sd_card_profile_record(
+  const sd_profile_phase phase,
+  const uint32_t start_timestamp
+)
+{
+  uint32_t timestamp = SD_GET_TIMESTAMP();
+  // The difference also works after the timestamp wraps around
+  uint32_t duration = timestamp - start_timestamp;
+  sd_profile_histogram *histogram = &sd_profile_histograms[phase];
+
+  if (histogram->count == 0 || duration < histogram->min)
+    histogram->min = duration;
+  if (duration > histogram->max)
+    histogram->max = duration;
+  histogram->count++;
+  histogram->total += duration;
+  histogram->buckets[sd_profile_get_bucket(duration)]++;
+
+  return timestamp;
+}
+
+void sd_card_profile_get_stats(sd_profile_stats *const stats)
+{
+  stats->frequency = SD_TRANSPORT(get_timestamp_frequency)();
+  for (uint32_t i = 0; i < SD_PROFILE_PHASES; i++)
+    stats->phases[i] = sd_profile_histograms[i];
+}
+
+void sd_card_profile_reset_stats(void)
+{
+  for (uint32_t i = 0; i < SD_PROFILE_PHASES; i++)
+    sd_profile_histograms[i] = (sd_profile_histogram) { 0 };
+}
+
+uint32_t sd_card_profile_get_percentile(
+  const sd_profile_histogram *const histogram,
+  const uint8_t percent
+)
+{
+  // Rounded up: the 100th percentile is the longest duration
+  uint64_t rank = ((uint64_t)histogram->count * percent + 99U) / 100U;
+  uint64_t counted = 0;
+
+  for (uint32_t i = 0; i < SD_PROFILE_BUCKETS; i++)
+  {
+    counted += histogram->buckets[i];
+    if (counted < rank || counted == 0)
+      continue;
+
+    uint32_t upper_bound = i < SD_PROFILE_BUCKETS - 1 ?
+      (1U << i) - 1U : UINT32_MAX;
+    return upper_bound < histogram->max ? upper_bound : histogram->max;
+  }
+
+  return histogram->max;
+}
+
+#endif
@@ -0,0 +1,353 @@
+/*
+Request queue with an elevator scheduler
+*/
+
+#include "sd_driver_queue.h"
+#include "sd_driver_read.h"
+#include "sd_driver_init.h"
+#include "sd_driver_write.h"
+#include "sd_driver_cache.h"
+#include "string.h"
+
+// Static functions ----------------------------------------------------------
+
+// Address after the last block of the request
+static uint32_t sd_queue_get_end_address(
+  const sd_queue *const queue,
+  const sd_queue_request *const request
+)
+{
+  return request->address + request->number_of_blocks *
+    sd_card_get_address_step(queue->block_length);
+}
+
+// Reads of the same blocks may be reordered, everything else keeps
+// the order of submission
+static bool sd_queue_is_conflict(
+  const sd_queue *const queue,
+  const sd_queue_request *const first,
+  const sd_queue_request *const second
+)
+{
+  if (first->operation == SD_QUEUE_READ &&
+    second->operation == SD_QUEUE_READ)
+    return false;
+
+  return first->address < sd_queue_get_end_address(queue, second) &&
+    second->address < sd_queue_get_end_address(queue, first);
+}
+
+// Moves the longest prefix of pending requests without conflicts to batch
+static uint8_t sd_queue_take_batch(
+  sd_queue *const queue,
+  sd_queue_request **const batch
+)
+{
+  uint8_t batch_size = 1;
+
+  for (; batch_size < queue->number_of_pending; batch_size++)
+  {
+    bool is_conflict = false;
+    for (uint8_t i = 0; i < batch_size && !is_conflict; i++)
+    {
+      is_conflict = sd_queue_is_conflict(
+        queue, queue->pending[i], queue->pending[batch_size]
+      );
+    }
+
+    if (is_conflict)
+      break;
+  }
+
+  memcpy(batch, queue->pending, batch_size * sizeof(*batch));
+  queue->number_of_pending -= batch_size;
+  memmove(
+    queue->pending,
+    queue->pending + batch_size,
+    queue->number_of_pending * sizeof(*batch)
+  );
+
+  return batch_size;
+}
+
+// Insertion sort by address, the batch is short
+static void sd_queue_sort(
+  sd_queue_request **const batch,
+  const uint8_t batch_size
+)
+{
+  for (uint8_t i = 1; i < batch_size; i++)
+  {
+    sd_queue_request *request = batch[i];
+    uint8_t j = i;
+
+    for (; j > 0 && batch[j - 1]->address > request->address; j--)
+      batch[j] = batch[j - 1];
+    batch[j] = request;
+  }
+}
+
+static sd_error sd_queue_read_run(
+  sd_queue *const queue,
+  sd_queue_request **const run,
+  const uint8_t run_length
+)
+{
+  SPI_HandleTypeDef *hspi = queue->hspi;
+  uint32_t block_length = queue->block_length;
+
+  // A single block does not need CMD12
+  if (run_length == 1 && run[0]->number_of_blocks == 1)
+  {
+    run[0]->status = sd_card_read_data(
+      hspi, run[0]->address, run[0]->data, block_length
+    );
+    return run[0]->status;
+  }
+
+  sd_command cmd_read_multiple_block = sd_card_get_cmd(18, run[0]->address);
+  sd_r1_response r1 = { 0 };
+  bool is_bounded = sd_card_status.block_count_supported;
+  sd_error status = SD_OK;
+
+  SELECT_SD();
+  if (is_bounded)
+  {
+    uint32_t number_of_blocks = 0;
+    for (uint8_t i = 0; i < run_length; i++)
+      number_of_blocks += run[i]->number_of_blocks;
+    status |= sd_card_set_block_count(hspi, number_of_blocks);
+  }
+  if (status == SD_OK)
+  {
+    status |= sd_card_send_cmd(hspi, &cmd_read_multiple_block);
+    status |= sd_card_receive_cmd_response(hspi, &r1, 1);
+  }
+
+  if (r1)
+    status = SD_TRANSMISSION_ERROR;
+  bool is_started = (status == SD_OK);
+
+  // After a failed block the rest of the run is not received
+  for (uint8_t i = 0; i < run_length; i++)
+  {
+    for (uint32_t j = 0; j < run[i]->number_of_blocks && !status; j++)
+    {
+      status = sd_card_receive_data_block(
+        hspi, run[i]->data + (j * block_length), block_length
+      );
+    }
+    run[i]->status = status;
+#ifdef SD_CACHE_SIZE
+    sd_card_cache_overlay(
+      run[i]->address, run[i]->data, block_length, run[i]->number_of_blocks
+    );
+#endif
+  }
+
+  // A bounded run ends by itself unless a block failed
+  if (is_started && (!is_bounded || status))
+    status |= sd_card_stop_transmission(hspi);
+
+  DISELECT_SD();
+  return status;
+}
+
+static sd_error sd_queue_write_run(
+  sd_queue *const queue,
+  sd_queue_request **const run,
+  const uint8_t run_length
+)
+{
+  SPI_HandleTypeDef *hspi = queue->hspi;
+  uint32_t block_length = queue->block_length;
+  uint32_t address_step = sd_card_get_address_step(block_length);
+  sd_write_session session = { 0 };
+
+  if (run_length == 1 && run[0]->number_of_blocks == 1)
+  {
+    run[0]->status = sd_card_write_data(
+      hspi, run[0]->address, run[0]->data, block_length
+    );
+    return run[0]->status;
+  }
+
+#if SD_PRE_ERASE_THRESHOLD
+  uint32_t number_of_blocks = 0;
+  for (uint8_t i = 0; i < run_length; i++)
+    number_of_blocks += run[i]->number_of_blocks;
+
+  // The hint is optional, its result does not matter
+  if (number_of_blocks >= SD_PRE_ERASE_THRESHOLD)
+    sd_card_set_pre_erase_count(hspi, number_of_blocks);
+#endif
+
+  sd_error status = sd_card_write_session_begin(
+    hspi, &session, run[0]->address, block_length
+  );
+
+  for (uint8_t i = 0; i < run_length; i++)
+  {
+    for (uint32_t j = 0; j < run[i]->number_of_blocks && !status; j++)
+    {
+      status = sd_card_write_session_append(
+        &session,
+        run[i]->address + (j * address_step),
+        run[i]->data + (j * block_length)
+      );
+    }
+    run[i]->status = status;
+  }
+
+  // Programming of the run ends with the stop token
+  sd_error end_status = sd_card_write_session_end(&session);
+  for (uint8_t i = 0; i < run_length; i++)
+    run[i]->status |= end_status;
+
+  return status | end_status;
+}
+
+static sd_error sd_queue_do_run(
+  sd_queue *const queue,
+  sd_queue_request **const run,
+  const uint8_t run_length
+)
+{
+  sd_error status = SD_OK;
+
+  if (run[0]->operation == SD_QUEUE_READ)
+    status = sd_queue_read_run(queue, run, run_length);
+  else
+    status = sd_queue_write_run(queue, run, run_length);
+
+  queue->head_address = sd_queue_get_end_address(
+    queue, run[run_length - 1]
+  );
+  queue->stats.runs++;
+
+  for (uint8_t i = 0; i < run_length; i++)
+  {
+    queue->stats.requests++;
+    queue->stats.blocks += run[i]->number_of_blocks;
+
+    run[i]->is_done = true;
+    if (run[i]->callback)
+      run[i]->callback(run[i]);
+  }
+
+  return status;
+}
+
+// Run number index of the batch
+static sd_error sd_queue_do_nth_run(
+  sd_queue *const queue,
+  sd_queue_request **const batch,
+  const uint8_t *const run_starts,
+  const uint8_t index
+)
+{
+  return sd_queue_do_run(
+    queue,
+    batch + run_starts[index],
+    run_starts[index + 1] - run_starts[index]
+  );
+}
+
+// Visits the runs of a sorted batch starting from the head in the current
+// direction, then the rest in the opposite one
+static sd_error sd_queue_sweep(
+  sd_queue *const queue,
+  sd_queue_request **const batch,
+  const uint8_t batch_size
+)
+{
+  // Index of the first request of every run and the end of the batch
+  uint8_t run_starts[SD_QUEUE_SIZE + 1] = { 0 };
+  uint8_t number_of_runs = 1;
+  uint8_t first_above = 0;
+  sd_error status = SD_OK;
+
+  for (uint8_t i = 1; i < batch_size; i++)
+  {
+    bool is_adjacent = batch[i]->operation == batch[i - 1]->operation &&
+      batch[i]->address == sd_queue_get_end_address(queue, batch[i - 1]);
+
+    if (!is_adjacent)
+      run_starts[number_of_runs++] = i;
+  }
+  run_starts[number_of_runs] = batch_size;
+
+  while (first_above < number_of_runs &&
+    batch[run_starts[first_above]]->address < queue->head_address)
+    first_above++;
+
+  if (queue->is_ascending)
+  {
+    for (uint8_t i = first_above; i < number_of_runs; i++)
+      status |= sd_queue_do_nth_run(queue, batch, run_starts, i);
+    if (first_above > 0)
+      queue->is_ascending = false;
+    for (uint8_t i = first_above; i > 0; i--)
+      status |= sd_queue_do_nth_run(queue, batch, run_starts, i - 1);
+  }
+  else
+  {
+    for (uint8_t i = first_above; i > 0; i--)
+      status |= sd_queue_do_nth_run(queue, batch, run_starts, i - 1);
+    if (first_above < number_of_runs)
+      queue->is_ascending = true;
+    for (uint8_t i = first_above; i < number_of_runs; i++)
+      status |= sd_queue_do_nth_run(queue, batch, run_starts, i);
+  }
+
+  return status;
+}
+
+// Implementations -----------------------------------------------------------
+
+void sd_card_queue_init(
+  sd_queue *const queue,
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t block_length
+)
+{
+  *queue = (sd_queue) {
+    .hspi = hspi,
+    .block_length = block_length,
+    .is_ascending = true
+  };
+}
+
+sd_error sd_card_queue_submit(
+  sd_queue *const queue,
+  sd_queue_request *const request
+)
+{
+  if (request->number_of_blocks == 0 || request->data == NULL)
+    return SD_INCORRECT_ARGUMENT;
+  if (queue->number_of_pending == SD_QUEUE_SIZE)
+    return SD_BUSY;
+
+  request->status = SD_OK;
+  request->is_done = false;
+  queue->pending[queue->number_of_pending++] = request;
+
+  return SD_OK;
+}
+
+sd_error sd_card_queue_dispatch(sd_queue *const queue)
+{
+  sd_queue_request *batch[SD_QUEUE_SIZE] = { 0 };
+  sd_error status = SD_OK;
+
+  // Requests submitted from the callbacks go to the next batch
+  while (queue->number_of_pending)
+  {
+    uint8_t batch_size = sd_queue_take_batch(queue, batch);
+
+    sd_queue_sort(batch, batch_size);
+    status |= sd_queue_sweep(queue, batch, batch_size);
+  }
+
+  return status;
+}
@@ -3,10 +3,107 @@ Single and multiple reading functions from SD card
 */
 
 #include "sd_driver_read.h"
+#include "sd_driver_init.h"
+#include "sd_driver_timeout.h"
+#include "sd_driver_cache.h"
+#include "sd_driver_prefetch.h"
+#include "sd_driver_profile.h"
 #include "crc-buffer.h"
 
+// Static functions ----------------------------------------------------------
+
+// CMD17 for one block, CMD18 for more. Stops at the first failed block:
+// received_blocks - blocks read without errors, is_started - the read
+// command was accepted
+static sd_error sd_card_read_blocks(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  uint8_t* data,
+  const uint32_t block_length,
+  const uint32_t number_of_blocks,
+  uint32_t *const received_blocks,
+  bool *const is_started
+)
+{
+  bool is_multiple = number_of_blocks > 1;
+  sd_command cmd_read = sd_card_get_cmd(is_multiple ? 18 : 17, address);
+  sd_r1_response r1 = { 0 };
+  bool is_bounded = is_multiple && sd_card_status.block_count_supported;
+  sd_error status = SD_OK;
+
+  *received_blocks = 0;
+  *is_started = false;
+
+  SELECT_SD();
+  if (is_bounded)
+    status |= sd_card_set_block_count(hspi, number_of_blocks);
+  if (status)
+    goto end_read;
+
+  status |= sd_card_send_cmd(hspi, &cmd_read);
+  status |= sd_card_receive_cmd_response(hspi, &r1, 1);
+
+  if (r1)
+    status = SD_TRANSMISSION_ERROR;
+  if (status)
+    goto end_read;
+
+  *is_started = true;
+  for (; *received_blocks < number_of_blocks; (*received_blocks)++)
+  {
+    status = sd_card_receive_data_block(
+      hspi, data + (*received_blocks * block_length), block_length
+    );
+    if (status)
+      break;
+  }
+
+  // After an error the card may still be sending the rest of the blocks
+  if (is_multiple && (!is_bounded || status))
+    status |= sd_card_stop_transmission(hspi);
+
+end_read:
+  DISELECT_SD();
+  return status;
+}
+
 // Implementations -----------------------------------------------------------
 
+sd_error sd_card_stop_transmission(SPI_HandleTypeDef *const hspi)
+{
+  sd_r1_response r1 = { 0 };
+  uint8_t busy_signal = 0;
+
+  sd_error status = sd_card_send_cmd(hspi, &sd_cmd_stop_transmission);
+
+  // Do we always get 0xef in r1?
+  status |= sd_card_receive_cmd_response(hspi, &r1, 1);  
+  SD_PROFILE_START(timestamp);
+  status |= sd_card_wait_response(
+    hspi, &busy_signal, 0x0, sd_card_timeouts.read
+  );
+  SD_PROFILE_RECORD(SD_PROFILE_BUSY, timestamp);
+
+  return status;
+}
+
+sd_error sd_card_set_block_count(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t number_of_blocks
+)
+{
+  sd_command cmd_set_block_count = sd_card_get_cmd(23, number_of_blocks);
+  sd_r1_response r1 = { 0 };
+
+  sd_error status = sd_card_send_cmd(hspi, &cmd_set_block_count);
+  status |= sd_card_receive_cmd_response(hspi, &r1, 1);
+
+  if (r1)
+    status = SD_TRANSMISSION_ERROR;
+
+  return status;
+}
+
 sd_error sd_card_read_data(
   SPI_HandleTypeDef *const hspi,
   const uint32_t address,
@@ -16,14 +113,27 @@ sd_error sd_card_read_data(
 {
   sd_command cmd_read_single_block = sd_card_get_cmd(17, address);
   sd_r1_response r1 = { 0 };
+  sd_error status = SD_OK;
+
+#ifdef SD_PREFETCH_DEPTH
+  if (sd_card_prefetch_read(hspi, address, data, block_length, &status))
+  {
+#ifdef SD_CACHE_SIZE
+    // Write-back data is newer than the card
+    if (status == SD_OK)
+      sd_card_cache_overlay(address, data, block_length, 1);
+#endif
+    return status;
+  }
+#endif
+
+#ifdef SD_CACHE_SIZE
+  if (sd_card_cache_read(address, data, block_length))
+    return SD_OK;
+#endif
 
   SELECT_SD();
-  sd_error status = (sd_error)HAL_SPI_Transmit(
-    hspi,
-    (uint8_t*)&cmd_read_single_block,
-    sizeof(cmd_read_single_block),
-    SD_TRANSMISSION_TIMEOUT
-  );
+  status = sd_card_send_cmd(hspi, &cmd_read_single_block);
   status |= sd_card_receive_cmd_response(hspi, &r1, 1);
 
   if (r1)
@@ -35,6 +145,11 @@ sd_error sd_card_read_data(
     hspi, data, block_length
   );
 
+#ifdef SD_CACHE_SIZE
+  if (status == SD_OK)
+    sd_card_cache_store(address, data, block_length);
+#endif
+
 end_read:
   DISELECT_SD();
   return status;
@@ -47,19 +162,93 @@ sd_error sd_card_read_multiple_data(
   const uint32_t block_length,
   const uint32_t number_of_blocks
 )
+{
+  return sd_card_read_multiple_data_with_stats(
+    hspi, address, data, block_length, number_of_blocks, NULL
+  );
+}
+
+sd_error sd_card_read_multiple_data_with_stats(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  uint8_t* data,
+  const uint32_t block_length,
+  const uint32_t number_of_blocks,
+  sd_read_retry_stats *const stats
+)
+{
+  uint32_t address_step = sd_card_get_address_step(block_length);
+  uint32_t first_block = 0;
+  uint32_t received_blocks = 0;
+  uint32_t last_failed_block = number_of_blocks;
+  uint32_t retries = 0;
+  bool is_started = false;
+  sd_error status = SD_OK;
+
+  if (stats)
+    *stats = (sd_read_retry_stats) { 0 };
+
+  // Only the blocks from the failed one are read again
+  while (first_block < number_of_blocks)
+  {
+    status = sd_card_read_blocks(
+      hspi,
+      address + (first_block * address_step),
+      data + (first_block * block_length),
+      block_length,
+      number_of_blocks - first_block,
+      &received_blocks,
+      &is_started
+    );
+    first_block += received_blocks;
+
+    // A rejected command (e.g. the address is out of range) is not retried
+    if (status == SD_OK || !is_started || retries == SD_READ_RETRIES)
+      break;
+
+    retries++;
+    if (stats == NULL)
+      continue;
+
+    stats->retries++;
+    if (first_block != last_failed_block)
+    {
+      if (stats->retried_blocks < SD_READ_RETRY_REPORT_SIZE)
+        stats->blocks[stats->retried_blocks] = first_block;
+      stats->retried_blocks++;
+    }
+    last_failed_block = first_block;
+  }
+
+#ifdef SD_CACHE_SIZE
+  sd_card_cache_overlay(address, data, block_length, number_of_blocks);
+#endif
+  return status;
+}
+
+sd_error sd_card_read_stream(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  uint8_t* buffers,
+  const uint8_t number_of_buffers,
+  const uint32_t block_length,
+  const sd_read_stream_callback callback,
+  void *const context,
+  sd_read_stream_stats *const stats
+)
 {
   sd_command cmd_read_multiple_block = sd_card_get_cmd(18, address);
-  sd_command cmd_stop_transmission = sd_card_get_cmd(12, address);
   sd_r1_response r1 = { 0 };
-  uint8_t busy_signal = 0;
+  uint8_t current_buffer = 0;
+  bool keep_reading = true;
+
+  if (number_of_buffers < 2)
+    return SD_INCORRECT_ARGUMENT;
+  if (stats)
+    *stats = (sd_read_stream_stats) { 0 };
 
   SELECT_SD();
-  sd_error status = (sd_error)HAL_SPI_Transmit(
-    hspi,
-    (uint8_t*)&cmd_read_multiple_block,
-    sizeof(cmd_read_multiple_block),
-    SD_TRANSMISSION_TIMEOUT
-  );
+  sd_error status = sd_card_send_cmd(hspi, &cmd_read_multiple_block);
   status |= sd_card_receive_cmd_response(hspi, &r1, 1);
 
   if (r1)
@@ -67,23 +256,47 @@ sd_error sd_card_read_multiple_data(
   if (status)
     goto end_read;
 
-  for (uint32_t i = 0; i < number_of_blocks; i++)
+  status |= sd_card_receive_data_block(hspi, buffers, block_length);
+
+  for (uint32_t i = 0; keep_reading && !status; i++)
   {
-    status |= sd_card_receive_data_block(
-      hspi, data + (i * block_length), block_length
+    uint8_t next_buffer = (current_buffer + 1) % number_of_buffers;
+    uint8_t* next_data = buffers + (next_buffer * block_length);
+
+    // The next block is received while the consumer processes this one
+    status |= sd_card_receive_data_block_start(hspi, next_data, block_length);
+    if (status)
+      break;
+
+#ifdef SD_CACHE_SIZE
+    sd_card_cache_overlay(
+      address + (i * sd_card_get_address_step(block_length)),
+      buffers + (current_buffer * block_length),
+      block_length,
+      1
+    );
+#endif
+    keep_reading = callback(
+      buffers + (current_buffer * block_length), i, context
     );
-  }
 
-  status |= HAL_SPI_Transmit(
-    hspi,
-    (uint8_t*)&cmd_stop_transmission,
-    sizeof(cmd_stop_transmission),
-    SD_TRANSMISSION_TIMEOUT
-  );
+    if (stats)
+    {
+      stats->blocks++;
+#ifdef SD_USE_DMA
+      // The consumer is faster than the card: it has to wait for the data
+      if (sd_card_dma_is_busy())
+        stats->stalls++;
+#endif
+    }
 
-  // Do we always get 0xef in r1?
-  status |= sd_card_receive_cmd_response(hspi, &r1, 1);  
-  status |= sd_card_wait_response(hspi, &busy_signal, 0x0);
+    status |= sd_card_receive_data_block_finish(
+      hspi, next_data, block_length
+    );
+    current_buffer = next_buffer;
+  }
+
+  status |= sd_card_stop_transmission(hspi);
 
 end_read:
   DISELECT_SD();
@@ -3,21 +3,181 @@
 */
 
 #include "sd_driver_secondary.h"
+#include "sd_driver_init.h"
+#include "sd_driver_clock.h"
+#include "sd_driver_timeout.h"
+#include "sd_driver_prefetch.h"
+#include "sd_driver_coalesce.h"
+#include "sd_driver_profile.h"
 #include "crc-buffer.h"
 #include "string.h"
 
+// Constants -----------------------------------------------------------------
+
+// '0' + '1' + command index, argument (MSB first), CRC7 + '1'
+const sd_command sd_cmd_go_idle_state = { 0x40, { 0, 0, 0, 0 }, 0x95 };
+const sd_command sd_cmd_send_if_cond = { 0x48, { 0, 0, 0x1, 0x55 }, 0x75 };
+const sd_command sd_cmd_send_csd = { 0x49, { 0, 0, 0, 0 }, 0xaf };
+const sd_command sd_cmd_stop_transmission = { 0x4c, { 0, 0, 0, 0 }, 0x61 };
+const sd_command sd_cmd_erase = { 0x66, { 0, 0, 0, 0 }, 0xa5 };
+const sd_command sd_cmd_app = { 0x77, { 0, 0, 0, 0 }, 0x65 };
+const sd_command sd_cmd_read_ocr = { 0x7a, { 0, 0, 0, 0 }, 0xfd };
+const sd_command sd_cmd_crc_off = { 0x7b, { 0, 0, 0, 0 }, 0x91 };
+const sd_command sd_cmd_crc_on = { 0x7b, { 0, 0, 0, 0x1 }, 0x83 };
+const sd_command sd_acmd_send_op_cond = { 0x69, { 0, 0, 0, 0 }, 0xe5 };
+
+// Variables -----------------------------------------------------------------
+
+const sd_transport *sd_card_transport = &SD_DEFAULT_TRANSPORT;
+
+// Static variables ----------------------------------------------------------
+
+// Bytes received ahead while polling. They are given to the next receive
+// calls, so the position in the stream does not change
+static uint8_t sd_card_lookahead[SD_POLL_CHUNK_SIZE];
+static uint8_t sd_card_lookahead_head = 0;
+static uint8_t sd_card_lookahead_length = 0;
+
+// Driver time: the timestamp extended to microseconds. The ticks of
+// the started microsecond stay after sd_card_last_timestamp
+static uint32_t sd_card_time_us = 0;
+static uint32_t sd_card_last_timestamp = 0;
+// Recalculated only when the frequency changes
+static uint32_t sd_card_timestamp_frequency = 0;
+static uint32_t sd_card_ticks_per_us = 1;
+
+#ifdef SD_USE_DMA
+
+static SPI_HandleTypeDef *volatile sd_card_dma_hspi = NULL;
+static volatile bool sd_card_dma_in_progress = false;
+static volatile sd_error sd_card_dma_status = SD_OK;
+
+#endif
+
+// Static functions ----------------------------------------------------------
+
+static uint16_t sd_card_take_lookahead(uint8_t *const data, uint16_t size)
+{
+  if (size > sd_card_lookahead_length)
+    size = sd_card_lookahead_length;
+
+  memcpy(data, sd_card_lookahead + sd_card_lookahead_head, size);
+  sd_card_lookahead_head += size;
+  sd_card_lookahead_length -= size;
+
+  return size;
+}
+
+// Timestamp ticks per microsecond of the current transport
+static uint32_t sd_card_get_ticks_per_us(void)
+{
+  uint32_t frequency = SD_TRANSPORT(get_timestamp_frequency)();
+
+  if (frequency != sd_card_timestamp_frequency)
+  {
+    sd_card_timestamp_frequency = frequency;
+    // The core clock is a whole number of MHz
+    sd_card_ticks_per_us = (frequency + 500000U) / 1000000U;
+    if (sd_card_ticks_per_us == 0)
+      sd_card_ticks_per_us = 1;
+  }
+
+  return sd_card_ticks_per_us;
+}
+
+// After a transmission or deselection, the bytes received ahead are
+// no longer part of the stream
+static void sd_card_drop_lookahead(void)
+{
+  sd_card_lookahead_head = 0;
+  sd_card_lookahead_length = 0;
+}
+
+#ifdef SD_USE_DMA
+
+// Callbacks -----------------------------------------------------------------
+
+__weak void sd_card_dma_idle_callback(void)
+{
+}
+
+#endif
+
 // Implementations -----------------------------------------------------------
 
+void sd_card_set_transport(const sd_transport *const transport)
+{
+  sd_card_transport = transport;
+}
+
+uint32_t sd_card_get_time_us(void)
+{
+  uint32_t ticks_per_us = sd_card_get_ticks_per_us();
+
+  // The difference also works after the timestamp wraps around
+  uint32_t elapsed_us =
+    (SD_GET_TIMESTAMP() - sd_card_last_timestamp) / ticks_per_us;
+  sd_card_last_timestamp += elapsed_us * ticks_per_us;
+  sd_card_time_us += elapsed_us;
+
+  return sd_card_time_us;
+}
+
+uint32_t sd_card_get_ticks(const uint32_t time_us)
+{
+  return time_us * sd_card_get_ticks_per_us();
+}
+
+#ifndef SD_TRANSPORT_SIM
+
+uint32_t sd_card_dwt_get_timestamp(void)
+{
+  // The counter is stopped after reset
+  if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk))
+  {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  }
+
+  return DWT->CYCCNT;
+}
+
+uint32_t sd_card_dwt_get_frequency(void)
+{
+  return SystemCoreClock;
+}
+
+#endif
+
+void sd_card_select(void)
+{
+#ifdef SD_COALESCE_BLOCKS
+  // Held writes go before the command
+  sd_card_coalesce_release();
+#endif
+#ifdef SD_PREFETCH_DEPTH
+  // Every command starts with the selection
+  sd_card_prefetch_stop();
+#endif
+  SD_TRANSPORT(select)();
+}
+
+void sd_card_deselect(void)
+{
+  sd_card_drop_lookahead();
+  SD_TRANSPORT(deselect)();
+}
+
 sd_error sd_card_receive_byte(
   SPI_HandleTypeDef *const hspi, 
   uint8_t* data
 )
 {
-  uint8_t dummy_data = 0xff;
+  if (sd_card_take_lookahead(data, 1))
+    return SD_OK;
 
-  return (sd_error)HAL_SPI_TransmitReceive(
-    hspi, &dummy_data, data, 1, SD_TRANSMISSION_TIMEOUT
-  );
+  return SD_TRANSPORT(exchange)(hspi, 0xff, data);
 }
 
 sd_error sd_card_receive_bytes(
@@ -26,12 +186,11 @@ sd_error sd_card_receive_bytes(
   const uint16_t size
 )
 {
-  sd_error status = SD_OK;
+  uint16_t taken = sd_card_take_lookahead(data, size);
+  if (taken == size)
+    return SD_OK;
 
-  for (uint16_t i = 0; i < size; i++)
-    status |= sd_card_receive_byte(hspi, data + i);
-  
-  return status;
+  return SD_TRANSPORT(receive)(hspi, data + taken, size - taken);
 }
 
 sd_error sd_card_transmit_byte(
@@ -39,9 +198,8 @@ sd_error sd_card_transmit_byte(
   const uint8_t *const data
 )
 {
-  return (sd_error)HAL_SPI_Transmit(
-    hspi, (uint8_t *)data, sizeof(uint8_t), SD_TRANSMISSION_TIMEOUT
-  );
+  sd_card_drop_lookahead();
+  return SD_TRANSPORT(transmit)(hspi, data, sizeof(uint8_t));
 }
 
 sd_error sd_card_transmit_bytes(
@@ -50,14 +208,153 @@ sd_error sd_card_transmit_bytes(
   const uint16_t size
 )
 {
-  sd_error status = SD_OK;
+  sd_card_drop_lookahead();
+  // The whole block goes out in one transfer
+  return SD_TRANSPORT(transmit)(hspi, data, size);
+}
+
+#ifdef SD_USE_DMA
+
+void sd_card_dma_complete(
+  SPI_HandleTypeDef *const hspi,
+  const sd_error status
+)
+{
+  // Other SPI peripherals may also use DMA
+  if (hspi != sd_card_dma_hspi)
+    return;
+
+  sd_card_dma_status = status;
+  sd_card_dma_in_progress = false;
+}
+
+sd_error sd_card_dma_receive_start(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t* data,
+  const uint16_t size
+)
+{
+  if (size > SD_BULK_TRANSFER_SIZE)
+    return SD_INCORRECT_ARGUMENT;
+  if (sd_card_dma_in_progress)
+    return SD_BUSY;
+
+  // Without asynchronous transfers the data is received right away
+  if (sd_card_transport->receive_start == NULL)
+  {
+    sd_card_dma_status = sd_card_transport->receive(hspi, data, size);
+    return sd_card_dma_status;
+  }
+
+  sd_card_dma_hspi = hspi;
+  sd_card_dma_status = SD_OK;
+  sd_card_dma_in_progress = true;
+
+  sd_error status = sd_card_transport->receive_start(hspi, data, size);
+  if (status)
+    sd_card_dma_in_progress = false;
 
-  for (uint16_t i = 0; i < size; i++)
-    status |= HAL_SPI_Transmit(hspi, (uint8_t *)(data + i), 1, SD_TRANSMISSION_TIMEOUT);
-  
   return status;
 }
 
+sd_error sd_card_dma_transmit_start(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const data,
+  const uint16_t size
+)
+{
+  if (sd_card_dma_in_progress)
+    return SD_BUSY;
+
+  if (sd_card_transport->transmit_start == NULL)
+  {
+    sd_card_dma_status = sd_card_transport->transmit(hspi, data, size);
+    return sd_card_dma_status;
+  }
+
+  sd_card_dma_hspi = hspi;
+  sd_card_dma_status = SD_OK;
+  sd_card_dma_in_progress = true;
+
+  sd_error status = sd_card_transport->transmit_start(hspi, data, size);
+  if (status)
+    sd_card_dma_in_progress = false;
+
+  return status;
+}
+
+bool sd_card_dma_is_busy(void)
+{
+  return sd_card_dma_in_progress;
+}
+
+uint16_t sd_card_dma_get_received(
+  SPI_HandleTypeDef *const hspi,
+  const uint16_t size
+)
+{
+  if (!sd_card_dma_in_progress)
+    return size;
+
+  return size - sd_card_transport->get_remaining(hspi);
+}
+
+void sd_card_dma_abort(SPI_HandleTypeDef *const hspi)
+{
+  if (!sd_card_dma_in_progress)
+    return;
+
+  sd_card_transport->abort(hspi);
+  sd_card_dma_in_progress = false;
+}
+
+sd_error sd_card_dma_wait(SPI_HandleTypeDef *const hspi)
+{
+  uint32_t timeout = sd_card_get_ticks(SD_TRANSMISSION_TIMEOUT * 1000U);
+  uint32_t captured_time = SD_GET_TIMESTAMP();
+
+  while (sd_card_dma_in_progress)
+  {
+    if ((SD_GET_TIMESTAMP() - captured_time) > timeout)
+    {
+      sd_card_dma_abort(hspi);
+      return SD_TIMEOUT;
+    }
+
+    sd_card_dma_idle_callback();
+  }
+
+  return sd_card_dma_status;
+}
+
+sd_error sd_card_dma_receive(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t* data,
+  const uint16_t size
+)
+{
+  sd_error status = sd_card_dma_receive_start(hspi, data, size);
+  if (status)
+    return status;
+
+  return sd_card_dma_wait(hspi);
+}
+
+sd_error sd_card_dma_transmit(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const data,
+  const uint16_t size
+)
+{
+  sd_error status = sd_card_dma_transmit_start(hspi, data, size);
+  if (status)
+    return status;
+
+  return sd_card_dma_wait(hspi);
+}
+
+#endif
+
 sd_command sd_card_get_cmd_without_crc(
   const uint8_t cmd_num, const uint32_t arg
 )
@@ -87,56 +384,204 @@ sd_command sd_card_get_cmd(const uint8_t cmd_num, const uint32_t arg)
   return cmd;
 }
 
-sd_error sd_card_receive_data_block(
+sd_error sd_card_send_cmd(
+  SPI_HandleTypeDef *const hspi,
+  const sd_command *const cmd
+)
+{
+  SD_PROFILE_START(timestamp);
+
+  sd_error status = sd_card_transmit_bytes(
+    hspi, (const uint8_t*)cmd, sizeof(*cmd)
+  );
+  SD_PROFILE_RECORD(SD_PROFILE_COMMAND, timestamp);
+
+  return status;
+}
+
+sd_error sd_card_receive_data_start(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t* data,
+  const uint16_t data_size
+)
+{
+#ifdef SD_USE_DMA
+  // The beginning of the block may have been received with the token
+  uint16_t taken = sd_card_take_lookahead(data, data_size);
+
+  // A short block may have been received entirely. HAL rejects
+  // zero-length transfers, the transfer is complete already
+  if (taken == data_size)
+  {
+    sd_card_dma_status = SD_OK;
+    return SD_OK;
+  }
+
+  return sd_card_dma_receive_start(hspi, data + taken, data_size - taken);
+#else
+  return sd_card_receive_bytes(hspi, data, data_size);
+#endif
+}
+
+sd_error sd_card_receive_data_block_start(
   SPI_HandleTypeDef *const hspi,
   uint8_t* data,
   const uint16_t data_size
 )
 {
-  crc_buffer_16 crc_buffer = { 0 };
-  crc_16_result received_crc = { 0 };
   uint8_t token = 0x0;
+  SD_PROFILE_START(timestamp);
 
   // The token is sent with a significant delay
-  sd_error status = sd_card_wait_response(hspi, &token, 0xff);
+  sd_error status = sd_card_wait_response(
+    hspi, &token, 0xff, sd_card_timeouts.read
+  );
+  SD_PROFILE_RECORD(SD_PROFILE_TOKEN, timestamp);
   if (token != 0xfe)
     return SD_ERROR;
 
-  status |= sd_card_receive_bytes(hspi, data, data_size);
+  status |= sd_card_receive_data_start(hspi, data, data_size);
+#ifndef SD_USE_DMA
+  SD_PROFILE_RECORD(SD_PROFILE_DATA, timestamp);
+#endif
+
+  return status;
+}
+
+sd_error sd_card_receive_data_block_finish(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t* data,
+  const uint16_t data_size
+)
+{
+  crc_buffer_16 crc_buffer = { 0 };
+  crc_16_result received_crc = { 0 };
+  sd_error status = SD_OK;
+  uint16_t checked_size = 0;
+  SD_PROFILE_START(timestamp);
+
+  crc_buffer_init_crc_16(&crc_buffer);
+
+#ifdef SD_USE_DMA
+  uint32_t timeout = sd_card_get_ticks(SD_TRANSMISSION_TIMEOUT * 1000U);
+  uint32_t captured_time = SD_GET_TIMESTAMP();
+
+  // The CRC of the already received part is calculated while
+  // the rest of the block is still moving
+  while (sd_card_dma_is_busy() &&
+    (SD_GET_TIMESTAMP() - captured_time) <= timeout)
+  {
+    uint16_t received_size = sd_card_dma_get_received(hspi, data_size);
+    if ((uint16_t)(received_size - checked_size) < SD_CRC_CHUNK_SIZE)
+      continue;
+
+    crc_buffer_update_crc_16(
+      &crc_buffer, data + checked_size, received_size - checked_size
+    );
+    checked_size = received_size;
+  }
+
+  status |= sd_card_dma_wait(hspi);
+  SD_PROFILE_RECORD(SD_PROFILE_DATA, timestamp);
+#endif
   status |= sd_card_receive_bytes(hspi, (uint8_t*)&received_crc, 2);
 
-  crc_16_result crc_result = crc_buffer_calculate_crc_16(
-    &crc_buffer, data, data_size
+  crc_buffer_update_crc_16(
+    &crc_buffer, data + checked_size, data_size - checked_size
   );
+  crc_16_result crc_result = crc_buffer_finalize_crc_16(&crc_buffer);
 
   // In the calculated CRC16, the bytes are in reverse order
-  if (!(received_crc.i8[1] == crc_result.i8[0] && 
-    received_crc.i8[0] == crc_result.i8[1]))
+  bool crc_error = !(received_crc.i8[1] == crc_result.i8[0] && 
+    received_crc.i8[0] == crc_result.i8[1]);
+  SD_PROFILE_RECORD(SD_PROFILE_CRC, timestamp);
+  sd_card_clock_report_crc(hspi, crc_error);
+
+  if (crc_error)
     return SD_CRC_ERROR;
   else
     return status;
 }
 
+sd_error sd_card_receive_data_block(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t* data,
+  const uint16_t data_size
+)
+{
+  sd_error status = sd_card_receive_data_block_start(hspi, data, data_size);
+  if (status)
+    return status;
+
+  return sd_card_receive_data_block_finish(hspi, data, data_size);
+}
+
+sd_error sd_card_poll_response(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t* received_value,
+  const uint8_t idle_value,
+  const uint16_t chunk_size
+)
+{
+  while (sd_card_lookahead_length)
+  {
+    *received_value = sd_card_lookahead[sd_card_lookahead_head++];
+    sd_card_lookahead_length--;
+
+    if (*received_value != idle_value)
+      return SD_OK;
+  }
+
+  *received_value = idle_value;
+
+  sd_error status = SD_TRANSPORT(receive)(
+    hspi, sd_card_lookahead, chunk_size
+  );
+  if (status)
+    return status;
+
+  for (uint16_t i = 0; i < chunk_size; i++)
+  {
+    if (sd_card_lookahead[i] == idle_value)
+      continue;
+
+    *received_value = sd_card_lookahead[i];
+    sd_card_lookahead_head = i + 1;
+    sd_card_lookahead_length = chunk_size - (i + 1);
+    return SD_OK;
+  }
+
+  return SD_BUSY;
+}
+
 // We are trying to get a non-zero byte.
 // The received byte is written to the argument
 sd_error sd_card_wait_response(
   SPI_HandleTypeDef *const hspi,
   uint8_t* received_value,
-  const uint8_t idle_value
+  const uint8_t idle_value,
+  const uint32_t timeout
 )
 {
-  sd_error status = SD_OK;
-  uint32_t captured_tick = HAL_GetTick();
+  uint16_t chunk_size = 1;
+  uint32_t captured_time = SD_GET_TIME_US();
 
-  do
+  // A response comes within a few bytes, so the first chunks are short.
+  // Long waits (data token, busy) are scanned in larger chunks
+  while (true)
   {
-    if ((HAL_GetTick() - captured_tick) > SD_TRANSMISSION_TIMEOUT)
-      return SD_TIMEOUT;
+    sd_error status = sd_card_poll_response(
+      hspi, received_value, idle_value, chunk_size
+    );
+    if (status != SD_BUSY)
+      return status;
 
-    status |= sd_card_receive_byte(hspi, received_value);
-  } while (*received_value == idle_value);
+    if ((SD_GET_TIME_US() - captured_time) > timeout)
+      return SD_TIMEOUT;
 
-  return status;
+    if (chunk_size < SD_POLL_CHUNK_SIZE)
+      chunk_size <<= 1;
+  }
 }
 
 sd_error sd_card_receive_cmd_response(
@@ -149,9 +594,13 @@ sd_error sd_card_receive_cmd_response(
   // Max length of cmd response - 5 bytes 
   // (excluding starting r1)
   uint8_t buffer[5] = { 0 };
+  SD_PROFILE_START(timestamp);
 	
   // We receive the first byte - r1
-  sd_error status = sd_card_wait_response(hspi, &r1, 0xff);
+  sd_error status = sd_card_wait_response(
+    hspi, &r1, 0xff, sd_card_timeouts.command
+  );
+  SD_PROFILE_RECORD(SD_PROFILE_R1, timestamp);
   *response = r1;
 
   if (status)
@@ -175,17 +624,11 @@ sd_error sd_card_get_csd(
   uint8_t *const csd
 )
 {
-  sd_command cmd_send_csd = sd_card_get_cmd(9, 0);
   sd_r1_response r1 = { 0 };
 
   // We request the CSD register to check the ability to set the block size
   SELECT_SD();
-  sd_error status = (sd_error)HAL_SPI_Transmit(
-    hspi,
-    (uint8_t*)&cmd_send_csd,
-    sizeof(cmd_send_csd),
-    SD_TRANSMISSION_TIMEOUT
-  );
+  sd_error status = sd_card_send_cmd(hspi, &sd_cmd_send_csd);
   status |= sd_card_receive_cmd_response(hspi, &r1, sizeof(r1));
   status |= sd_card_receive_data_block(hspi, csd, 16);
   DISELECT_SD();
@@ -213,3 +656,11 @@ sd_error sd_card_set_block_len(
 
   return status;
 }
+
+uint32_t sd_card_get_address_step(const uint32_t block_length)
+{
+  if (sd_card_status.capacity == HIGH_OR_EXTENDED)
+    return 1;
+
+  return block_length;
+}
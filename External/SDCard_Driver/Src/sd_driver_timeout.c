@@ -0,0 +1,154 @@
+/*
+Timeouts of the card operations
+*/
+
+#include "sd_driver_timeout.h"
+#include "sd_driver_clock.h"
+
+// Defines -------------------------------------------------------------------
+
+// SDHC cards are not larger than 32 GB (size in KBytes)
+#define SD_TIMEOUT_SDHC_MAX_SIZE (32U * 1024U * 1024U)
+
+// Variables -----------------------------------------------------------------
+
+sd_timeouts sd_card_timeouts = {
+  .command = SD_COMMAND_TIMEOUT,
+  .read = SD_TRANSMISSION_TIMEOUT * 1000U,
+  .write = SD_TRANSMISSION_TIMEOUT * 1000U,
+  .erase_offset = SD_TRANSMISSION_TIMEOUT * 1000U,
+  .erase_per_unit = 0,
+  .erase_unit = 1
+};
+
+// Static variables ----------------------------------------------------------
+
+static bool sd_timeout_is_card_known = false;
+static bool sd_timeout_is_extended = false; // SDXC
+// Typical access time: TAAC (ns) plus NSAC (clock cycles)
+static float sd_timeout_access_time = 0.f;
+static uint32_t sd_timeout_access_clocks = 0;
+static uint8_t sd_timeout_write_speed_factor = 1;
+
+// Static functions ----------------------------------------------------------
+
+// Rounded up to whole microseconds
+static uint32_t sd_timeout_get_limited(
+  const float time_ns,
+  const uint32_t max_timeout
+)
+{
+  float timeout = time_ns / 1000.f + 1.f;
+
+  return timeout < (float)max_timeout ? (uint32_t)timeout : max_timeout;
+}
+
+// Implementations -----------------------------------------------------------
+
+void sd_card_timeouts_reset(void)
+{
+  sd_timeout_is_card_known = false;
+  sd_card_timeouts = (sd_timeouts) {
+    .command = SD_COMMAND_TIMEOUT,
+    .read = SD_TRANSMISSION_TIMEOUT * 1000U,
+    .write = SD_TRANSMISSION_TIMEOUT * 1000U,
+    .erase_offset = SD_TRANSMISSION_TIMEOUT * 1000U,
+    .erase_per_unit = 0,
+    .erase_unit = 1
+  };
+}
+
+void sd_card_timeouts_init(
+  SPI_HandleTypeDef *const hspi,
+  const sd_info *const info,
+  const uint8_t *const ssr
+)
+{
+  // AU_SIZE code to KBytes
+  uint32_t au_sizes[] = {
+    0, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096,
+    8192, 12288, 16384, 24576, 32768, 65536
+  };
+
+  sd_timeout_is_card_known = true;
+  sd_timeout_is_extended = sd_card_status.capacity == HIGH_OR_EXTENDED &&
+    info->size > SD_TIMEOUT_SDHC_MAX_SIZE;
+  sd_timeout_access_time = info->access_time;
+  sd_timeout_access_clocks = info->access_clocks;
+  sd_timeout_write_speed_factor = info->write_speed_factor;
+
+  sd_card_timeouts_update(hspi);
+
+  // Without the erase parameters, each write block may take 250 ms
+  sd_card_timeouts.erase_offset = 0;
+  sd_card_timeouts.erase_per_unit = SD_ERASE_TIMEOUT_PER_BLOCK;
+  sd_card_timeouts.erase_unit = 1;
+  if (ssr == NULL)
+    return;
+
+  // AU_SIZE - bits 431:428, ERASE_SIZE - 423:408 (in AUs),
+  // ERASE_TIMEOUT - 407:402 (s), ERASE_OFFSET - 401:400 (s)
+  uint32_t au_size = au_sizes[ssr[10] >> 4];
+  uint32_t erase_size = ((uint32_t)ssr[11] << 8) | ssr[12];
+  uint32_t erase_timeout = ssr[13] >> 2;
+  uint32_t erase_offset = ssr[13] & 0x3;
+
+  // Zero - the card does not support the timeout calculation
+  if (au_size == 0 || erase_size == 0 || erase_timeout == 0)
+    return;
+
+  sd_card_timeouts.erase_offset = erase_offset * 1000000U;
+  sd_card_timeouts.erase_per_unit = (uint32_t)(
+    ((uint64_t)erase_timeout * 1000000 + erase_size - 1) / erase_size
+  );
+  sd_card_timeouts.erase_unit = au_size * 2; // 512-byte blocks
+}
+
+void sd_card_timeouts_update(SPI_HandleTypeDef *const hspi)
+{
+  if (!sd_timeout_is_card_known)
+    return;
+
+  // For SDHC and SDXC the timeouts are fixed
+  if (sd_card_status.capacity == HIGH_OR_EXTENDED)
+  {
+    sd_card_timeouts.read = SD_READ_TIMEOUT_MAX;
+    sd_card_timeouts.write = sd_timeout_is_extended ?
+      SD_WRITE_TIMEOUT_MAX_SDXC : SD_WRITE_TIMEOUT_MAX;
+    return;
+  }
+
+  uint32_t clock = sd_card_get_clock(hspi);
+  float access_time = sd_timeout_access_time;
+  if (clock)
+    access_time += (float)sd_timeout_access_clocks * 1e9f / (float)clock;
+
+  // 100 times the typical access time, writes - times R2W_FACTOR
+  sd_card_timeouts.read = sd_timeout_get_limited(
+    access_time * 100.f, SD_READ_TIMEOUT_MAX
+  );
+  sd_card_timeouts.write = sd_timeout_get_limited(
+    access_time * 100.f * (float)sd_timeout_write_speed_factor,
+    SD_WRITE_TIMEOUT_MAX
+  );
+}
+
+uint32_t sd_card_get_erase_timeout(
+  const uint32_t start_address,
+  const uint32_t end_address
+)
+{
+  uint32_t address_step = sd_card_get_address_step(512);
+  uint32_t number_of_blocks = 1;
+
+  if (end_address > start_address)
+    number_of_blocks += (end_address - start_address) / address_step;
+
+  // An area smaller than the unit takes as long as the whole unit
+  uint64_t units = ((uint64_t)number_of_blocks +
+    sd_card_timeouts.erase_unit - 1) / sd_card_timeouts.erase_unit;
+  uint64_t timeout = sd_card_timeouts.erase_offset +
+    units * sd_card_timeouts.erase_per_unit;
+
+  return timeout > UINT32_MAX ? UINT32_MAX : (uint32_t)timeout;
+}
@@ -0,0 +1,204 @@
+/*
+* Transport over STM32 HAL SPI and GPIO calls
+*/
+
+#ifndef SD_TRANSPORT_SIM
+
+#include "sd_driver_secondary.h"
+
+// Defines -------------------------------------------------------------------
+
+// BR[2:0] = 7 - clock divided by 256
+#define SD_MAX_PRESCALER_INDEX 7U
+
+// Static variables ----------------------------------------------------------
+
+// While receiving, the line must be held high. One shared pattern lets the
+// whole block be clocked out by a single HAL call instead of one per byte
+static const uint8_t sd_card_dummy_pattern[SD_BULK_TRANSFER_SIZE] = {
+  [0 ... SD_BULK_TRANSFER_SIZE - 1] = 0xff
+};
+
+// Static functions ----------------------------------------------------------
+
+static sd_error sd_card_hal_exchange(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t tx_data,
+  uint8_t *const rx_data
+)
+{
+  return (sd_error)HAL_SPI_TransmitReceive(
+    hspi, (uint8_t*)&tx_data, rx_data, 1, SD_TRANSMISSION_TIMEOUT
+  );
+}
+
+static sd_error sd_card_hal_transmit(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const data,
+  const uint16_t size
+)
+{
+  return (sd_error)HAL_SPI_Transmit(
+    hspi, (uint8_t*)data, size, SD_TRANSMISSION_TIMEOUT
+  );
+}
+
+static sd_error sd_card_hal_receive(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t *const data,
+  const uint16_t size
+)
+{
+  sd_error status = SD_OK;
+
+  // Blocks larger than the pattern are received in several transfers
+  for (uint16_t offset = 0; offset < size; offset += SD_BULK_TRANSFER_SIZE)
+  {
+    uint16_t chunk_size = size - offset;
+    if (chunk_size > SD_BULK_TRANSFER_SIZE)
+      chunk_size = SD_BULK_TRANSFER_SIZE;
+
+    status |= HAL_SPI_TransmitReceive(
+      hspi,
+      (uint8_t*)sd_card_dummy_pattern,
+      data + offset,
+      chunk_size,
+      SD_TRANSMISSION_TIMEOUT
+    );
+  }
+
+  return status;
+}
+
+#ifdef SD_USE_DMA
+
+static sd_error sd_card_hal_receive_start(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t *const data,
+  const uint16_t size
+)
+{
+  return (sd_error)HAL_SPI_TransmitReceive_DMA(
+    hspi, (uint8_t*)sd_card_dummy_pattern, data, size
+  );
+}
+
+static sd_error sd_card_hal_transmit_start(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const data,
+  const uint16_t size
+)
+{
+  return (sd_error)HAL_SPI_Transmit_DMA(hspi, (uint8_t*)data, size);
+}
+
+static uint16_t sd_card_hal_get_remaining(SPI_HandleTypeDef *const hspi)
+{
+  // The counter is decremented after each byte is written to memory
+  return (uint16_t)__HAL_DMA_GET_COUNTER(hspi->hdmarx);
+}
+
+static void sd_card_hal_abort(SPI_HandleTypeDef *const hspi)
+{
+  HAL_SPI_Abort(hspi);
+}
+
+#endif
+
+static void sd_card_hal_select(void)
+{
+  HAL_GPIO_WritePin(SD_CS_GPIO_PORT, SD_CS_PIN, GPIO_PIN_RESET);
+}
+
+static void sd_card_hal_deselect(void)
+{
+  HAL_GPIO_WritePin(SD_CS_GPIO_PORT, SD_CS_PIN, GPIO_PIN_SET);
+}
+
+static uint32_t sd_card_hal_get_bus_clock(SPI_HandleTypeDef *const hspi)
+{
+  // SPI1 is on APB2, others are on APB1
+  if (hspi->Instance == SPI1)
+    return HAL_RCC_GetPCLK2Freq();
+
+  return HAL_RCC_GetPCLK1Freq();
+}
+
+// The clock is the bus clock divided by 2^(index + 1)
+static sd_error sd_card_hal_set_clock(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t max_clock
+)
+{
+  uint32_t bus_clock = sd_card_hal_get_bus_clock(hspi);
+  uint8_t index = 0;
+
+  while ((bus_clock >> (index + 1)) > max_clock)
+  {
+    if (index == SD_MAX_PRESCALER_INDEX)
+      return SD_INCORRECT_ARGUMENT;
+    index++;
+  }
+
+  uint32_t prescaler = (uint32_t)index << SPI_CR1_BR_Pos;
+
+  // The baud rate must not be changed while communication is ongoing.
+  // HAL enables SPI again at the start of the next transfer
+  __HAL_SPI_DISABLE(hspi);
+  MODIFY_REG(hspi->Instance->CR1, SPI_CR1_BR, prescaler);
+  hspi->Init.BaudRatePrescaler = prescaler;
+
+  return SD_OK;
+}
+
+static uint32_t sd_card_hal_get_clock(SPI_HandleTypeDef *const hspi)
+{
+  uint8_t index =
+    (READ_REG(hspi->Instance->CR1) & SPI_CR1_BR) >> SPI_CR1_BR_Pos;
+
+  return sd_card_hal_get_bus_clock(hspi) >> (index + 1);
+}
+
+
+// Callbacks -----------------------------------------------------------------
+
+#ifdef SD_USE_DMA
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+  sd_card_dma_complete(hspi, SD_OK);
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+  sd_card_dma_complete(hspi, SD_OK);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+  sd_card_dma_complete(hspi, SD_ERROR);
+}
+
+#endif
+
+// Variables -----------------------------------------------------------------
+
+const sd_transport sd_transport_hal = {
+  .exchange = sd_card_hal_exchange,
+  .transmit = sd_card_hal_transmit,
+  .receive = sd_card_hal_receive,
+#ifdef SD_USE_DMA
+  .receive_start = sd_card_hal_receive_start,
+  .transmit_start = sd_card_hal_transmit_start,
+  .get_remaining = sd_card_hal_get_remaining,
+  .abort = sd_card_hal_abort,
+#endif
+  .select = sd_card_hal_select,
+  .deselect = sd_card_hal_deselect,
+  .set_clock = sd_card_hal_set_clock,
+  .get_clock = sd_card_hal_get_clock,
+  .get_timestamp = sd_card_dwt_get_timestamp,
+  .get_timestamp_frequency = sd_card_dwt_get_frequency
+};
+
+#endif
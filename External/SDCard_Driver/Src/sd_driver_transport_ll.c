@@ -0,0 +1,193 @@
+/*
+* Transport over SPI registers (LL), without HAL locking and state checks
+*/
+
+#ifndef SD_TRANSPORT_SIM
+
+#include "sd_driver_transport_ll.h"
+#include "stm32f1xx_ll_spi.h"
+
+// Defines -------------------------------------------------------------------
+
+// BR[2:0] = 7 - clock divided by 256
+#define SD_MAX_PRESCALER_INDEX 7U
+
+// Static functions ----------------------------------------------------------
+
+// HAL leaves SPI disabled after the clock is changed
+static inline void sd_card_ll_enable(SPI_TypeDef *const spi)
+{
+  if (!LL_SPI_IsEnabled(spi))
+    LL_SPI_Enable(spi);
+}
+
+// Received bytes of a transmission are dropped, so the next receive
+// starts with an empty data register
+static inline void sd_card_ll_drop_received(SPI_TypeDef *const spi)
+{
+  while (!LL_SPI_IsActiveFlag_TXE(spi));
+  while (LL_SPI_IsActiveFlag_BSY(spi));
+
+  // Reads DR and SR: clears RXNE and OVR
+  LL_SPI_ClearFlag_OVR(spi);
+}
+
+static uint32_t sd_card_ll_get_bus_clock(SPI_HandleTypeDef *const hspi)
+{
+  // SPI1 is on APB2, others are on APB1
+  if (hspi->Instance == SPI1)
+    return HAL_RCC_GetPCLK2Freq();
+
+  return HAL_RCC_GetPCLK1Freq();
+}
+
+// Implementations -----------------------------------------------------------
+
+// In master mode the flags are set within one byte time, so the loops do
+// not check the tick
+
+sd_error sd_card_ll_exchange(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t tx_data,
+  uint8_t *const rx_data
+)
+{
+  SPI_TypeDef *spi = hspi->Instance;
+  sd_card_ll_enable(spi);
+
+  while (!LL_SPI_IsActiveFlag_TXE(spi));
+  LL_SPI_TransmitData8(spi, tx_data);
+  while (!LL_SPI_IsActiveFlag_RXNE(spi));
+  *rx_data = LL_SPI_ReceiveData8(spi);
+
+  return SD_OK;
+}
+
+sd_error sd_card_ll_transmit(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const data,
+  const uint16_t size
+)
+{
+  SPI_TypeDef *spi = hspi->Instance;
+  sd_card_ll_enable(spi);
+
+  // The next byte is written while the previous one is being shifted out
+  for (uint16_t i = 0; i < size; i++)
+  {
+    while (!LL_SPI_IsActiveFlag_TXE(spi));
+    LL_SPI_TransmitData8(spi, data[i]);
+  }
+
+  sd_card_ll_drop_received(spi);
+  return SD_OK;
+}
+
+sd_error sd_card_ll_receive(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t *const data,
+  const uint16_t size
+)
+{
+  SPI_TypeDef *spi = hspi->Instance;
+
+  if (size == 0)
+    return SD_OK;
+
+  sd_card_ll_enable(spi);
+
+  // One byte is always in flight: 0xff for byte i + 1 is written before
+  // byte i is read, so the clock does not stop between bytes
+  while (!LL_SPI_IsActiveFlag_TXE(spi));
+  LL_SPI_TransmitData8(spi, 0xff);
+  for (uint16_t i = 0; i < size - 1; i++)
+  {
+    while (!LL_SPI_IsActiveFlag_TXE(spi));
+    LL_SPI_TransmitData8(spi, 0xff);
+    while (!LL_SPI_IsActiveFlag_RXNE(spi));
+    data[i] = LL_SPI_ReceiveData8(spi);
+  }
+  while (!LL_SPI_IsActiveFlag_RXNE(spi));
+  data[size - 1] = LL_SPI_ReceiveData8(spi);
+
+  // An interrupt longer than one byte time loses a byte
+  if (LL_SPI_IsActiveFlag_OVR(spi))
+  {
+    LL_SPI_ClearFlag_OVR(spi);
+    return SD_ERROR;
+  }
+
+  return SD_OK;
+}
+
+void sd_card_ll_select(void)
+{
+  WRITE_REG(SD_CS_GPIO_PORT->BRR, SD_CS_PIN);
+}
+
+void sd_card_ll_deselect(void)
+{
+  WRITE_REG(SD_CS_GPIO_PORT->BSRR, SD_CS_PIN);
+}
+
+// The clock is the bus clock divided by 2^(index + 1)
+sd_error sd_card_ll_set_clock(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t max_clock
+)
+{
+  uint32_t bus_clock = sd_card_ll_get_bus_clock(hspi);
+  uint8_t index = 0;
+
+  while ((bus_clock >> (index + 1)) > max_clock)
+  {
+    if (index == SD_MAX_PRESCALER_INDEX)
+      return SD_INCORRECT_ARGUMENT;
+    index++;
+  }
+
+  uint32_t prescaler = (uint32_t)index << SPI_CR1_BR_Pos;
+
+  // The baud rate must not be changed while communication is ongoing
+  LL_SPI_Disable(hspi->Instance);
+  LL_SPI_SetBaudRatePrescaler(hspi->Instance, prescaler);
+  LL_SPI_Enable(hspi->Instance);
+  hspi->Init.BaudRatePrescaler = prescaler;
+
+  return SD_OK;
+}
+
+uint32_t sd_card_ll_get_clock(SPI_HandleTypeDef *const hspi)
+{
+  uint8_t index = LL_SPI_GetBaudRatePrescaler(hspi->Instance) >>
+    SPI_CR1_BR_Pos;
+
+  return sd_card_ll_get_bus_clock(hspi) >> (index + 1);
+}
+
+uint32_t sd_card_ll_get_timestamp(void)
+{
+  return sd_card_dwt_get_timestamp();
+}
+
+uint32_t sd_card_ll_get_timestamp_frequency(void)
+{
+  return sd_card_dwt_get_frequency();
+}
+
+// Variables -----------------------------------------------------------------
+
+// Without asynchronous transfers, SD_USE_DMA falls back to blocking ones
+const sd_transport sd_transport_ll = {
+  .exchange = sd_card_ll_exchange,
+  .transmit = sd_card_ll_transmit,
+  .receive = sd_card_ll_receive,
+  .select = sd_card_ll_select,
+  .deselect = sd_card_ll_deselect,
+  .set_clock = sd_card_ll_set_clock,
+  .get_clock = sd_card_ll_get_clock,
+  .get_timestamp = sd_card_ll_get_timestamp,
+  .get_timestamp_frequency = sd_card_ll_get_timestamp_frequency
+};
+
+#endif
@@ -0,0 +1,1009 @@
+/*
+Simulated SD card in SPI mode for host builds
+*/
+
+#ifdef SD_TRANSPORT_SIM
+
+#include "sd_driver_transport_sim.h"
+#include "sd_driver_init.h"
+#include "crc-buffer.h"
+#include "string.h"
+
+// Defines -------------------------------------------------------------------
+
+#define SD_SIM_QUEUE_SIZE 8U
+
+// BR[2:0] = 7 - clock divided by 256
+#define SD_SIM_MAX_PRESCALER_INDEX 7U
+
+// Structs -------------------------------------------------------------------
+
+typedef enum
+{
+  SD_SIM_FILL = 0x0U, // value, count times
+  SD_SIM_DATA, // count bytes from data
+  SD_SIM_WAIT // value until the time
+} sd_sim_segment_kind;
+
+// Part of the card output
+typedef struct
+{
+  sd_sim_segment_kind kind;
+  uint8_t value;
+  uint32_t count;
+  const uint8_t *data;
+  uint64_t until_ns;
+} sd_sim_segment;
+
+typedef enum
+{
+  SD_SIM_COMMAND = 0x0U,
+  SD_SIM_WRITE_TOKEN,
+  SD_SIM_WRITE_DATA
+} sd_sim_input_state;
+
+typedef struct
+{
+  sd_sim_config config;
+
+  bool selected;
+  bool idle;
+  bool application_command;
+  bool crc_enabled;
+  bool high_speed_active;
+  uint16_t init_polls_left;
+  uint32_t block_length;
+
+  sd_sim_input_state input_state;
+  uint8_t command[6];
+  uint8_t command_length;
+
+  bool multiple_read;
+  bool multiple_write;
+  uint32_t pre_erased_blocks; // Left of the ACMD23 count
+  uint32_t written_blocks; // Accepted by the last write (ACMD22)
+  bool is_write_error_injected;
+  uint32_t blocks_before_write_error;
+  bool is_read_error_injected;
+  uint32_t blocks_before_read_error;
+  uint32_t block_count; // Set by CMD23 for the next command
+  uint32_t read_blocks_left; // Of a bounded multiple read (0 - open-ended)
+  uint64_t offset; // Of the next block of a multiple read or write
+  uint64_t erase_start;
+  uint64_t erase_end;
+
+  uint8_t write_buffer[SD_SIM_SECTOR_SIZE + 2];
+  uint32_t write_received;
+
+  sd_sim_segment queue[SD_SIM_QUEUE_SIZE];
+  uint8_t queue_head;
+  uint8_t queue_length;
+
+  // Sources of the queued data
+  uint8_t response[5];
+  uint8_t data_token;
+  uint8_t data_response;
+  uint8_t registers[64];
+  uint8_t data_crc[2];
+
+  uint8_t prescaler_index;
+  uint64_t time_ns;
+} sd_sim_card;
+
+// The driver only passes the handle through
+struct __SPI_HandleTypeDef
+{
+  uint8_t unused;
+};
+
+typedef struct
+{
+  SPI_HandleTypeDef *hspi;
+  const uint8_t *tx_data; // NULL - 0xff is transmitted
+  uint8_t *rx_data;
+  uint16_t size;
+  uint16_t done;
+  uint64_t start_ns;
+} sd_sim_transfer;
+
+// Static variables ----------------------------------------------------------
+
+static SPI_HandleTypeDef sd_sim_spi = { 0 };
+static sd_sim_card sd_sim = { 0 };
+static sd_sim_stats sd_sim_statistics = { 0 };
+static uint64_t sd_sim_stats_start_ns = 0;
+
+#ifdef SD_USE_DMA
+static sd_sim_transfer sd_sim_async = { 0 };
+static bool sd_sim_async_active = false;
+#endif
+
+// Static functions ----------------------------------------------------------
+
+static uint64_t sd_sim_get_byte_ns(void)
+{
+  uint32_t clock = sd_sim.config.bus_clock >> (sd_sim.prescaler_index + 1);
+
+  return 8000000000ULL / clock;
+}
+
+static uint64_t sd_sim_get_capacity(void)
+{
+  return (uint64_t)sd_sim.config.sectors * SD_SIM_SECTOR_SIZE;
+}
+
+static void sd_sim_clear_queue(void)
+{
+  sd_sim.queue_head = 0;
+  sd_sim.queue_length = 0;
+}
+
+static void sd_sim_push(const sd_sim_segment segment)
+{
+  if (sd_sim.queue_length == SD_SIM_QUEUE_SIZE)
+    return;
+
+  uint8_t index = (sd_sim.queue_head + sd_sim.queue_length) %
+    SD_SIM_QUEUE_SIZE;
+  sd_sim.queue[index] = segment;
+  sd_sim.queue_length++;
+}
+
+static void sd_sim_push_fill(const uint8_t value, const uint32_t count)
+{
+  sd_sim_push((sd_sim_segment) {
+    .kind = SD_SIM_FILL, .value = value, .count = count
+  });
+}
+
+static void sd_sim_push_data(const uint8_t *const data, const uint32_t count)
+{
+  sd_sim_push((sd_sim_segment) {
+    .kind = SD_SIM_DATA, .data = data, .count = count
+  });
+}
+
+static void sd_sim_push_wait(const uint8_t value, const uint32_t time_ns)
+{
+  sd_sim_push((sd_sim_segment) {
+    .kind = SD_SIM_WAIT, .value = value, .until_ns = sd_sim.time_ns + time_ns
+  });
+}
+
+static uint8_t sd_sim_get_r1(void)
+{
+  return sd_sim.idle ? R1_IN_IDLE_STATE : R1_CLEAR_FLAGS;
+}
+
+static void sd_sim_push_r1(const uint8_t r1)
+{
+  sd_sim.response[0] = r1;
+  sd_sim_push_data(sd_sim.response, 1);
+}
+
+// Token, data and CRC16 (MSB first)
+static void sd_sim_push_data_block(
+  const uint8_t *const data,
+  const uint16_t size
+)
+{
+  crc_buffer_16 crc_buffer = { 0 };
+  crc_16_result crc = crc_buffer_calculate_crc_16(
+    &crc_buffer, (uint8_t*)data, size
+  );
+
+  sd_sim.data_crc[0] = crc.i16 >> 8;
+  sd_sim.data_crc[1] = crc.i16 & 0xff;
+  sd_sim.data_token = 0xfe;
+
+  sd_sim_push_data(&sd_sim.data_token, 1);
+  sd_sim_push_data(data, size);
+  sd_sim_push_data(sd_sim.data_crc, 2);
+}
+
+// Register contents (CSD, SCR, SD status...) as a data block
+static void sd_sim_push_register_block(const uint16_t size)
+{
+  sd_sim_push_fill(0xff, 1);
+  sd_sim_push_wait(0xff, sd_sim.config.register_latency_ns);
+  sd_sim_push_data_block(sd_sim.registers, size);
+}
+
+// A block of the storage. The CRC is pushed by reference, so an injected
+// error can corrupt it after the data
+static void sd_sim_push_storage_block(const uint64_t offset)
+{
+  sd_sim_push_data_block(sd_sim.config.storage + offset, sd_sim.block_length);
+
+  if (sd_sim.is_read_error_injected &&
+    sd_sim.blocks_before_read_error-- == 0)
+  {
+    sd_sim.is_read_error_injected = false;
+    sd_sim.data_crc[0] ^= 0xff;
+  }
+}
+
+// A bounded multiple read ends after its last block
+static void sd_sim_count_read_block(void)
+{
+  if (sd_sim.read_blocks_left && --sd_sim.read_blocks_left == 0)
+    sd_sim.multiple_read = false;
+}
+
+// The next block of a multiple read
+static void sd_sim_push_next_block(void)
+{
+  sd_sim_push_wait(0xff, sd_sim.config.read_gap_ns);
+
+  if (sd_sim.offset + sd_sim.block_length > sd_sim_get_capacity())
+  {
+    // Error token: out of range
+    sd_sim.data_token = 0x08;
+    sd_sim_push_data(&sd_sim.data_token, 1);
+    sd_sim.multiple_read = false;
+    return;
+  }
+
+  sd_sim_push_storage_block(sd_sim.offset);
+  sd_sim.offset += sd_sim.block_length;
+  sd_sim_count_read_block();
+}
+
+static uint8_t sd_sim_pop(void)
+{
+  while (true)
+  {
+    if (sd_sim.queue_length == 0)
+    {
+      if (!sd_sim.multiple_read)
+        return 0xff;
+
+      sd_sim_push_next_block();
+    }
+
+    sd_sim_segment *segment = &sd_sim.queue[sd_sim.queue_head];
+
+    if (segment->kind == SD_SIM_WAIT && sd_sim.time_ns < segment->until_ns)
+      return segment->value;
+
+    if (segment->kind != SD_SIM_WAIT && segment->count)
+    {
+      segment->count--;
+      if (segment->kind == SD_SIM_FILL)
+        return segment->value;
+      return *segment->data++;
+    }
+
+    sd_sim.queue_head = (sd_sim.queue_head + 1) % SD_SIM_QUEUE_SIZE;
+    sd_sim.queue_length--;
+  }
+}
+
+// Byte address of the block, false - out of range
+static bool sd_sim_get_offset(const uint32_t argument, uint64_t *const offset)
+{
+  *offset = sd_sim.config.high_capacity ?
+    (uint64_t)argument * SD_SIM_SECTOR_SIZE : argument;
+
+  return *offset + sd_sim.block_length <= sd_sim_get_capacity();
+}
+
+static void sd_sim_build_scr(void)
+{
+  uint8_t *scr = sd_sim.registers;
+
+  memset(scr, 0, SD_SCR_SIZE);
+  scr[0] = 0x02; // SCR version 1.0, physical layer 2.00
+  scr[1] = 0x05; // 1 and 4 bit bus
+  scr[2] = 0x80; // Physical layer 3.0x
+  scr[3] = sd_sim.config.block_count ? 0x02 : 0;
+}
+
+// SD status: 4 MB allocation units, erase of one AU takes up to 1 s
+// plus 1 s offset
+static void sd_sim_build_ssr(void)
+{
+  uint8_t *ssr = sd_sim.registers;
+
+  memset(ssr, 0, SD_SSR_SIZE);
+  ssr[10] = 0x90; // AU_SIZE
+  ssr[12] = 0x01; // ERASE_SIZE
+  ssr[13] = (1 << 2) | 1; // ERASE_TIMEOUT, ERASE_OFFSET
+}
+
+static void sd_sim_build_csd(void)
+{
+  uint8_t *csd = sd_sim.registers;
+  // Classes 0, 2, 4, 5, 7, 8 and 10 (switch)
+  uint16_t classes = sd_sim.config.high_speed ? 0x5b5 : 0x1b5;
+
+  memset(csd, 0, 16);
+  csd[1] = 0x0e; // TAAC: 1 ms
+  csd[3] = sd_sim.high_speed_active ? 0x5a : 0x32; // 50 or 25 MHz
+  csd[4] = classes >> 4;
+  csd[5] = ((classes & 0xf) << 4) | 9; // READ_BL_LEN: 512
+  csd[10] = 0x7f; // ERASE_BLK_EN, SECTOR_SIZE
+  csd[11] = 0x80;
+  csd[12] = (0x2 << 2) | (9 >> 2); // R2W_FACTOR: 4, WRITE_BL_LEN: 512
+  csd[13] = (9 & 0x3) << 6;
+
+  if (sd_sim.config.high_capacity)
+  {
+    // Capacity: (C_SIZE + 1) * 512 KB
+    uint32_t c_size = sd_sim.config.sectors / 1024 - 1;
+
+    csd[0] = 0x40;
+    csd[7] = (c_size >> 16) & 0x3f;
+    csd[8] = c_size >> 8;
+    csd[9] = c_size;
+  }
+  else
+  {
+    // Capacity: (C_SIZE + 1) * 2^(C_SIZE_MULT + 2) * 512, C_SIZE_MULT = 7
+    uint32_t c_size = sd_sim.config.sectors / 512 - 1;
+
+    csd[6] = 0x80 | ((c_size >> 10) & 0x3); // READ_BL_PARTIAL
+    csd[7] = c_size >> 2;
+    csd[8] = ((c_size & 0x3) << 6) | 0x3f; // Max currents
+    csd[9] = 0xfc | (7 >> 1);
+    csd[10] |= (7 & 0x1) << 7;
+  }
+
+  crc_buffer_7 crc_buffer;
+  csd[15] = crc_buffer_calculate_crc_7(&crc_buffer, csd, 15);
+}
+
+// CMD6 status: support bits (bytes 2-13) and selected functions (14-16)
+static void sd_sim_build_switch_status(const uint32_t argument)
+{
+  uint8_t *status = sd_sim.registers;
+  bool switch_mode = argument >> 31;
+
+  memset(status, 0, SD_SWITCH_STATUS_SIZE);
+  status[1] = 100; // Max current, mA
+
+  for (uint8_t group = 1; group <= 6; group++)
+  {
+    uint8_t support_index = 13 - ((group - 1) << 1);
+    uint8_t function = (argument >> ((group - 1) << 2)) & 0xf;
+    uint8_t supported = 0x1;
+
+    if (group == 1 && sd_sim.config.high_speed)
+      supported |= 0x2;
+
+    status[support_index] = supported;
+    status[support_index - 1] = 0x80; // Function 15
+
+    uint8_t selected = 0xf;
+    if (function == 0xf)
+      selected = group == 1 ? sd_sim.high_speed_active : 0;
+    else if (function < 8 && (supported & (1 << function)))
+      selected = function;
+
+    if (group == 1 && switch_mode && sd_sim.config.high_speed_rejected)
+      selected = 0xf;
+    if (group == 1 && switch_mode && selected != 0xf)
+      sd_sim.high_speed_active = selected == 1;
+
+    uint8_t result_index = 16 - ((group - 1) >> 1);
+    status[result_index] |= ((group - 1) & 0x1) ? selected << 4 : selected;
+  }
+
+  status[17] = 0x1; // Data structure version
+}
+
+static void sd_sim_execute_command(void)
+{
+  uint8_t index = sd_sim.command[0] & 0x3f;
+  uint32_t argument = ((uint32_t)sd_sim.command[1] << 24) |
+    ((uint32_t)sd_sim.command[2] << 16) |
+    ((uint32_t)sd_sim.command[3] << 8) | sd_sim.command[4];
+  bool application_command = sd_sim.application_command;
+  uint64_t offset = 0;
+  uint32_t block_count = sd_sim.block_count;
+
+  sd_sim_statistics.commands++;
+  sd_sim.application_command = false;
+  sd_sim.block_count = 0;
+
+  // CMD12 stops the data that is being sent. The response comes after
+  // one byte (NCR), CMD12 response - after one more (stuff byte)
+  sd_sim_clear_queue();
+  sd_sim_push_fill(0xff, index == 12 ? 2 : 1);
+
+  // CMD0 and CMD8 are always protected by CRC
+  crc_buffer_7 crc_buffer;
+  if ((sd_sim.crc_enabled || index == 0 || index == 8) &&
+    crc_buffer_calculate_crc_7(&crc_buffer, sd_sim.command, 5) !=
+      sd_sim.command[5])
+  {
+    sd_sim_statistics.crc_errors++;
+    sd_sim_push_r1(sd_sim_get_r1() | R1_COM_CRC_ERROR);
+    return;
+  }
+
+  if (application_command && index == 41)
+  {
+    if (sd_sim.init_polls_left)
+      sd_sim.init_polls_left--;
+    else
+      sd_sim.idle = false;
+
+    sd_sim_push_r1(sd_sim_get_r1());
+    return;
+  }
+
+  if (application_command && index == 23 && sd_sim.config.pre_erased_busy_ns)
+  {
+    sd_sim.pre_erased_blocks = argument & 0x7fffff;
+    sd_sim_push_r1(sd_sim_get_r1());
+    return;
+  }
+
+  if (application_command && index == 22)
+  {
+    sd_sim.registers[0] = sd_sim.written_blocks >> 24;
+    sd_sim.registers[1] = (sd_sim.written_blocks >> 16) & 0xff;
+    sd_sim.registers[2] = (sd_sim.written_blocks >> 8) & 0xff;
+    sd_sim.registers[3] = sd_sim.written_blocks & 0xff;
+    sd_sim_push_r1(sd_sim_get_r1());
+    sd_sim_push_register_block(4);
+    return;
+  }
+
+  if (application_command && index == 13)
+  {
+    sd_sim_build_ssr();
+    // R2: R1 and the second status byte
+    sd_sim.response[0] = sd_sim_get_r1();
+    sd_sim.response[1] = 0;
+    sd_sim_push_data(sd_sim.response, 2);
+    sd_sim_push_register_block(SD_SSR_SIZE);
+    return;
+  }
+
+  if (application_command && index == 51)
+  {
+    sd_sim_build_scr();
+    sd_sim_push_r1(sd_sim_get_r1());
+    sd_sim_push_register_block(SD_SCR_SIZE);
+    return;
+  }
+
+  switch (index)
+  {
+    case 0:
+      sd_sim.idle = true;
+      sd_sim.crc_enabled = false;
+      sd_sim.multiple_read = false;
+      sd_sim_push_r1(R1_IN_IDLE_STATE);
+      break;
+    case 8:
+      if (sd_sim.config.version_1)
+      {
+        sd_sim_push_r1(sd_sim_get_r1() | R1_ILLEGAL_COMMAND);
+        break;
+      }
+      sd_sim.response[0] = sd_sim_get_r1();
+      sd_sim.response[1] = 0;
+      sd_sim.response[2] = 0;
+      sd_sim.response[3] = (argument >> 8) & 0xf; // Voltage accepted
+      sd_sim.response[4] = argument & 0xff; // Check pattern
+      sd_sim_push_data(sd_sim.response, 5);
+      break;
+    case 9:
+      sd_sim_build_csd();
+      sd_sim_push_r1(sd_sim_get_r1());
+      sd_sim_push_register_block(16);
+      break;
+    case 6:
+      sd_sim_build_switch_status(argument);
+      sd_sim_push_r1(sd_sim_get_r1());
+      sd_sim_push_register_block(SD_SWITCH_STATUS_SIZE);
+      break;
+    case 12:
+      sd_sim.multiple_read = false;
+      sd_sim_push_r1(sd_sim_get_r1());
+      sd_sim_push_fill(0x0, 1); // Busy
+      sd_sim_push_wait(0x0, sd_sim.config.stop_busy_ns);
+      break;
+    case 16:
+      // SDHC blocks are always 512 bytes
+      if (argument == 0 || argument > SD_SIM_SECTOR_SIZE ||
+        (sd_sim.config.high_capacity && argument != SD_SIM_SECTOR_SIZE))
+      {
+        sd_sim_push_r1(sd_sim_get_r1() | R1_PARAMETER_ERROR);
+        break;
+      }
+      sd_sim.block_length = argument;
+      sd_sim_push_r1(sd_sim_get_r1());
+      break;
+    case 17:
+    case 18:
+      if (!sd_sim_get_offset(argument, &offset))
+      {
+        sd_sim_push_r1(sd_sim_get_r1() | R1_ADDRESS_ERROR);
+        break;
+      }
+      sd_sim_push_r1(sd_sim_get_r1());
+      sd_sim_push_wait(0xff, sd_sim.config.read_latency_ns);
+      sd_sim_push_storage_block(offset);
+      sd_sim.offset = offset + sd_sim.block_length;
+      sd_sim.multiple_read = index == 18;
+      sd_sim.read_blocks_left = index == 18 ? block_count : 0;
+      sd_sim_count_read_block();
+      break;
+    case 23:
+      if (!sd_sim.config.block_count || argument == 0)
+      {
+        sd_sim_push_r1(sd_sim_get_r1() | R1_ILLEGAL_COMMAND);
+        break;
+      }
+      sd_sim.block_count = argument;
+      sd_sim_push_r1(sd_sim_get_r1());
+      break;
+    case 24:
+    case 25:
+      if (!sd_sim_get_offset(argument, &offset))
+      {
+        sd_sim_push_r1(sd_sim_get_r1() | R1_ADDRESS_ERROR);
+        break;
+      }
+      sd_sim_push_r1(sd_sim_get_r1());
+      sd_sim.offset = offset;
+      sd_sim.written_blocks = 0;
+      sd_sim.multiple_write = index == 25;
+      sd_sim.input_state = SD_SIM_WRITE_TOKEN;
+      break;
+    case 32:
+    case 33:
+      offset = sd_sim.config.high_capacity ?
+        (uint64_t)argument * SD_SIM_SECTOR_SIZE : argument;
+      if (index == 32)
+        sd_sim.erase_start = offset;
+      else
+        sd_sim.erase_end = offset;
+      sd_sim_push_r1(sd_sim_get_r1());
+      break;
+    case 38:
+      // Whole blocks from the start to the end one inclusive
+      sd_sim.erase_start -= sd_sim.erase_start % SD_SIM_SECTOR_SIZE;
+      sd_sim.erase_end += SD_SIM_SECTOR_SIZE -
+        sd_sim.erase_end % SD_SIM_SECTOR_SIZE;
+      if (sd_sim.erase_end > sd_sim_get_capacity() ||
+        sd_sim.erase_start >= sd_sim.erase_end)
+      {
+        sd_sim_push_r1(sd_sim_get_r1() | R1_ERASE_SEQUENCE_ERROR);
+        break;
+      }
+      memset(
+        sd_sim.config.storage + sd_sim.erase_start,
+        0,
+        sd_sim.erase_end - sd_sim.erase_start
+      );
+      sd_sim_push_r1(sd_sim_get_r1());
+      sd_sim_push_wait(0x0, sd_sim.config.erase_busy_ns);
+      break;
+    case 55:
+      sd_sim.application_command = true;
+      sd_sim_push_r1(sd_sim_get_r1());
+      break;
+    case 58:
+      // Power up status, CCS and 2.7-3.6V
+      sd_sim.response[0] = sd_sim_get_r1();
+      sd_sim.response[1] = sd_sim.idle ? 0 :
+        0x80 | (sd_sim.config.high_capacity ? 0x40 : 0);
+      sd_sim.response[2] = 0xff;
+      sd_sim.response[3] = 0x80;
+      sd_sim.response[4] = 0;
+      sd_sim_push_data(sd_sim.response, 5);
+      break;
+    case 59:
+      sd_sim.crc_enabled = argument & 0x1;
+      sd_sim_push_r1(sd_sim_get_r1());
+      break;
+    default:
+      sd_sim_push_r1(sd_sim_get_r1() | R1_ILLEGAL_COMMAND);
+  }
+}
+
+static void sd_sim_finish_write_block(void)
+{
+  crc_buffer_16 crc_buffer = { 0 };
+  crc_16_result crc = crc_buffer_calculate_crc_16(
+    &crc_buffer, sd_sim.write_buffer, sd_sim.block_length
+  );
+  uint8_t *received_crc = sd_sim.write_buffer + sd_sim.block_length;
+
+  sd_sim.input_state = sd_sim.multiple_write ?
+    SD_SIM_WRITE_TOKEN : SD_SIM_COMMAND;
+
+  if (sd_sim.crc_enabled && (received_crc[0] != (crc.i16 >> 8) ||
+    received_crc[1] != (crc.i16 & 0xff)))
+  {
+    sd_sim_statistics.crc_errors++;
+    sd_sim.data_response = 0xe0 | SD_DATA_RESPONSE_CRC_ERROR;
+    sd_sim_push_data(&sd_sim.data_response, 1);
+    return;
+  }
+
+  if (sd_sim.is_write_error_injected &&
+    sd_sim.blocks_before_write_error-- == 0)
+  {
+    sd_sim.is_write_error_injected = false;
+    sd_sim.data_response = 0xe0 | SD_DATA_RESPONSE_WRITE_ERROR;
+    sd_sim_push_data(&sd_sim.data_response, 1);
+    return;
+  }
+
+  memcpy(
+    sd_sim.config.storage + sd_sim.offset,
+    sd_sim.write_buffer,
+    sd_sim.block_length
+  );
+  sd_sim.offset += sd_sim.block_length;
+  sd_sim.written_blocks++;
+
+  sd_sim.data_response = 0xe0 | SD_DATA_RESPONSE_ACCEPTED;
+  sd_sim_push_data(&sd_sim.data_response, 1);
+  if (sd_sim.multiple_write && sd_sim.pre_erased_blocks)
+  {
+    sd_sim.pre_erased_blocks--;
+    sd_sim_push_wait(0x0, sd_sim.config.pre_erased_busy_ns);
+  }
+  else if (sd_sim.multiple_write && sd_sim.config.write_multiple_busy_ns)
+    sd_sim_push_wait(0x0, sd_sim.config.write_multiple_busy_ns);
+  else
+    sd_sim_push_wait(0x0, sd_sim.config.write_busy_ns);
+
+  // The next block of a multiple write would be out of range
+  if (sd_sim.multiple_write &&
+    sd_sim.offset + sd_sim.block_length > sd_sim_get_capacity())
+    sd_sim.multiple_write = false;
+}
+
+// Byte from the host
+static void sd_sim_process(const uint8_t data)
+{
+  switch (sd_sim.input_state)
+  {
+    case SD_SIM_COMMAND:
+      // '0' + '1' starts a command
+      if (sd_sim.command_length == 0 && (data & 0xc0) != 0x40)
+        return;
+
+      sd_sim.command[sd_sim.command_length++] = data;
+      if (sd_sim.command_length < sizeof(sd_sim.command))
+        return;
+
+      sd_sim.command_length = 0;
+      sd_sim_execute_command();
+      break;
+    case SD_SIM_WRITE_TOKEN:
+      if (data == 0xfd && sd_sim.multiple_write)
+      {
+        // Stop token: busy follows after one byte
+        sd_sim.input_state = SD_SIM_COMMAND;
+        sd_sim.pre_erased_blocks = 0;
+        sd_sim_push_fill(0xff, 1);
+        sd_sim_push_wait(0x0, sd_sim.config.write_busy_ns);
+      }
+      else if (data == (sd_sim.multiple_write ? 0xfc : 0xfe))
+      {
+        sd_sim.write_received = 0;
+        sd_sim.input_state = SD_SIM_WRITE_DATA;
+      }
+      break;
+    case SD_SIM_WRITE_DATA:
+      sd_sim.write_buffer[sd_sim.write_received++] = data;
+      if (sd_sim.write_received == sd_sim.block_length + 2)
+        sd_sim_finish_write_block();
+      break;
+  }
+}
+
+static uint8_t sd_sim_exchange_byte(const uint8_t data)
+{
+  sd_sim_statistics.bytes++;
+
+  // Without CS the card does not drive the line
+  if (!sd_sim.selected || sd_sim.config.is_absent)
+    return 0xff;
+
+  uint8_t received = sd_sim_pop();
+  sd_sim_process(data);
+
+  return received;
+}
+
+static void sd_sim_spend(const uint64_t time_ns)
+{
+  sd_sim.time_ns += time_ns;
+}
+
+static void sd_sim_call(void)
+{
+  sd_sim_statistics.calls++;
+  sd_sim_spend(sd_sim.config.call_overhead_ns);
+}
+
+#ifdef SD_USE_DMA
+
+// Moves the bytes that have been clocked by now
+static void sd_sim_async_progress(void)
+{
+  if (!sd_sim_async_active)
+    return;
+
+  uint64_t clocked = (sd_sim.time_ns - sd_sim_async.start_ns) /
+    sd_sim_get_byte_ns();
+  if (clocked > sd_sim_async.size)
+    clocked = sd_sim_async.size;
+
+  for (; sd_sim_async.done < clocked; sd_sim_async.done++)
+  {
+    uint8_t data = sd_sim_async.tx_data ?
+      sd_sim_async.tx_data[sd_sim_async.done] : 0xff;
+    uint8_t received = sd_sim_exchange_byte(data);
+
+    if (sd_sim_async.rx_data)
+      sd_sim_async.rx_data[sd_sim_async.done] = received;
+  }
+
+  if (sd_sim_async.done < sd_sim_async.size)
+    return;
+
+  sd_sim_async_active = false;
+  sd_card_dma_complete(sd_sim_async.hspi, SD_OK);
+}
+
+static sd_error sd_sim_async_start(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const tx_data,
+  uint8_t *const rx_data,
+  const uint16_t size
+)
+{
+  sd_sim_call();
+
+  // As HAL_SPI_TransmitReceive_DMA
+  if (size == 0)
+    return SD_ERROR;
+
+  sd_sim_async = (sd_sim_transfer) {
+    .hspi = hspi,
+    .tx_data = tx_data,
+    .rx_data = rx_data,
+    .size = size,
+    .start_ns = sd_sim.time_ns
+  };
+  sd_sim_async_active = true;
+
+  return SD_OK;
+}
+
+static sd_error sd_sim_receive_start(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t *const data,
+  const uint16_t size
+)
+{
+  return sd_sim_async_start(hspi, NULL, data, size);
+}
+
+static sd_error sd_sim_transmit_start(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const data,
+  const uint16_t size
+)
+{
+  return sd_sim_async_start(hspi, data, NULL, size);
+}
+
+static uint16_t sd_sim_get_remaining(SPI_HandleTypeDef *const hspi)
+{
+  sd_sim_spend(sd_sim.config.poll_ns);
+  sd_sim_async_progress();
+
+  return sd_sim_async.size - sd_sim_async.done;
+}
+
+static void sd_sim_abort(SPI_HandleTypeDef *const hspi)
+{
+  sd_sim_async_active = false;
+}
+
+#endif
+
+static sd_error sd_sim_exchange(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t tx_data,
+  uint8_t *const rx_data
+)
+{
+  sd_sim_call();
+  sd_sim_spend(sd_sim_get_byte_ns());
+  *rx_data = sd_sim_exchange_byte(tx_data);
+
+  return SD_OK;
+}
+
+static sd_error sd_sim_transmit(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const data,
+  const uint16_t size
+)
+{
+  sd_sim_call();
+
+  for (uint16_t i = 0; i < size; i++)
+  {
+    sd_sim_spend(sd_sim_get_byte_ns());
+    sd_sim_exchange_byte(data[i]);
+  }
+
+  return SD_OK;
+}
+
+static sd_error sd_sim_receive(
+  SPI_HandleTypeDef *const hspi,
+  uint8_t *const data,
+  const uint16_t size
+)
+{
+  sd_sim_call();
+
+  for (uint16_t i = 0; i < size; i++)
+  {
+    sd_sim_spend(sd_sim_get_byte_ns());
+    data[i] = sd_sim_exchange_byte(0xff);
+  }
+
+  return SD_OK;
+}
+
+static void sd_sim_select(void)
+{
+  sd_sim.selected = true;
+}
+
+static void sd_sim_deselect(void)
+{
+  sd_sim.selected = false;
+  sd_sim.command_length = 0;
+}
+
+static sd_error sd_sim_set_clock(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t max_clock
+)
+{
+  uint8_t index = 0;
+
+  while ((sd_sim.config.bus_clock >> (index + 1)) > max_clock)
+  {
+    if (index == SD_SIM_MAX_PRESCALER_INDEX)
+      return SD_INCORRECT_ARGUMENT;
+    index++;
+  }
+
+  sd_sim.prescaler_index = index;
+  return SD_OK;
+}
+
+static uint32_t sd_sim_get_clock(SPI_HandleTypeDef *const hspi)
+{
+  return sd_sim.config.bus_clock >> (sd_sim.prescaler_index + 1);
+}
+
+// Virtual time in ns: the host clock would not show the modeled bus
+static uint32_t sd_sim_get_timestamp(void)
+{
+  sd_sim_spend(sd_sim.config.poll_ns);
+#ifdef SD_USE_DMA
+  sd_sim_async_progress();
+#endif
+
+  return (uint32_t)sd_sim.time_ns;
+}
+
+static uint32_t sd_sim_get_timestamp_frequency(void)
+{
+  return 1000000000U;
+}
+
+// Variables -----------------------------------------------------------------
+
+SPI_HandleTypeDef *const sd_card_sim_hspi = &sd_sim_spi;
+
+const sd_transport sd_transport_sim = {
+  .exchange = sd_sim_exchange,
+  .transmit = sd_sim_transmit,
+  .receive = sd_sim_receive,
+#ifdef SD_USE_DMA
+  .receive_start = sd_sim_receive_start,
+  .transmit_start = sd_sim_transmit_start,
+  .get_remaining = sd_sim_get_remaining,
+  .abort = sd_sim_abort,
+#endif
+  .select = sd_sim_select,
+  .deselect = sd_sim_deselect,
+  .set_clock = sd_sim_set_clock,
+  .get_clock = sd_sim_get_clock,
+  .get_timestamp = sd_sim_get_timestamp,
+  .get_timestamp_frequency = sd_sim_get_timestamp_frequency
+};
+
+// Implementations -----------------------------------------------------------
+
+void sd_card_sim_init(const sd_sim_config *const config)
+{
+  uint64_t time_ns = sd_sim.time_ns;
+
+  sd_sim = (sd_sim_card) {
+    .config = *config,
+    .idle = true,
+    .init_polls_left = config->init_polls,
+    .block_length = SD_SIM_SECTOR_SIZE,
+    .prescaler_index = SD_SIM_MAX_PRESCALER_INDEX,
+    .time_ns = time_ns
+  };
+
+  if (sd_sim.config.bus_clock == 0)
+    sd_sim.config.bus_clock = SD_SIM_DEFAULT_BUS_CLOCK;
+  if (sd_sim.config.poll_ns == 0)
+    sd_sim.config.poll_ns = SD_SIM_DEFAULT_POLL_NS;
+
+#ifdef SD_USE_DMA
+  sd_sim_async_active = false;
+#endif
+}
+
+void sd_card_sim_get_stats(sd_sim_stats *const stats)
+{
+  *stats = sd_sim_statistics;
+  stats->time_ns = sd_sim.time_ns - sd_sim_stats_start_ns;
+}
+
+void sd_card_sim_reset_stats(void)
+{
+  sd_sim_statistics = (sd_sim_stats) { 0 };
+  sd_sim_stats_start_ns = sd_sim.time_ns;
+}
+
+uint64_t sd_card_sim_get_time_ns(void)
+{
+  return sd_sim.time_ns;
+}
+
+bool sd_card_sim_is_selected(void)
+{
+  return sd_sim.selected;
+}
+
+bool sd_card_sim_is_sending(void)
+{
+  return sd_sim.multiple_read;
+}
+
+void sd_card_sim_wait(const uint32_t time_ns)
+{
+  sd_sim_spend(time_ns);
+#ifdef SD_USE_DMA
+  sd_sim_async_progress();
+#endif
+}
+
+void sd_card_sim_inject_write_error(const uint32_t blocks_before)
+{
+  sd_sim.is_write_error_injected = true;
+  sd_sim.blocks_before_write_error = blocks_before;
+}
+
+void sd_card_sim_inject_read_error(const uint32_t blocks_before)
+{
+  sd_sim.is_read_error_injected = true;
+  sd_sim.blocks_before_read_error = blocks_before;
+}
+
+#endif
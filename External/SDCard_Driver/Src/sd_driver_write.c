@@ -1,4 +1,8 @@
 #include "sd_driver_write.h"
+#include "sd_driver_clock.h"
+#include "sd_driver_cache.h"
+#include "sd_driver_timeout.h"
+#include "sd_driver_profile.h"
 #include "crc-buffer.h"
 
 // Static functions ----------------------------------------------------------
@@ -10,32 +14,168 @@ static sd_error sd_card_transmit_data_block(
   const uint8_t start_token
 )
 {
-  crc_buffer_16 crc_buffer = { 0 };
-  uint8_t data_response = 0x0;
+  uint8_t crc[2] = { 0 };
   uint8_t busy_signal = 0;
 
-  crc_16_result crc_result = crc_buffer_calculate_crc_16(
-    &crc_buffer, (uint8_t*)data, data_size
+  sd_error status = sd_card_transmit_data_block_start(
+    hspi, data, data_size, start_token, crc
   );
+  status |= sd_card_transmit_data_block_finish(hspi, crc);
+  SD_PROFILE_START(timestamp);
+  status |= sd_card_wait_response(
+    hspi, &busy_signal, 0x0, sd_card_timeouts.write
+  );
+  SD_PROFILE_RECORD(SD_PROFILE_BUSY, timestamp);
 
-  sd_error status = sd_card_transmit_byte(hspi, &start_token);
-  status |= sd_card_transmit_bytes(hspi, data, data_size);
-  status |= sd_card_transmit_bytes(
-    hspi, (uint8_t*)&crc_result, sizeof(crc_16_result)
+  return status;
+}
+
+// CS remains selected on success
+static sd_error sd_card_open_multiple_write(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address
+)
+{
+  sd_command cmd_write_multiple_block = sd_card_get_cmd(25, address);
+  sd_r1_response r1 = { 0 };
+
+  SELECT_SD();
+  sd_error status = sd_card_send_cmd(hspi, &cmd_write_multiple_block);
+  status |= sd_card_receive_cmd_response(hspi, &r1, 1);
+
+  if (r1)
+    status = SD_TRANSMISSION_ERROR;
+  if (status)
+    DISELECT_SD();
+
+  return status;
+}
+
+// is_opened (can be NULL) - CMD25 was accepted
+static sd_error sd_card_write_blocks(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  const uint8_t *const data,
+  const uint32_t block_length,
+  const uint32_t number_of_blocks,
+  bool *const is_opened
+)
+{
+  sd_error status = sd_card_open_multiple_write(hspi, address);
+  if (is_opened)
+    *is_opened = (status == SD_OK);
+  if (status)
+    return status;
+
+  // The blocks after a failed one are not sent: the card counts
+  // only the blocks written without errors (ACMD22)
+  for (uint32_t i = 0; i < number_of_blocks && !status; i++)
+  {
+    // 0xfc - start token of multiple block write
+    status = sd_card_transmit_data_block(
+      hspi, data + (i * block_length), block_length, 0xfc
+    );
+  }
+
+  // The stop token is sent after an error too, so the card leaves
+  // the receive state
+  status |= sd_card_close_multiple_write(hspi);
+
+#ifdef SD_CACHE_SIZE
+  sd_card_cache_write(address, data, block_length, number_of_blocks, status);
+#endif
+  return status;
+}
+
+// Implementations -----------------------------------------------------------
+
+sd_error sd_card_close_multiple_write(SPI_HandleTypeDef *const hspi)
+{
+  uint8_t stop_token = 0xfd;
+  uint8_t busy_signal = 0;
+
+  sd_error status = sd_card_transmit_byte(hspi, &stop_token);
+  SD_PROFILE_START(timestamp);
+  // The busy signal does not appear immediately. This is not
+  // described in the documentation
+  status |= sd_card_wait_response(
+    hspi, &busy_signal, 0xff, sd_card_timeouts.command
+  );
+  status |= sd_card_wait_response(
+    hspi, &busy_signal, 0x0, sd_card_timeouts.write
   );
+  SD_PROFILE_RECORD(SD_PROFILE_BUSY, timestamp);
+
+  DISELECT_SD();
+  return status;
+}
+
+sd_error sd_card_transmit_data_block_start(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const data,
+  const uint16_t data_size,
+  const uint8_t start_token,
+  uint8_t *const crc
+)
+{
+  crc_buffer_16 crc_buffer = { 0 };
+  crc_16_result crc_result = { 0 };
+  sd_error status = SD_OK;
+  SD_PROFILE_START(timestamp);
+
+#ifdef SD_USE_DMA
+  status |= sd_card_transmit_byte(hspi, &start_token);
+  status |= sd_card_dma_transmit_start(hspi, data, data_size);
+  // The CRC is calculated while the data is moving
+  crc_result = crc_buffer_calculate_crc_16(
+    &crc_buffer, (uint8_t*)data, data_size
+  );
+  SD_PROFILE_RECORD(SD_PROFILE_CRC, timestamp);
+#else
+  crc_result = crc_buffer_calculate_crc_16(
+    &crc_buffer, (uint8_t*)data, data_size
+  );
+  SD_PROFILE_RECORD(SD_PROFILE_CRC, timestamp);
+  status |= sd_card_transmit_byte(hspi, &start_token);
+  status |= sd_card_transmit_bytes(hspi, data, data_size);
+  SD_PROFILE_RECORD(SD_PROFILE_DATA, timestamp);
+#endif
 
+  // CRC16 goes MSB first, in the calculated one the bytes are reversed
+  crc[0] = crc_result.i8[1];
+  crc[1] = crc_result.i8[0];
+
+  return status;
+}
+
+sd_error sd_card_transmit_data_block_finish(
+  SPI_HandleTypeDef *const hspi,
+  const uint8_t *const crc
+)
+{
+  uint8_t data_response = 0x0;
+  sd_error status = SD_OK;
+  SD_PROFILE_START(timestamp);
+
+#ifdef SD_USE_DMA
+  status |= sd_card_dma_wait(hspi);
+  SD_PROFILE_RECORD(SD_PROFILE_DATA, timestamp);
+#endif
+  status |= sd_card_transmit_bytes(hspi, crc, 2);
   status |= sd_card_receive_byte(hspi, &data_response);
-  status |= sd_card_wait_response(hspi, &busy_signal, 0x0);
+  SD_PROFILE_RECORD(SD_PROFILE_TOKEN, timestamp);
 
   switch (data_response & 0xf)
   {
     case SD_DATA_RESPONSE_CRC_ERROR:
+      sd_card_clock_report_crc(hspi, true);
       status = SD_CRC_ERROR;
       break;
     case SD_DATA_RESPONSE_WRITE_ERROR:
       status = SD_ERROR;
       break;
     case SD_DATA_RESPONSE_ACCEPTED:
+      sd_card_clock_report_crc(hspi, false);
       break;
     default:
       status |= SD_TRANSMISSION_ERROR;
@@ -44,8 +184,6 @@ static sd_error sd_card_transmit_data_block(
   return status;
 }
 
-// Implementations -----------------------------------------------------------
-
 sd_error sd_card_write_data(
   SPI_HandleTypeDef *const hspi,
   const uint32_t address,
@@ -57,12 +195,7 @@ sd_error sd_card_write_data(
   sd_r1_response r1 = { 0 };
 
   SELECT_SD();
-  sd_error status = (sd_error)HAL_SPI_Transmit(
-    hspi,
-    (uint8_t*)&cmd_write_block,
-    sizeof(cmd_write_block),
-    SD_TRANSMISSION_TIMEOUT
-  );
+  sd_error status = sd_card_send_cmd(hspi, &cmd_write_block);
   status |= sd_card_receive_cmd_response(hspi, &r1, 1);
 
   if (r1)
@@ -77,6 +210,31 @@ sd_error sd_card_write_data(
 
 end_write:
   DISELECT_SD();
+#ifdef SD_CACHE_SIZE
+  sd_card_cache_write(address, data, block_length, 1, status);
+#endif
+  return status;
+}
+
+sd_error sd_card_set_pre_erase_count(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t number_of_blocks
+)
+{
+  // Bits 22:0 - number of blocks
+  sd_command acmd_set_wr_blk_erase_count = sd_card_get_cmd(
+    23, number_of_blocks & 0x7fffff
+  );
+  sd_r1_response app_response = { 0 };
+  sd_r1_response r1 = { 0 };
+  sd_error status = SD_OK;
+
+  SEND_CMD(hspi, sd_cmd_app, app_response, status);
+  SEND_CMD(hspi, acmd_set_wr_blk_erase_count, r1, status);
+
+  if (app_response || r1)
+    status = SD_TRANSMISSION_ERROR;
+
   return status;
 }
 
@@ -88,43 +246,189 @@ sd_error sd_card_write_multiple_data(
   const uint32_t number_of_blocks
 )
 {
-  sd_command cmd_write_multiple_block = sd_card_get_cmd(25, address);
+#if SD_PRE_ERASE_THRESHOLD
+  if (number_of_blocks >= SD_PRE_ERASE_THRESHOLD)
+    return sd_card_write_multiple_data_pre_erase(
+      hspi, address, data, block_length, number_of_blocks
+    );
+#endif
+
+  return sd_card_write_blocks(
+    hspi, address, data, block_length, number_of_blocks, NULL
+  );
+}
+
+sd_error sd_card_write_multiple_data_pre_erase(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  const uint8_t *const data,
+  const uint32_t block_length,
+  const uint32_t number_of_blocks
+)
+{
+  // The hint is optional: the write goes on if the card rejects it
+  sd_card_set_pre_erase_count(hspi, number_of_blocks);
+
+  return sd_card_write_blocks(
+    hspi, address, data, block_length, number_of_blocks, NULL
+  );
+}
+
+sd_error sd_card_get_written_blocks(
+  SPI_HandleTypeDef *const hspi,
+  uint32_t *const number_of_blocks
+)
+{
+  sd_command acmd_send_num_wr_blocks = sd_card_get_cmd(22, 0);
+  sd_r1_response app_response = { 0 };
   sd_r1_response r1 = { 0 };
-  uint8_t stop_token = 0xfd;
-  uint8_t busy_signal = 0;
+  uint8_t written_blocks[4] = { 0 };
+  sd_error status = SD_OK;
+
+  SEND_CMD(hspi, sd_cmd_app, app_response, status);
 
   SELECT_SD();
-  sd_error status = (sd_error)HAL_SPI_Transmit(
-    hspi,
-    (uint8_t*)&cmd_write_multiple_block,
-    sizeof(cmd_write_multiple_block),
-    SD_TRANSMISSION_TIMEOUT
-  );
+  status |= sd_card_send_cmd(hspi, &acmd_send_num_wr_blocks);
   status |= sd_card_receive_cmd_response(hspi, &r1, 1);
 
-  if (r1)
+  if (app_response || r1)
     status = SD_TRANSMISSION_ERROR;
   if (status)
-    goto end_write;
+    goto end_get;
 
-  for (uint32_t i = 0; i < number_of_blocks; i++)
+  status |= sd_card_receive_data_block(
+    hspi, written_blocks, sizeof(written_blocks)
+  );
+  // MSB first
+  if (status == SD_OK)
   {
-    // 0xfc - start token of multiple block write
-    status |= sd_card_transmit_data_block(
-      hspi, data + (i * block_length), block_length, 0xfc
-    );
+    *number_of_blocks = ((uint32_t)written_blocks[0] << 24) |
+      ((uint32_t)written_blocks[1] << 16) |
+      ((uint32_t)written_blocks[2] << 8) | written_blocks[3];
   }
 
+end_get:
+  DISELECT_SD();
+  return status;
+}
+
+sd_error sd_card_write_multiple_data_resumable(
+  SPI_HandleTypeDef *const hspi,
+  const uint32_t address,
+  const uint8_t *const data,
+  const uint32_t block_length,
+  const uint32_t number_of_blocks,
+  uint32_t *const written_blocks
+)
+{
+  uint32_t first_block = *written_blocks;
+  uint32_t left_blocks = number_of_blocks - first_block;
+  uint32_t card_written_blocks = 0;
+  bool is_opened = false;
+
+  if (first_block > number_of_blocks)
+    return SD_INCORRECT_ARGUMENT;
+  if (left_blocks == 0)
+    return SD_OK;
+
+#if SD_PRE_ERASE_THRESHOLD
+  if (left_blocks >= SD_PRE_ERASE_THRESHOLD)
+    sd_card_set_pre_erase_count(hspi, left_blocks);
+#endif
+
+  sd_error status = sd_card_write_blocks(
+    hspi,
+    address + (first_block * sd_card_get_address_step(block_length)),
+    data + (first_block * block_length),
+    block_length,
+    left_blocks,
+    &is_opened
+  );
+  if (status == SD_OK)
+  {
+    *written_blocks = number_of_blocks;
+    return status;
+  }
+
+  // A rejected CMD25 wrote nothing, ACMD22 would count the previous
+  // write. Without the count the write is resumed from the same block
+  if (is_opened &&
+    sd_card_get_written_blocks(hspi, &card_written_blocks) == SD_OK &&
+    card_written_blocks <= left_blocks)
+    *written_blocks = first_block + card_written_blocks;
+
+  return status;
+}
+
+sd_error sd_card_write_session_begin(
+  SPI_HandleTypeDef *const hspi,
+  sd_write_session *const session,
+  const uint32_t address,
+  const uint32_t block_length
+)
+{
+  *session = (sd_write_session) {
+    .hspi = hspi,
+    .next_address = address,
+    .block_length = block_length,
+    .is_open = false
+  };
+
+  sd_error status = sd_card_open_multiple_write(hspi, address);
+  session->is_open = (status == SD_OK);
+
+  return status;
+}
+
+sd_error sd_card_write_session_append(
+  sd_write_session *const session,
+  const uint32_t address,
+  const uint8_t *const data
+)
+{
+  sd_error status = SD_OK;
+
+  // A gap in addresses closes the current CMD25 and opens a new one
+  if (session->is_open && address != session->next_address)
+    status |= sd_card_write_session_end(session);
   if (status)
-    goto end_write;
+    return status;
+  if (!session->is_open)
+  {
+    status |= sd_card_open_multiple_write(session->hspi, address);
+    if (status)
+      return status;
+    session->is_open = true;
+  }
 
-  status |= sd_card_transmit_byte(hspi, &stop_token);
-  // The busy signal does not appear immediately. This is not
-  // described in the documentation
-  status |= sd_card_wait_response(hspi, &busy_signal, 0xff);
-  status |= sd_card_wait_response(hspi, &busy_signal, 0x0);
+  // 0xfc - start token of multiple block write
+  status |= sd_card_transmit_data_block(
+    session->hspi, data, session->block_length, 0xfc
+  );
+#ifdef SD_CACHE_SIZE
+  sd_card_cache_write(address, data, session->block_length, 1, status);
+#endif
+
+  // The stop token is sent after an error too, so the card leaves
+  // the receive state
+  if (status)
+  {
+    status |= sd_card_close_multiple_write(session->hspi);
+    session->is_open = false;
+    return status;
+  }
+
+  session->next_address = address + 
+    sd_card_get_address_step(session->block_length);
 
-end_write:
-  DISELECT_SD();
   return status;
 }
+
+sd_error sd_card_write_session_end(sd_write_session *const session)
+{
+  if (!session->is_open)
+    return SD_OK;
+
+  session->is_open = false;
+  return sd_card_close_multiple_write(session->hspi);
+}